@@ -9,9 +9,31 @@ tests(i32 argc, char *argv[])
     char *output = "tests";
 
     bld_sa_t cc = {0};
-    BLD_SA_PUSH(cc, "src/tests.c", "src/metacz.c", "src/interpreter.c");
+    BLD_SA_PUSH(cc, "src/tests.c", "src/metacz.c", "src/interpreter.c", "src/jit.c", "src/aot.c", "src/pool.c", "src/sampler.c",
+                "src/tracer.c", "src/tier.c", "src/stack.c");
     BLD_SA_PUSH(cc, "-I.", "-Isrc", "-o", output, BLD_WARNINGS);
-    BLD_SA_PUSH(cc, "-D_DEBUG");
+    BLD_SA_PUSH(cc, "-D_DEBUG", "-ldl", "-pthread");
+
+    u32 res = bld_cc_params((const char **)cc.data, cc.count);
+    if (res != 0)
+        return res;
+
+    return bld_run_program(output);
+}
+
+// The model with its functions compiled ahead of time into `model_aot.so`.
+i32
+aot(i32 argc, char *argv[])
+{
+    char *output = "model";
+
+    bld_sa_t cc = {0};
+    BLD_SA_PUSH(cc, "src/main.c", "src/metacz.c", "src/interpreter.c", "src/aot.c");
+    BLD_SA_PUSH(cc, "-I.", "-Isrc", "-o", output, BLD_WARNINGS);
+    BLD_SA_PUSH(cc, "-DMODEL_AOT", "-ldl");
+    if (bld_contains("debug", argc, argv)) {
+        BLD_SA_PUSH(cc, "-D_DEBUG");
+    }
 
     u32 res = bld_cc_params((const char **)cc.data, cc.count);
     if (res != 0)
@@ -28,6 +50,9 @@ main(i32 argc, char *argv[])
     if (bld_contains("test", argc, argv))
         return tests(argc, argv);
 
+    if (bld_contains("aot", argc, argv))
+        return aot(argc, argv);
+
     char *output = "model";
 
     bld_sa_t cc = {0};
@@ -36,6 +61,10 @@ main(i32 argc, char *argv[])
     if (bld_contains("debug", argc, argv)) {
         BLD_SA_PUSH(cc, "-D_DEBUG");
     }
+    // Opcode histogram, printed once the model ran.
+    if (bld_contains("stats", argc, argv)) {
+        BLD_SA_PUSH(cc, "-DVM_STATS");
+    }
 
     u32 res = bld_cc_params((const char **)cc.data, cc.count);
     if (res != 0)
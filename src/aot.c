@@ -0,0 +1,441 @@
+#include "aot.h"
+
+#include <string.h>
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/* Every function becomes plain C over `int32_t` locals:
+ *   inputs `i<n>`, variables `v<n>` and the evaluation stack `s[]`.
+ * The stack depth is static so every access is `s[constant]` and the C compiler
+ * keeps them in registers, there is no allocator on our side.
+ */
+
+static b32
+aot_is_int(type_ref_t type_ref)
+{
+    return type_ref.tag == data_type_Basic && type_ref.index_for_tag == data_basic_Int;
+}
+
+b32
+aot_is_supported(cz_t *cz, func_ref_t func_ref)
+{
+    abs_func_t *func = cz->abs_funcs.data + func_ref.func_index;
+
+    for (u32 i = 0; i < func->in_count; ++i) {
+        if (!aot_is_int(cz->abs_func_ins.data[func->in_offset + i]))
+            return false;
+    }
+    for (u32 i = 0; i < func->out_count; ++i) {
+        if (!aot_is_int(cz->abs_func_outs.data[func->out_offset + i]))
+            return false;
+    }
+    for (u32 i = 0; i < func->var_count; ++i) {
+        if (!aot_is_int(cz->abs_func_vars.data[func->var_offset + i]))
+            return false;
+    }
+
+    abs_code_t *code = cz->abs_code.data + func->code_offset;
+
+    for (u32 inst_index = 0; inst_index < func->code_count; inst_index += abs_inst_size(code[inst_index].inst)) {
+        switch (code[inst_index].inst) {
+            case abs_inst_LoadImm: {
+                immediate_t immediate = cz->immediates.data[code[inst_index + 1].index];
+
+                if (!aot_is_int(immediate.type) || immediate.data_size != sizeof(i32))
+                    return false;
+            } break;
+
+            case abs_inst_Add:      /* fallthrough */
+            case abs_inst_Sub:      /* fallthrough */
+            case abs_inst_LoadIn:   /* fallthrough */
+            case abs_inst_LoadVar:  /* fallthrough */
+            case abs_inst_StoreIn:  /* fallthrough */
+            case abs_inst_StoreVar: /* fallthrough */
+            case abs_inst_Label:    /* fallthrough */
+            case abs_inst_Ret:      /* fallthrough */
+            case abs_inst_JmpUc:    /* fallthrough */
+            case abs_inst_JmpNz:    /* fallthrough */
+            case abs_inst_JmpZe:    /* fallthrough */
+            case abs_inst_JmpEq:    /* fallthrough */
+            case abs_inst_JmpNe:    /* fallthrough */
+            case abs_inst_JmpLt:    /* fallthrough */
+            case abs_inst_JmpGt:    /* fallthrough */
+            case abs_inst_JmpLe:    /* fallthrough */
+            case abs_inst_JmpGe:
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// Depth at a label, `CZ_NO_ID` until a jump or fallthrough reaches it.
+static u32 *
+aot_label_depth(aot_t *aot, u32 label_index)
+{
+    for (u32 i = 0; i < aot->labels.count; ++i) {
+        if (aot->labels.data[i].label_index == label_index)
+            return &aot->labels.data[i].depth;
+    }
+
+    aot_label_t label = { .label_index = label_index, .depth = CZ_NO_ID };
+    dck_stretchy_push(aot->labels, label);
+
+    return &aot->labels.data[aot->labels.count - 1].depth;
+}
+
+static void
+aot_emit_return(FILE *out, abs_func_t *func, u32 func_index, u32 depth)
+{
+    ASSERT(depth >= func->out_count);
+    (void)depth;
+
+    if (func->out_count == 0) {
+        fprintf(out, "    return;\n");
+        return;
+    }
+
+    fprintf(out, "    return (cz_f%u_out_t) { ", func_index);
+    for (u32 i = 0; i < func->out_count; ++i) {
+        fprintf(out, "%ss[%u]", i ? ", " : "", i);
+    }
+    fprintf(out, " };\n");
+}
+
+static b32
+aot_emit_func(aot_t *aot, cz_t *cz, FILE *out, func_ref_t func_ref)
+{
+    u32 func_index = func_ref.func_index;
+    abs_func_t *func = cz->abs_funcs.data + func_index;
+
+    if (!aot_is_supported(cz, func_ref)) {
+        fprintf(stderr, "aot: cz_f%u has values other than ints or calls\n", func_index);
+        return false;
+    }
+
+    // Signature.
+    if (func->out_count != 0) {
+        fprintf(out, "typedef struct\n{\n");
+        for (u32 i = 0; i < func->out_count; ++i) {
+            fprintf(out, "    int32_t o%u;\n", i);
+        }
+        fprintf(out, "} cz_f%u_out_t;\n\n", func_index);
+
+        fprintf(out, "cz_f%u_out_t\n", func_index);
+    }
+    else {
+        fprintf(out, "void\n");
+    }
+
+    fprintf(out, "cz_f%u(", func_index);
+    for (u32 i = 0; i < func->in_count; ++i) {
+        fprintf(out, "%sint32_t i%u", i ? ", " : "", i);
+    }
+    fprintf(out, "%s)\n{\n", func->in_count ? "" : "void");
+
+    for (u32 i = 0; i < func->var_count; ++i) {
+        fprintf(out, "    int32_t v%u = 0;\n", i);
+    }
+
+    // Every push takes at least two words of abstract code.
+    fprintf(out, "    int32_t s[%u];\n\n", func->code_count / 2 + 1);
+
+    // Body.
+    aot->labels.count = 0;
+
+    u32 depth = 0;
+    b32 unreachable = false;
+
+    for (u32 inst_index = 0; inst_index < func->code_count; ++inst_index) {
+        abs_code_t code = cz->abs_code.data[func->code_offset + inst_index];
+
+        switch (code.inst) {
+            case abs_inst_Add: /* fallthrough */
+            case abs_inst_Sub: {
+                ASSERT(depth >= 2);
+                depth--;
+
+                // Through unsigned so that overflow wraps like it does in the interpreter.
+                fprintf(out, "    s[%u] = (int32_t)((uint32_t)s[%u] %c (uint32_t)s[%u]);\n",
+                        depth - 1, depth - 1, code.inst == abs_inst_Add ? '+' : '-', depth);
+            } break;
+
+            case abs_inst_LoadIn:  /* fallthrough */
+            case abs_inst_LoadVar: /* fallthrough */
+            case abs_inst_StoreIn: /* fallthrough */
+            case abs_inst_StoreVar: {
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 local_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+
+                b32 is_in = code.inst == abs_inst_LoadIn || code.inst == abs_inst_StoreIn;
+                char kind  = is_in ? 'i' : 'v';
+                u32  index = local_index - (is_in ? func->in_base : func->var_base);
+
+                if (code.inst == abs_inst_LoadIn || code.inst == abs_inst_LoadVar) {
+                    fprintf(out, "    s[%u] = %c%u;\n", depth++, kind, index);
+                }
+                else {
+                    ASSERT(depth >= 1);
+                    fprintf(out, "    %c%u = s[%u];\n", kind, index, --depth);
+                }
+            } break;
+
+            case abs_inst_LoadImm: {
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 imm_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+                immediate_t immediate = cz->immediates.data[imm_index];
+
+                i32 imm;
+                memcpy(&imm, cz->imm_data.data + immediate.data_offset, sizeof(i32));
+
+                // INT32_MIN has no literal of its own.
+                fprintf(out, "    s[%u] = (int32_t)%dLL;\n", depth++, imm);
+            } break;
+
+            case abs_inst_Label: {
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 label_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+
+                u32 *label_depth = aot_label_depth(aot, label_index);
+                if (*label_depth == CZ_NO_ID) {
+                    *label_depth = depth;
+                }
+                else {
+                    ASSERT(unreachable || *label_depth == depth);
+                    depth = *label_depth;
+                }
+
+                fprintf(out, "l%u:;\n", label_index);
+                unreachable = false;
+            } break;
+
+            case abs_inst_JmpUc: /* fallthrough */
+            case abs_inst_JmpNz: /* fallthrough */
+            case abs_inst_JmpZe: /* fallthrough */
+            case abs_inst_JmpEq: /* fallthrough */
+            case abs_inst_JmpNe: /* fallthrough */
+            case abs_inst_JmpLt: /* fallthrough */
+            case abs_inst_JmpGt: /* fallthrough */
+            case abs_inst_JmpLe: /* fallthrough */
+            case abs_inst_JmpGe: {
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 label_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+
+                static const char *conditions[] = { "!=", "==", "==", "!=", "<", ">", "<=", ">=" };
+
+                switch (code.inst) {
+                    case abs_inst_JmpUc:
+                        fprintf(out, "    goto l%u;\n", label_index);
+                        unreachable = true;
+                        break;
+
+                    case abs_inst_JmpNz: /* fallthrough */
+                    case abs_inst_JmpZe:
+                        ASSERT(depth >= 1);
+                        depth--;
+                        fprintf(out, "    if (s[%u] %s 0) goto l%u;\n",
+                                depth, conditions[code.inst - abs_inst_JmpNz], label_index);
+                        break;
+
+                    default:
+                        ASSERT(depth >= 2);
+                        depth -= 2;
+                        fprintf(out, "    if (s[%u] %s s[%u]) goto l%u;\n",
+                                depth, conditions[code.inst - abs_inst_JmpNz], depth + 1, label_index);
+                        break;
+                }
+
+                u32 *label_depth = aot_label_depth(aot, label_index);
+                ASSERT(*label_depth == CZ_NO_ID || *label_depth == depth);
+                *label_depth = depth;
+            } break;
+
+            case abs_inst_Ret: {
+                if (!unreachable) {
+                    aot_emit_return(out, func, func_index, depth);
+                }
+                unreachable = true;
+            } break;
+
+            default:
+                UNREACHABLE(); // Rejected by `aot_is_supported`.
+        }
+    }
+
+    if (!unreachable) {
+        aot_emit_return(out, func, func_index, depth);
+    }
+
+    fprintf(out, "}\n\n");
+
+    // Frame wrapper, inputs and outputs are packed `int32_t`s at offset 0.
+    fprintf(out, "void\ncz_f%u_frame(uint8_t *frame)\n{\n", func_index);
+    if (func->in_count != 0) {
+        fprintf(out, "    int32_t in[%u];\n", func->in_count);
+        fprintf(out, "    memcpy(in, frame, sizeof(in));\n");
+    }
+
+    fprintf(out, "    ");
+    if (func->out_count != 0) {
+        fprintf(out, "cz_f%u_out_t out = ", func_index);
+    }
+    fprintf(out, "cz_f%u(", func_index);
+    for (u32 i = 0; i < func->in_count; ++i) {
+        fprintf(out, "%sin[%u]", i ? ", " : "", i);
+    }
+    fprintf(out, ");\n");
+
+    if (func->out_count != 0) {
+        fprintf(out, "    memcpy(frame, &out, sizeof(out));\n");
+    }
+    else {
+        fprintf(out, "    (void)frame;\n");
+    }
+    fprintf(out, "}\n\n");
+
+    return true;
+}
+
+b32
+aot_add(aot_t *aot, cz_t *cz, func_ref_t func_ref)
+{
+    if (!aot_is_supported(cz, func_ref))
+        return false;
+
+    dck_stretchy_push(aot->funcs, func_ref);
+    return true;
+}
+
+b32
+aot_emit(aot_t *aot, cz_t *cz, const char *c_path)
+{
+    FILE *out = fopen(c_path, "w");
+    if (!out) {
+        fprintf(stderr, "aot: can't open '%s' for writing\n", c_path);
+        return false;
+    }
+
+    fprintf(out, "// Generated, do not edit.\n\n");
+    fprintf(out, "#include <stdint.h>\n#include <string.h>\n\n");
+
+    b32 is_emitted = true;
+
+    for (u32 i = 0; i < aot->funcs.count && is_emitted; ++i) {
+        is_emitted = aot_emit_func(aot, cz, out, aot->funcs.data[i]);
+    }
+
+    return fclose(out) == 0 && is_emitted;
+}
+
+b32
+aot_build(const char *c_path, const char *so_path)
+{
+    // Straight to the compiler, no shell in between to split the paths.
+    char *argv[] = { "cc", (char *)c_path, "-O2", "-shared", "-fPIC", "-o", (char *)so_path, NULL };
+
+    pid_t pid;
+    if (posix_spawnp(&pid, "cc", NULL, NULL, argv, environ) != 0) {
+        fprintf(stderr, "aot: can't run cc\n");
+        return false;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid)
+        return false;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+b32
+aot_load(aot_t *aot, cz_t *cz, const char *so_path)
+{
+    void *handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "aot: %s\n", dlerror());
+        return false;
+    }
+
+    if (aot->handle) {
+        dlclose(aot->handle);
+    }
+    aot->handle = handle;
+
+    aot->loaded.count = 0;
+    dck_stretchy_reserve(aot->loaded, cz->abs_funcs.count);
+    memset(aot->loaded.data, 0, cz->abs_funcs.count * sizeof(*aot->loaded.data));
+    aot->loaded.count = cz->abs_funcs.count;
+
+    for (u32 i = 0; i < aot->funcs.count; ++i) {
+        u32 func_index = aot->funcs.data[i].func_index;
+        abs_func_t *func = cz->abs_funcs.data + func_index;
+
+        char name[32];
+        aot_func_t *loaded = aot->loaded.data + func_index;
+
+        snprintf(name, sizeof(name), "cz_f%u", func_index);
+        loaded->entry = dlsym(handle, name);
+
+        snprintf(name, sizeof(name), "cz_f%u_frame", func_index);
+        void *frame_entry = dlsym(handle, name);
+        memcpy(&loaded->frame_entry, &frame_entry, sizeof(frame_entry));
+
+        if (!loaded->entry || !loaded->frame_entry) {
+            fprintf(stderr, "aot: '%s' is missing '%s'\n", so_path, name);
+            return false;
+        }
+
+        loaded->out_size   = func->out_count * sizeof(i32);
+        loaded->frame_size = func->in_count * sizeof(i32);
+        if (loaded->frame_size < loaded->out_size) {
+            loaded->frame_size = loaded->out_size;
+        }
+    }
+
+    return true;
+}
+
+aot_func_t *
+aot_lookup(aot_t *aot, func_ref_t func_ref)
+{
+    if (func_ref.func_index >= aot->loaded.count)
+        return NULL;
+
+    aot_func_t *func = aot->loaded.data + func_ref.func_index;
+    return func->entry ? func : NULL;
+}
+
+void
+aot_execute(aot_func_t *func, vm_thread_t *thread)
+{
+    ASSERT(func->frame_entry);
+
+    thread->bp = 0;
+    thread->popped_pos = 0;
+
+    if (thread->memory.count < func->frame_size) {
+        dck_stretchy_reserve(thread->memory, func->frame_size - thread->memory.count);
+        thread->memory.count = func->frame_size;
+    }
+
+    func->frame_entry(thread->memory.data + thread->bp);
+}
+
+void
+aot_free(aot_t *aot)
+{
+    if (aot->handle) {
+        dlclose(aot->handle);
+    }
+
+    free(aot->funcs.data);
+    free(aot->loaded.data);
+    free(aot->labels.data);
+
+    *aot = (aot_t) {0};
+}
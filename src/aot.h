@@ -0,0 +1,70 @@
+#ifndef AOT_H_
+#define AOT_H_
+
+#include "metacz.h"
+#include "interpreter.h"
+
+/*
+ * Ahead of time backend, abs functions as C compiled into a shared object.
+ */
+
+// Takes the frame with the inputs at offset 0, leaves the outputs there.
+typedef void (*aot_frame_entry_t)(u8 *frame);
+
+typedef struct
+{
+    // `cz_f<func_index>`, takes the inputs as `int32_t` parameters and returns a struct of the outputs.
+    void *entry;
+    // `cz_f<func_index>_frame`, wrapper over `entry` for `VM_PUSH` / `VM_GET`.
+    aot_frame_entry_t frame_entry;
+
+    u32 frame_size;
+    u32 out_size;
+} aot_func_t;
+
+typedef struct
+{
+    u32 label_index;
+    u32 depth;
+} aot_label_t;
+
+typedef struct
+{
+    // Functions that go into the shared object.
+    dck_stretchy_t (func_ref_t, u32) funcs;
+    // Indexed by `func_ref_t.func_index`, `entry == NULL` when not loaded.
+    dck_stretchy_t (aot_func_t, u32) loaded;
+
+    dck_stretchy_t (aot_label_t, u32) labels;
+
+    void *handle;
+} aot_t;
+
+// Whether `aot_emit` handles the function: only ints and no calls.
+b32
+aot_is_supported(cz_t *cz, func_ref_t func_ref);
+
+// False, and nothing added, for functions `aot_is_supported` doesn't take.
+b32
+aot_add(aot_t *aot, cz_t *cz, func_ref_t func_ref);
+
+b32
+aot_emit(aot_t *aot, cz_t *cz, const char *c_path);
+
+// Compiles the emitted source with `cc -O2`, `so_path` must contain a '/' to be loaded from there.
+b32
+aot_build(const char *c_path, const char *so_path);
+
+b32
+aot_load(aot_t *aot, cz_t *cz, const char *so_path);
+
+aot_func_t *
+aot_lookup(aot_t *aot, func_ref_t func_ref);
+
+void
+aot_execute(aot_func_t *func, vm_thread_t *thread);
+
+void
+aot_free(aot_t *aot);
+
+#endif // AOT_H_
@@ -1,5 +1,7 @@
 #include "interpreter.h"
 
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
 
 static void
@@ -43,6 +45,7 @@ vm_alloc_object(vm_compiler_t *compiler, cz_t *cz, type_ref_t type_ref)
         .base_offset  = compiler->allocated_memory,
         .alignment    = allocation.alignment,
         .size         = allocation.size,
+        .type_ref     = type_ref,
     };
 
     compiler->allocated_memory += allocation.size;
@@ -60,8 +63,11 @@ vm_align(u32 value, u32 alignment)
     return value;
 }
 
+static void
+vm_flush_objects(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz);
+
 static vm_object_t
-vm_push_type(vm_t *vm, vm_compiler_t *compiler, cz_t *cz, type_ref_t type_ref)
+vm_push_type(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz, type_ref_t type_ref)
 {
     u32 prev_sp = compiler->allocated_memory;
 
@@ -69,8 +75,15 @@ vm_push_type(vm_t *vm, vm_compiler_t *compiler, cz_t *cz, type_ref_t type_ref)
 
     u32 remainder = compiler->allocated_memory % allocation.alignment;
     if (remainder != 0) {
-        dck_stretchy_push(vm->code, vm_inst_IncSP);
-        dck_stretchy_push(vm->code, allocation.alignment - remainder);
+        if (compiler->mode == vm_compile_mode_Cached) {
+            vm_flush_objects(program, compiler, cz);
+        }
+
+        // Register code addresses the stack statically, there is no stack pointer to move.
+        if (compiler->mode != vm_compile_mode_Register) {
+            dck_stretchy_push(program->code, vm_inst_IncSP);
+            dck_stretchy_push(program->code, allocation.alignment - remainder);
+        }
         compiler->allocated_memory += allocation.alignment - remainder;
     }
 
@@ -79,12 +92,18 @@ vm_push_type(vm_t *vm, vm_compiler_t *compiler, cz_t *cz, type_ref_t type_ref)
         .base_offset  = compiler->allocated_memory,
         .alignment    = allocation.alignment,
         .size         = allocation.size,
+        .type_ref     = type_ref,
+        .location     = vm_location_Slot,
     };
 
     dck_stretchy_push(compiler->objects, object);
 
     compiler->allocated_memory += allocation.size;
 
+    if (compiler->max_memory < compiler->allocated_memory) {
+        compiler->max_memory = compiler->allocated_memory;
+    }
+
     return object;
 }
 
@@ -98,527 +117,4181 @@ vm_pop_object(vm_compiler_t *compiler, cz_t *cz)
     return object;
 }
 
-u32
-vm_compile(vm_t *vm, vm_compiler_t *compiler, cz_t *cz, func_ref_t func_ref)
+// A value computed in its output slot, it takes no room on the stack.
+static vm_object_t
+vm_push_result(vm_compiler_t *compiler, cz_t *cz, type_ref_t type_ref, u32 dst)
 {
-    compiler->allocated_memory   = 0;
-    compiler->objects.count      = 0;
-    compiler->jump_patches.count = 0;
-    compiler->labels.count       = 0;
+    vm_allocation_t allocation = vm_type_to_allocation(cz, type_ref);
+
+    vm_object_t object = {
+        .prev_mem_off = compiler->allocated_memory,
+        .base_offset  = dst,
+        .alignment    = allocation.alignment,
+        .size         = allocation.size,
+        .type_ref     = type_ref,
+        .location     = vm_location_Slot,
+    };
 
-    u32 code_offset = vm->code.count;
+    dck_stretchy_push(compiler->objects, object);
 
-    abs_func_t *func = cz->abs_funcs.data + func_ref.func_index;
+    return object;
+}
 
-    u32 object_offset = compiler->objects.count;
-    (void)object_offset; // TODO: Useful when working with nested functions (closures).
+static void
+vm_emit_imm(vm_program_t *program, cz_t *cz, u32 imm_index)
+{
+    immediate_t immediate = cz->immediates.data[imm_index];
+    u32 size = (u32)immediate.data_size;
 
-    u32 input_offset = compiler->objects.count;
+    dck_stretchy_push(program->code, size);
 
-    for (u32 i = 0; i < func->in_count; ++i) {
-        type_ref_t type = cz->abs_func_ins.data[func->in_offset + i];
-        vm_object_t object = vm_alloc_object(compiler, cz, type);
-        dck_stretchy_push(compiler->objects, object);
+    u32 imm_inst_size = (size + sizeof(vm_inst_t) - 1) / sizeof(vm_inst_t);
+    dck_stretchy_reserve(program->code, imm_inst_size);
+
+    u8 *imm_ptr = (u8 *)(cz->imm_data.data + immediate.data_offset);
+
+    memcpy(program->code.data + program->code.count, imm_ptr, size);
+
+    program->code.count += imm_inst_size;
+}
+
+/* Register code leaves loaded locals and immediates where they are.
+ * They get copied into their own stack slot only once something needs them there.
+ */
+static void
+vm_materialize(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz, vm_object_t *object)
+{
+    switch (object->location) {
+        case vm_location_Slot:
+            return;
+
+        case vm_location_Local:
+            dck_stretchy_push(program->code, vm_inst_MemMove);
+            compiler->last_dst = program->code.count;
+            dck_stretchy_push(program->code, object->base_offset);
+            dck_stretchy_push(program->code, object->location_index);
+            dck_stretchy_push(program->code, object->size);
+            break;
+
+        case vm_location_Imm:
+            dck_stretchy_push(program->code, vm_inst_MoveImmReg);
+            compiler->last_dst = program->code.count;
+            dck_stretchy_push(program->code, object->base_offset);
+            vm_emit_imm(program, cz, object->location_index);
+            break;
     }
 
-    // TODO: return address + base pointer + Closure base pointers.
+    object->location = vm_location_Slot;
+}
 
-    u32 variable_offset = compiler->objects.count;
+static u32
+vm_operand(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz, vm_object_t *object)
+{
+    if (object->location == vm_location_Local)
+        return object->location_index;
 
-    for (u32 i = 0; i < func->var_count; ++i) {
-        type_ref_t type = cz->abs_func_vars.data[func->var_offset + i];
-        vm_object_t object = vm_alloc_object(compiler, cz, type);
-        dck_stretchy_push(compiler->objects, object);
+    vm_materialize(program, compiler, cz, object);
+
+    return object->base_offset;
+}
+
+static void
+vm_cache_fill(vm_program_t *program, vm_compiler_t *compiler, u32 count)
+{
+    for (; compiler->cached_count < count; ++(compiler->cached_count)) {
+        dck_stretchy_push(program->code, vm_inst_FillA);
     }
+}
 
-    u32 eval_offset = compiler->objects.count;
+static void
+vm_cache_spill(vm_program_t *program, vm_compiler_t *compiler, u32 count)
+{
+    for (; compiler->cached_count > count; --(compiler->cached_count)) {
+        dck_stretchy_push(program->code, vm_inst_SpillA);
+    }
+}
 
-    for (u32 inst_index = 0; inst_index < func->code_count; ++inst_index) {
-        abs_code_t code = cz->abs_code.data[func->code_offset + inst_index];
+static void
+vm_flush_objects(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz)
+{
+    if (compiler->mode == vm_compile_mode_Cached) {
+        vm_cache_spill(program, compiler, 0);
+        return;
+    }
 
-        vm_object_t object;
-        vm_object_t object_r;
-        vm_object_t object_l;
+    if (compiler->mode != vm_compile_mode_Register)
+        return;
 
-        switch (code.inst) {
-            case abs_inst_Add: /* fallthrough */
-            case abs_inst_Sub: {
-                // NOTE: Types need to be tilable.
+    for (u32 i = compiler->eval_offset; i < compiler->objects.count; ++i) {
+        vm_materialize(program, compiler, cz, compiler->objects.data + i);
+    }
+}
 
-                ASSERT(eval_offset + 2 <= compiler->allocated_memory);
-                
-                object_r = vm_pop_object(compiler, cz);
-                ASSERT(object_r.type_ref.tag == data_type_Basic); // TODO:
-                ASSERT(object_r.type_ref.index_for_tag == data_basic_Int);
+// Back to the evaluation stack a forward jump left, for code only reachable through jumps.
+static void
+vm_restore_objects(vm_compiler_t *compiler, vm_patch_t patch)
+{
+    u32 object_count = patch.object_count;
 
-                object_l = vm_pop_object(compiler, cz);
-                ASSERT(object_l.type_ref.tag == data_type_Basic); // TODO:
-                ASSERT(object_l.type_ref.index_for_tag == data_basic_Int);
+    compiler->objects.count = compiler->eval_offset;
+    for (u32 i = compiler->eval_offset; i < object_count; ++i) {
+        dck_stretchy_push(compiler->objects, compiler->patch_objects.data[patch.object_offset + i - compiler->eval_offset]);
+    }
 
-                if (code.inst == abs_inst_Add) {
-                    dck_stretchy_push(vm->code, vm_inst_AddInt);
-                }
-                else {
-                    dck_stretchy_push(vm->code, vm_inst_SubInt);
-                }
+    if (object_count > compiler->eval_offset) {
+        vm_object_t top = compiler->objects.data[object_count - 1];
+        compiler->allocated_memory = top.base_offset + top.size;
+    }
+    else {
+        compiler->allocated_memory = compiler->locals_size;
+    }
+}
 
-                vm_push_type(vm, compiler, cz, object_l.type_ref);
-            } break;
+static void
+vm_emit_jump_offset(vm_program_t *program, vm_compiler_t *compiler, u32 label_index)
+{
+    for (u32 i = 0; i < compiler->labels.count; ++i) {
+        vm_patch_t patch = compiler->labels.data[i];
 
-            case abs_inst_LoadIn: /* fallthrough */
-            case abs_inst_LoadVar: {
-                // TODO: Make work for closures.
+        if (patch.label_index == label_index) {
+            ASSERT(patch.object_count == compiler->objects.count);
 
-                ASSERT(inst_index + 1 < func->code_count);
-                u32 local_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+            i32 rel_offset = (i32)patch.absolute_offset - (i32)(program->code.count + 1);
+            dck_stretchy_push(program->code, *((u32*)(&rel_offset)));
+            return;
+        }
+    }
 
-                if (code.inst == abs_inst_LoadIn) {
-                    object = compiler->objects.data[input_offset + local_index - func->in_base];
-                }
-                else {
-                    object = compiler->objects.data[variable_offset + local_index - func->var_base];
-                }
+    u32 object_offset = compiler->patch_objects.count;
+    for (u32 i = compiler->eval_offset; i < compiler->objects.count; ++i) {
+        dck_stretchy_push(compiler->patch_objects, compiler->objects.data[i]);
+    }
 
-                vm_push_type(vm, compiler, cz, object.type_ref);
+    dck_stretchy_push(compiler->jump_patches, (vm_patch_t) {
+        .label_index     = label_index,
+        .absolute_offset = program->code.count,
+        .object_count    = compiler->objects.count,
+        .object_offset   = object_offset,
+    });
+    dck_stretchy_push(program->code, 0xDEADC0DE);
+}
 
-                dck_stretchy_push(vm->code, vm_inst_Load);
-                dck_stretchy_push(vm->code, object.base_offset);
-                dck_stretchy_push(vm->code, object.size);
-            } break;
+static b32
+vm_is_local_load(abs_inst_t inst)
+{
+    return inst == abs_inst_LoadIn || inst == abs_inst_LoadVar;
+}
 
-            case abs_inst_LoadImm: {
-                ASSERT(inst_index + 1 < func->code_count);
+static vm_object_t
+vm_local_object(vm_compiler_t *compiler, abs_func_t *func, abs_inst_t inst, u32 local_index)
+{
+    if (inst == abs_inst_LoadIn || inst == abs_inst_StoreIn) {
+        return compiler->objects.data[compiler->input_offset + local_index - func->in_base];
+    }
 
-                u32 imm_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
-                immediate_t immediate = cz->immediates.data[imm_index];
+    return compiler->objects.data[compiler->variable_offset + local_index - func->var_base];
+}
 
-                object = vm_push_type(vm, compiler, cz, immediate.type);
+static b32
+vm_is_int_imm(cz_t *cz, u32 imm_index)
+{
+    immediate_t immediate = cz->immediates.data[imm_index];
 
-                dck_stretchy_push(vm->code, vm_inst_LoadImm);
-                dck_stretchy_push(vm->code, object.size);
+    return immediate.type.tag == data_type_Basic
+        && immediate.type.index_for_tag == data_basic_Int;
+}
 
-                u32 imm_inst_size = (object.size + sizeof(vm_inst_t) - 1) / sizeof(vm_inst_t);
-                dck_stretchy_reserve(vm->code, imm_inst_size);
+/* Superinstructions.
+ * Looks at the abstract code starting at `inst_index` and if it starts with one of the
+ * common sequences, emits the fused instruction for it.
+ * Returns the number of abstract code words consumed, zero when nothing matched.
+ * Labels are abstract instructions of their own, so nothing gets fused across them.
+ */
+static u32
+vm_compile_fused(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz, abs_func_t *func, u32 inst_index)
+{
+    abs_code_t *code = cz->abs_code.data + func->code_offset + inst_index;
+    u32 remaining = func->code_count - inst_index;
 
-                u8 *imm_ptr = (u8 *)(cz->imm_data.data + immediate.data_offset);
+    if (remaining < 4 || !vm_is_local_load(code[0].inst))
+        return 0;
 
-                memcpy(vm->code.data + vm->code.count, imm_ptr, object.size);
+    vm_object_t object_l = vm_local_object(compiler, func, code[0].inst, code[1].index);
 
-                vm->code.count += imm_inst_size;
-            } break;
+    if (object_l.type_ref.tag != data_type_Basic || object_l.type_ref.index_for_tag != data_basic_Int)
+        return 0;
 
-            case abs_inst_StoreIn: /* fallthrough */
-            case abs_inst_StoreVar: {
-                // TODO: Make work for closures.
+    // Load; Store
+    if (code[2].inst == abs_inst_StoreIn || code[2].inst == abs_inst_StoreVar) {
+        vm_object_t object_dst = vm_local_object(compiler, func, code[2].inst, code[3].index);
 
-                ASSERT(inst_index + 1 < func->code_count);
-                u32 local_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+        dck_stretchy_push(program->code, vm_inst_LoadStore);
+        dck_stretchy_push(program->code, object_dst.base_offset);
+        dck_stretchy_push(program->code, object_l.base_offset);
+        dck_stretchy_push(program->code, object_l.size);
+        return 4;
+    }
 
-                if (code.inst == abs_inst_LoadIn) {
-                    object = compiler->objects.data[input_offset + local_index - func->in_base];
-                }
-                else {
-                    object = compiler->objects.data[variable_offset + local_index - func->var_base];
-                }
+    if (remaining < 5)
+        return 0;
 
-                vm_object_t stack_object = compiler->objects.data[--(compiler->objects.count)];
+    b32 is_imm;
+    u32 operand;
 
-                dck_stretchy_push(vm->code, vm_inst_Store);
-                dck_stretchy_push(vm->code, object.base_offset);
-                dck_stretchy_push(vm->code, stack_object.size);
-                compiler->allocated_memory -= stack_object.size;
-            } break;
+    if (vm_is_local_load(code[2].inst)) {
+        vm_object_t object_r = vm_local_object(compiler, func, code[2].inst, code[3].index);
 
-            case abs_inst_Label: {
-                ASSERT(inst_index + 1 < func->code_count);
-                u32 label_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+        if (object_r.type_ref.tag != data_type_Basic || object_r.type_ref.index_for_tag != data_basic_Int)
+            return 0;
 
-                for (u32 i = 0; i < compiler->jump_patches.count;) {
-                    vm_patch_t patch = compiler->jump_patches.data[i];
+        is_imm  = false;
+        operand = object_r.base_offset;
+    }
+    else if (code[2].inst == abs_inst_LoadImm && vm_is_int_imm(cz, code[3].index)) {
+        immediate_t immediate = cz->immediates.data[code[3].index];
 
-                    if (patch.label_index == label_index) {
-                        // Offset by one cuz the IP points to the next instruction, not current.
-                        i32 rel_offset = (i32)(vm->code.count) - ((i32)patch.absolute_offset + 1);
-                        vm->code.data[patch.absolute_offset] = *((u32*)&rel_offset);
+        is_imm  = true;
+        operand = *(u32 *)(cz->imm_data.data + immediate.data_offset);
+    }
+    else {
+        return 0;
+    }
 
-                        compiler->jump_patches.data[i] = compiler->jump_patches.data[--(compiler->jump_patches.count)];
-                    }
-                    else {
-                        ++i;
-                    }
-                }
+    abs_inst_t inst = code[4].inst;
 
-                dck_stretchy_push(compiler->labels, (vm_patch_t) {
-                    .label_index     = label_index,
-                    .absolute_offset = vm->code.count,
-                });
-            } break;
+    // Load; Load|LoadImm; Add|Sub
+    // Cached code keeps the result in a register instead.
+    if ((inst == abs_inst_Add || inst == abs_inst_Sub) && compiler->mode != vm_compile_mode_Cached) {
+        u32 dst = compiler->result_dsts.data[inst_index + 4];
+
+        if (dst != CZ_NO_ID && !is_imm) {
+            vm_push_result(compiler, cz, object_l.type_ref, dst);
+
+            dck_stretchy_push(program->code, inst == abs_inst_Add ? vm_inst_AddIntReg : vm_inst_SubIntReg);
+            dck_stretchy_push(program->code, dst);
+            dck_stretchy_push(program->code, object_l.base_offset);
+            dck_stretchy_push(program->code, operand);
+            return 5;
+        }
+
+        vm_push_type(program, compiler, cz, object_l.type_ref);
+
+        if (is_imm) {
+            dck_stretchy_push(program->code, inst == abs_inst_Add ? vm_inst_AddIntLI : vm_inst_SubIntLI);
+        }
+        else {
+            dck_stretchy_push(program->code, inst == abs_inst_Add ? vm_inst_AddIntLL : vm_inst_SubIntLL);
+        }
+
+        dck_stretchy_push(program->code, object_l.base_offset);
+        dck_stretchy_push(program->code, operand);
+        return 5;
+    }
+
+    // Load; Load|LoadImm; Jmp<cmp>
+    if (inst >= abs_inst_JmpEq && inst <= abs_inst_JmpGe) {
+        ASSERT(remaining >= 6);
+
+        vm_flush_objects(program, compiler, cz);
+
+        vm_inst_t base = is_imm ? vm_inst_JmpIntEqLI : vm_inst_JmpIntEqLL;
+        dck_stretchy_push(program->code, base + (inst - abs_inst_JmpEq));
+        dck_stretchy_push(program->code, object_l.base_offset);
+        dck_stretchy_push(program->code, operand);
+
+        vm_emit_jump_offset(program, compiler, code[5].index);
+        return 6;
+    }
+
+    return 0;
+}
+
+/* The arguments are the top of the stack and already in the callee's input layout, so they
+ * become the callee's frame as they are. Only when an alignment in between differs they get
+ * copied above the stack into that layout first.
+ * Pops the arguments and returns the frame offset of the callee's base pointer.
+ */
+static u32
+vm_emit_call_args(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz, abs_func_t *callee, u32 *in_size)
+{
+    ASSERT(compiler->objects.count - compiler->eval_offset >= callee->in_count);
+
+    vm_object_t *args = compiler->objects.data + compiler->objects.count - callee->in_count;
+
+    u32 base = callee->in_count > 0 ? args[0].base_offset : compiler->allocated_memory;
+    u32 size = 0;
+    u32 max_alignment = 1;
+    b32 is_in_place = true;
+
+    for (u32 i = 0; i < callee->in_count; ++i) {
+        vm_allocation_t allocation = vm_type_to_allocation(cz, cz->abs_func_ins.data[callee->in_offset + i]);
+
+        size = vm_align(size, allocation.alignment);
+        is_in_place &= args[i].base_offset == base + size;
+        size += allocation.size;
+
+        if (max_alignment < allocation.alignment) {
+            max_alignment = allocation.alignment;
+        }
+    }
+
+    // The outputs are left at the same base.
+    for (u32 i = 0; i < callee->out_count; ++i) {
+        vm_allocation_t allocation = vm_type_to_allocation(cz, cz->abs_func_outs.data[callee->out_offset + i]);
+
+        if (max_alignment < allocation.alignment) {
+            max_alignment = allocation.alignment;
+        }
+    }
+
+    is_in_place &= base % max_alignment == 0;
+
+    if (!is_in_place) {
+        u32 new_base = vm_align(compiler->allocated_memory, max_alignment);
+
+        if (compiler->mode != vm_compile_mode_Register) {
+            dck_stretchy_push(program->code, vm_inst_IncSP);
+            dck_stretchy_push(program->code, new_base + size - compiler->allocated_memory);
+        }
+
+        if (compiler->max_memory < new_base + size) {
+            compiler->max_memory = new_base + size;
+        }
+
+        u32 offset = 0;
+        for (u32 i = 0; i < callee->in_count; ++i) {
+            offset = vm_align(offset, args[i].alignment);
+
+            dck_stretchy_push(program->code, vm_inst_MemMove);
+            dck_stretchy_push(program->code, new_base + offset);
+            dck_stretchy_push(program->code, args[i].base_offset);
+            dck_stretchy_push(program->code, args[i].size);
+
+            offset += args[i].size;
+        }
+
+        base = new_base;
+    }
+
+    compiler->objects.count -= callee->in_count;
+    compiler->allocated_memory = base;
+
+    *in_size = size;
+    return base;
+}
+
+static void
+vm_emit_call_target(vm_program_t *program, func_ref_t func_ref, u32 call_offset)
+{
+    // The latest compiled version, so a recompiled function is what new calls go to.
+    for (u32 i = program->functions.count; i-- > 0;) {
+        vm_function_t *function = program->functions.data + i;
+
+        if (function->func_ref.func_index == func_ref.func_index) {
+            dck_stretchy_push(program->code, function->code_offset);
+            return;
+        }
+    }
+
+    dck_stretchy_push(program->call_patches, (vm_call_patch_t) {
+        .func_ref    = func_ref,
+        .call_offset = call_offset,
+    });
+    dck_stretchy_push(program->code, CZ_NO_ID);
+}
+
+static b32
+vm_is_cond_jump(abs_inst_t inst);
+
+// Whether nothing but jumps and labels stand between `inst_index` and the return.
+static b32
+vm_reaches_ret(cz_t *cz, abs_func_t *func, u32 inst_index)
+{
+    abs_code_t *code = cz->abs_code.data + func->code_offset;
+
+    // Bounded so a jump cycle can't keep us here.
+    for (u32 steps = 0; steps < func->code_count && inst_index < func->code_count; ++steps) {
+        switch (code[inst_index].inst) {
+            case abs_inst_Ret:
+                return true;
+
+            case abs_inst_Label:
+                inst_index += 2;
+                break;
 
-            case abs_inst_JmpGe: /* fallthrough */
-            case abs_inst_JmpLe: /* fallthrough */
-            case abs_inst_JmpGt: /* fallthrough */
-            case abs_inst_JmpLt: /* fallthrough */
-            case abs_inst_JmpNe: /* fallthrough */
-            case abs_inst_JmpEq:
-                object_l = vm_pop_object(compiler, cz);
-                ASSERT(object_l.type_ref.tag == data_type_Basic); // TODO:
-                ASSERT(object_l.type_ref.index_for_tag == data_basic_Int);
-                /* fallthrough */
-            case abs_inst_JmpZe: /* fallthrough */
-            case abs_inst_JmpNz:
-                object_r = vm_pop_object(compiler, cz);
-                ASSERT(object_r.type_ref.tag == data_type_Basic); // TODO:
-                ASSERT(object_r.type_ref.index_for_tag == data_basic_Int);
-                /* fallthrough */
             case abs_inst_JmpUc: {
-                vm_inst_t jmp_inst = vm_inst_JmpUc + (code.inst - abs_inst_JmpUc);
-                dck_stretchy_push(vm->code, jmp_inst);
+                u32 label_index = code[inst_index + 1].index;
 
-                ASSERT(inst_index + 1 < func->code_count);
-                u32 label_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+                for (inst_index = 0; inst_index < func->code_count; inst_index += abs_inst_size(code[inst_index].inst)) {
+                    if (code[inst_index].inst == abs_inst_Label && code[inst_index + 1].index == label_index)
+                        break;
+                }
+            } break;
+
+            default:
+                return false;
+        }
+    }
+
+    return false;
+}
+
+/* A call is in tail position when it reaches the return right away and leaves the outputs in
+ * the layout the function itself returns them in.
+ */
+static b32
+vm_is_tail_call(cz_t *cz, abs_func_t *func, abs_func_t *callee, u32 inst_index)
+{
+    if (callee->out_count != func->out_count)
+        return false;
+
+    for (u32 i = 0; i < func->out_count; ++i) {
+        type_ref_t callee_type = cz->abs_func_outs.data[callee->out_offset + i];
+        type_ref_t type        = cz->abs_func_outs.data[func->out_offset + i];
+
+        if (callee_type.tag != type.tag || callee_type.index_for_tag != type.index_for_tag)
+            return false;
+    }
+
+    return vm_reaches_ret(cz, func, inst_index);
+}
+
+static b32
+vm_ranges_overlap(u32 a, u32 a_size, u32 b, u32 b_size)
+{
+    return a < b + b_size && b < a + a_size;
+}
+
+// Unconditional jumps that reach the return get compiled as the return itself, they don't count.
+static b32
+vm_is_jump_target(cz_t *cz, abs_func_t *func, u32 label_index)
+{
+    abs_code_t *code = cz->abs_code.data + func->code_offset;
+
+    for (u32 i = 0; i < func->code_count; i += abs_inst_size(code[i].inst)) {
+        abs_inst_t inst = code[i].inst;
+
+        if ((inst == abs_inst_JmpUc || vm_is_cond_jump(inst)) && code[i + 1].index == label_index
+         && (inst != abs_inst_JmpUc || !vm_reaches_ret(cz, func, i)))
+            return true;
+    }
+
+    return false;
+}
+
+// Where the output `out_index` is returned, packed from the base of the frame.
+static u32
+vm_out_offset(cz_t *cz, abs_func_t *func, u32 out_index, u32 *size)
+{
+    u32 offset = 0;
+
+    for (u32 i = 0; i <= out_index; ++i) {
+        vm_allocation_t allocation = vm_type_to_allocation(cz, cz->abs_func_outs.data[func->out_offset + i]);
+
+        offset = vm_align(offset, allocation.alignment);
+        *size  = allocation.size;
+
+        if (i < out_index) {
+            offset += allocation.size;
+        }
+    }
+
+    return offset;
+}
+
+#define VM_LOCAL_READ    1
+#define VM_LOCAL_WRITTEN 2
+
+/* Goes backwards over `compiler->run_insts`, straight line code ending in a return, keeping track
+ * of how deep the stack gets below where each value was pushed. Values nothing pops before the return
+ * are results, their output slot is theirs when no later instruction touches the input or variable
+ * it overlaps.
+ */
+static void
+vm_find_run_results(vm_compiler_t *compiler, cz_t *cz, abs_func_t *func)
+{
+    abs_code_t *code = cz->abs_code.data + func->code_offset;
+    u32 local_count = func->in_count + func->var_count;
+
+    compiler->local_uses.count = 0;
+    for (u32 i = 0; i < local_count; ++i) {
+        dck_stretchy_push(compiler->local_uses, 0);
+    }
+
+    // Counted from the bottom of the evaluation stack.
+    u32 depth = func->out_count;
+    u32 low   = depth;
+
+    for (u32 i = compiler->run_insts.count; i-- > 0;) {
+        u32 inst_index = compiler->run_insts.data[i];
+        abs_inst_t inst = code[inst_index].inst;
+
+        b32 is_store = inst == abs_inst_StoreIn || inst == abs_inst_StoreVar;
+        u32 pops     = inst == abs_inst_Add || inst == abs_inst_Sub ? 2 : is_store ? 1 : 0;
+
+        depth = depth - (is_store ? 0 : 1) + pops;
+
+        u32 local = CZ_NO_ID;
+        if (inst == abs_inst_LoadIn || inst == abs_inst_StoreIn) {
+            local = code[inst_index + 1].index - func->in_base;
+        }
+        else if (inst == abs_inst_LoadVar || inst == abs_inst_StoreVar) {
+            local = func->in_count + code[inst_index + 1].index - func->var_base;
+        }
+
+        u32 index = depth - pops;
+
+        if (!is_store && index < low) {
+            u32 size;
+            u32 dst = vm_out_offset(cz, func, index, &size);
+
+            // Loading a local onto itself writes nothing, it only mustn't change before the return.
+            vm_object_t *object = local != CZ_NO_ID ? compiler->objects.data + compiler->input_offset + local : NULL;
+            b32 is_in_place = object && object->base_offset == dst && object->size == size;
+
+            b32 is_free = dst + size <= compiler->locals_size;
+            for (u32 j = 0; j < local_count && is_free; ++j) {
+                vm_object_t other = compiler->objects.data[compiler->input_offset + j];
+                u8 uses = compiler->local_uses.data[j] & (is_in_place ? VM_LOCAL_WRITTEN : ~0);
+
+                is_free = uses == 0 || !vm_ranges_overlap(dst, size, other.base_offset, other.size);
+            }
+
+            if (is_free) {
+                compiler->result_dsts.data[inst_index] = dst;
+            }
+        }
+
+        if (low > index) {
+            low = index;
+        }
+
+        if (local != CZ_NO_ID) {
+            compiler->local_uses.data[local] |= is_store ? VM_LOCAL_WRITTEN : VM_LOCAL_READ;
+        }
+    }
+}
+
+/* Fills `compiler->result_dsts` with the output slot of every instruction that can compute its value
+ * straight into it. Only code from the last label something jumps to or the last call on is looked at,
+ * anything earlier gets moved into place by the epilogue.
+ */
+static void
+vm_find_results(vm_compiler_t *compiler, cz_t *cz, abs_func_t *func)
+{
+    abs_code_t *code = cz->abs_code.data + func->code_offset;
+
+    compiler->result_dsts.count = 0;
+    for (u32 i = 0; i < func->code_count; ++i) {
+        dck_stretchy_push(compiler->result_dsts, CZ_NO_ID);
+    }
+
+    compiler->run_insts.count = 0;
+
+    for (u32 inst_index = 0; inst_index < func->code_count; inst_index += abs_inst_size(code[inst_index].inst)) {
+        switch (code[inst_index].inst) {
+            case abs_inst_Add:      /* fallthrough */
+            case abs_inst_Sub:      /* fallthrough */
+            case abs_inst_LoadIn:   /* fallthrough */
+            case abs_inst_LoadVar:  /* fallthrough */
+            case abs_inst_LoadImm:  /* fallthrough */
+            case abs_inst_StoreIn:  /* fallthrough */
+            case abs_inst_StoreVar:
+                dck_stretchy_push(compiler->run_insts, inst_index);
+                break;
+
+            case abs_inst_Label:
+                if (compiler->run_insts.count > 0 && vm_is_jump_target(cz, func, code[inst_index + 1].index)) {
+                    compiler->run_insts.count = 0;
+                }
+                break;
+
+            case abs_inst_JmpUc:
+                if (vm_reaches_ret(cz, func, inst_index)) {
+                    vm_find_run_results(compiler, cz, func);
+                }
+                compiler->run_insts.count = 0;
+                break;
+
+            case abs_inst_Ret:
+                vm_find_run_results(compiler, cz, func);
+                compiler->run_insts.count = 0;
+                break;
+
+            default:
+                compiler->run_insts.count = 0;
+                break;
+        }
+    }
+}
+
+#undef VM_LOCAL_READ
+#undef VM_LOCAL_WRITTEN
+
+// Register code copies what still refers to the output slot out before anything gets written to it.
+static void
+vm_clear_result_slot(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz, u32 dst, u32 size)
+{
+    if (compiler->mode != vm_compile_mode_Register)
+        return;
+
+    for (u32 i = compiler->eval_offset; i < compiler->objects.count; ++i) {
+        vm_object_t *alias = compiler->objects.data + i;
+
+        if (alias->location == vm_location_Local && vm_ranges_overlap(alias->location_index, alias->size, dst, size)) {
+            vm_materialize(program, compiler, cz, alias);
+        }
+    }
+}
+
+// Whether writing `size` bytes at `dst` would clobber the source of another pending result.
+static b32
+vm_result_clobbers(vm_compiler_t *compiler, u32 self, u32 dst, u32 size)
+{
+    for (u32 i = 0; i < compiler->result_moves.count; ++i) {
+        vm_result_move_t *move = compiler->result_moves.data + i;
+
+        if (i != self && move->src != CZ_NO_ID && vm_ranges_overlap(dst, size, move->src, move->object.size))
+            return true;
+    }
+
+    return false;
+}
+
+/* Moves the results that weren't computed in their output slot there.
+ * Register code copies loaded locals and immediates in from where they are instead of going
+ * through their own slot first. The outputs overlap the inputs, so nothing is written over a value
+ * another result still needs, cycles go through a slot above the frame. Stack code only ever moves
+ * its results down, which never makes one.
+ */
+static void
+vm_emit_result_moves(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz)
+{
+    compiler->result_moves.count = 0;
+
+    u32 dst = 0;
+    for (u32 i = compiler->eval_offset; i < compiler->objects.count; ++i) {
+        vm_object_t object = compiler->objects.data[i];
+        dst = vm_align(dst, object.alignment);
+
+        u32 src = object.location == vm_location_Local ? object.location_index
+                : object.location == vm_location_Imm   ? CZ_NO_ID
+                                                       : object.base_offset;
+        if (src != dst) {
+            dck_stretchy_push(compiler->result_moves, ((vm_result_move_t) {
+                .object = object,
+                .dst    = dst,
+                .src    = src,
+            }));
+        }
+
+        dst += object.size;
+    }
+
+    while (compiler->result_moves.count > 0) {
+        u32 index = CZ_NO_ID;
+
+        for (u32 i = 0; i < compiler->result_moves.count && index == CZ_NO_ID; ++i) {
+            vm_result_move_t move = compiler->result_moves.data[i];
+
+            if (!vm_result_clobbers(compiler, i, move.dst, move.object.size)) {
+                index = i;
+            }
+        }
+
+        if (index == CZ_NO_ID) {
+            // Every result is in the way of another, one with a source moves out of the frame first.
+            vm_result_move_t *move = compiler->result_moves.data;
+            while (move->src == CZ_NO_ID) {
+                move++;
+            }
+            u32 scratch = vm_align(compiler->max_memory, move->object.alignment);
+
+            dck_stretchy_push(program->code, vm_inst_MemMove);
+            dck_stretchy_push(program->code, scratch);
+            dck_stretchy_push(program->code, move->src);
+            dck_stretchy_push(program->code, move->object.size);
+
+            move->src = scratch;
+            compiler->max_memory = scratch + move->object.size;
+            continue;
+        }
+
+        vm_result_move_t move = compiler->result_moves.data[index];
+        compiler->result_moves.data[index] = compiler->result_moves.data[--(compiler->result_moves.count)];
+
+        if (move.src == CZ_NO_ID) {
+            dck_stretchy_push(program->code, vm_inst_MoveImmReg);
+            dck_stretchy_push(program->code, move.dst);
+            vm_emit_imm(program, cz, move.object.location_index);
+        }
+        else {
+            dck_stretchy_push(program->code, vm_inst_MemMove);
+            dck_stretchy_push(program->code, move.dst);
+            dck_stretchy_push(program->code, move.src);
+            dck_stretchy_push(program->code, move.object.size);
+        }
+    }
+
+    if (compiler->max_memory < dst) {
+        compiler->max_memory = dst;
+    }
+}
+
+/* The caller hands over the base of the callee's frame, where it put the arguments, as the base of
+ * the outputs. Results end up packed from there on and the caller's stack goes on right after them.
+ */
+static void
+vm_emit_epilogue(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz)
+{
+    // TODO: Copy the base pointer and return address to the top of the stack.
+
+    // Cached results go to their stack slots first.
+    vm_cache_spill(program, compiler, 0);
+
+    vm_emit_result_moves(program, compiler, cz);
+    dck_stretchy_push(program->code, vm_inst_Ret);
+}
+
+static u32
+vm_inst_size(const vm_program_t *program, u32 ip);
+
+static void
+vm_decode(vm_program_t *program, u32 code_offset);
+
+static b32
+vm_is_branch(vm_inst_t inst);
+
+static b32
+vm_is_cond_jump(abs_inst_t inst)
+{
+    return inst >= abs_inst_JmpNz && inst <= abs_inst_JmpGe;
+}
+
+static abs_inst_t
+vm_invert_jump(abs_inst_t inst)
+{
+    switch (inst) {
+        case abs_inst_JmpNz: return abs_inst_JmpZe;
+        case abs_inst_JmpZe: return abs_inst_JmpNz;
+        case abs_inst_JmpEq: return abs_inst_JmpNe;
+        case abs_inst_JmpNe: return abs_inst_JmpEq;
+        case abs_inst_JmpLt: return abs_inst_JmpGe;
+        case abs_inst_JmpGe: return abs_inst_JmpLt;
+        case abs_inst_JmpGt: return abs_inst_JmpLe;
+        case abs_inst_JmpLe: return abs_inst_JmpGt;
+
+        default: UNREACHABLE();
+    }
+
+    UNREACHABLE();
+}
+
+static u32
+vm_block_of(vm_compiler_t *compiler, u32 inst_index)
+{
+    u32 lo = 0;
+    u32 hi = compiler->blocks.count;
+
+    while (hi - lo > 1) {
+        u32 mid = lo + (hi - lo) / 2;
+
+        if (compiler->blocks.data[mid].start <= inst_index) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static u32
+vm_block_of_label(vm_compiler_t *compiler, u32 label_index)
+{
+    for (u32 i = 0; i < compiler->blocks.count; ++i) {
+        if (compiler->blocks.data[i].label_index == label_index)
+            return i;
+    }
+
+    UNREACHABLE();
+}
+
+static void
+vm_layout_push(vm_compiler_t *compiler, cz_t *cz, abs_inst_t inst, u32 operand, u32 inst_index)
+{
+    dck_stretchy_push(cz->abs_code, (abs_code_t) { .inst = inst });
+    dck_stretchy_push(cz->abs_code, (abs_code_t) { .index = operand });
+    dck_stretchy_push(compiler->layout_map, inst_index);
+    dck_stretchy_push(compiler->layout_map, inst_index);
+}
+
+/* Walks the new order, deciding which jumps stay, flip or get added.
+ * The first pass only marks the blocks that need a label, the second writes the code.
+ */
+static void
+vm_layout_emit(vm_compiler_t *compiler, cz_t *cz, abs_func_t *func, b32 emit)
+{
+    const abs_code_t *code = cz->abs_code.data + func->code_offset;
+
+    for (u32 position = 0; position < compiler->layout_order.count; ++position) {
+        u32 block_index = compiler->layout_order.data[position];
+        vm_block_t *block = compiler->blocks.data + block_index;
+
+        u32 next = position + 1 < compiler->layout_order.count ? compiler->layout_order.data[position + 1] : CZ_NO_ID;
+        u32 fall = block_index + 1 < compiler->blocks.count ? block_index + 1 : CZ_NO_ID;
+
+        if (emit) {
+            if (block->is_target && code[block->start].inst != abs_inst_Label) {
+                vm_layout_push(compiler, cz, abs_inst_Label, block->label_index, block->start);
+            }
+
+            for (u32 i = block->start; i < block->last; ++i) {
+                dck_stretchy_push(cz->abs_code, code[i]);
+                dck_stretchy_push(compiler->layout_map, i);
+            }
+        }
+
+        abs_inst_t inst = code[block->last].inst;
+        b32 keep = true;
+
+        if (vm_is_cond_jump(inst)) {
+            u32 target = vm_block_of_label(compiler, code[block->last + 1].index);
+
+            if (next == target && next != fall) {
+                // Hot path falls through to the target, jump away to the cold side instead.
+                compiler->blocks.data[fall].is_target = true;
+                if (emit) {
+                    vm_layout_push(compiler, cz, vm_invert_jump(inst), compiler->blocks.data[fall].label_index, block->last);
+                }
+                continue;
+            }
+        }
+        else if (inst == abs_inst_JmpUc) {
+            keep = vm_block_of_label(compiler, code[block->last + 1].index) != next;
+        }
+
+        if (emit && keep) {
+            for (u32 i = block->last; i < block->end; ++i) {
+                dck_stretchy_push(cz->abs_code, code[i]);
+                dck_stretchy_push(compiler->layout_map, block->last);
+            }
+        }
+
+        b32 falls_through = inst != abs_inst_JmpUc && inst != abs_inst_Ret;
+
+        if (falls_through && fall != CZ_NO_ID && fall != next) {
+            compiler->blocks.data[fall].is_target = true;
+            if (emit) {
+                vm_layout_push(compiler, cz, abs_inst_JmpUc, compiler->blocks.data[fall].label_index, block->last);
+            }
+        }
+    }
+}
+
+/* Lays `func` out hot path first into scratch space at the end of `cz->abs_code`.
+ * False when the profile never ran it, it's compiled as recorded then.
+ */
+static b32
+vm_layout_blocks(vm_compiler_t *compiler, cz_t *cz, func_ref_t func_ref, abs_func_t *laid_out)
+{
+    const vm_program_t *profiled = compiler->layout_program;
+    const vm_profile_t *profile  = compiler->layout_profile;
+
+    abs_func_t *func = cz->abs_funcs.data + func_ref.func_index;
+    const abs_code_t *code = cz->abs_code.data + func->code_offset;
+
+    compiler->blocks.count       = 0;
+    compiler->layout_order.count = 0;
+    compiler->layout_map.count   = 0;
+
+    u32 next_label = func->label_count;
+
+    for (u32 inst_index = 0; inst_index < func->code_count;) {
+        vm_block_t block = {
+            .start       = inst_index,
+            .label_index = code[inst_index].inst == abs_inst_Label ? code[inst_index + 1].index : next_label++,
+        };
+
+        // Up to the next label, a jump or the return.
+        do {
+            abs_inst_t inst = code[inst_index].inst;
+
+            block.last  = inst_index;
+            inst_index += abs_inst_size(inst);
+
+            if ((inst >= abs_inst_JmpUc && inst <= abs_inst_JmpGe) || inst == abs_inst_Ret)
+                break;
+        } while (inst_index < func->code_count && code[inst_index].inst != abs_inst_Label);
+
+        block.end = inst_index;
+        dck_stretchy_push(compiler->blocks, block);
+    }
+
+    b32 has_counts = false;
+
+    for (u32 ip = 0; ip < profile->counts.count; ip += vm_inst_size(profiled, ip)) {
+        u64 count = profile->counts.data[ip];
+        if (count == 0)
+            continue;
+
+        vm_abs_loc_t loc = vm_find_abs_loc(profiled, ip);
+        if (loc.func_index != func_ref.func_index)
+            continue;
+
+        has_counts = true;
+
+        vm_block_t *block = compiler->blocks.data + vm_block_of(compiler, loc.inst_index);
+        if (block->heat < count) {
+            block->heat = count;
+        }
+
+        // Fused and deferred jumps map to their first operand, still in the same block.
+        if (vm_is_branch(profiled->code.data[ip]) && vm_is_cond_jump(code[block->last].inst)) {
+            block->taken     += profile->taken.data[ip];
+            block->not_taken += count - profile->taken.data[ip];
+        }
+    }
+
+    if (!has_counts)
+        return false;
+
+    for (u32 current = 0; current != CZ_NO_ID;) {
+        vm_block_t *block = compiler->blocks.data + current;
+        block->is_placed = true;
+        dck_stretchy_push(compiler->layout_order, current);
+
+        abs_inst_t inst = code[block->last].inst;
+        u32 fall = current + 1 < compiler->blocks.count ? current + 1 : CZ_NO_ID;
+        u32 next = CZ_NO_ID;
+
+        if (vm_is_cond_jump(inst)) {
+            u32 target = vm_block_of_label(compiler, code[block->last + 1].index);
+
+            u32 hot  = block->taken > block->not_taken ? target : fall;
+            u32 cold = hot == target ? fall : target;
+
+            if (!compiler->blocks.data[hot].is_placed) {
+                next = hot;
+            }
+            else if (!compiler->blocks.data[cold].is_placed) {
+                next = cold;
+            }
+        }
+        else if (inst == abs_inst_JmpUc) {
+            u32 target = vm_block_of_label(compiler, code[block->last + 1].index);
+
+            if (!compiler->blocks.data[target].is_placed) {
+                next = target;
+            }
+        }
+        else if (inst != abs_inst_Ret && fall != CZ_NO_ID && !compiler->blocks.data[fall].is_placed) {
+            next = fall;
+        }
+
+        if (next == CZ_NO_ID) {
+            // Hottest block left, the cold ones keep their recorded order at the end.
+            for (u32 i = 0; i < compiler->blocks.count; ++i) {
+                if (compiler->blocks.data[i].is_placed)
+                    continue;
+
+                if (next == CZ_NO_ID || compiler->blocks.data[i].heat > compiler->blocks.data[next].heat) {
+                    next = i;
+                }
+            }
+        }
+
+        current = next;
+    }
+
+    vm_layout_emit(compiler, cz, func, false);
+
+    // At most a label and a jump more per block, `code` must not move while emitting.
+    dck_stretchy_reserve(cz->abs_code, func->code_count + 4 * compiler->blocks.count);
+
+    *laid_out = *func;
+    laid_out->code_offset = cz->abs_code.count;
+    laid_out->label_count = next_label;
+
+    vm_layout_emit(compiler, cz, func, true);
+
+    laid_out->code_count = cz->abs_code.count - laid_out->code_offset;
+
+    return true;
+}
+
+/* One `vm_inst_Stub` per callee the calls from `patch_offset` on are waiting for, right after the code.
+ * The calls stay in `call_patches`, so compiling the callee later retargets them same as without a stub.
+ */
+static void
+vm_emit_stubs(vm_program_t *program, u32 patch_offset)
+{
+    for (u32 i = patch_offset; i < program->call_patches.count; ++i) {
+        vm_call_patch_t patch = program->call_patches.data[i];
+
+        u32 stub_offset = CZ_NO_ID;
+
+        for (u32 j = patch_offset; j < i; ++j) {
+            vm_call_patch_t other = program->call_patches.data[j];
+
+            if (other.func_ref.func_index == patch.func_ref.func_index) {
+                stub_offset = program->code.data[other.call_offset + vm_inst_size(program, other.call_offset) - 1];
+                break;
+            }
+        }
+
+        if (stub_offset == CZ_NO_ID) {
+            stub_offset = program->code.count;
+            dck_stretchy_push(program->code, vm_inst_Stub);
+            dck_stretchy_push(program->code, patch.func_ref.func_index);
+        }
+
+        // The target is always the last operand.
+        program->code.data[patch.call_offset + vm_inst_size(program, patch.call_offset) - 1] = stub_offset;
+    }
+}
+
+u32
+vm_compile(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz, func_ref_t func_ref)
+{
+    compiler->allocated_memory   = 0;
+    compiler->max_memory         = 0;
+    compiler->objects.count      = 0;
+    compiler->jump_patches.count = 0;
+    compiler->patch_objects.count = 0;
+    compiler->labels.count       = 0;
+    compiler->last_dst           = CZ_NO_ID;
+    compiler->unreachable        = false;
+    compiler->cached_count       = 0;
+    compiler->has_calls          = false;
+    compiler->sp_patches.count   = 0;
+
+    u32 code_offset = program->code.count;
+    u32 patch_offset = program->call_patches.count;
+
+    abs_func_t *func = cz->abs_funcs.data + func_ref.func_index;
+
+    // The laid out copy lives past the end of `abs_code` until compiled.
+    u32 abs_code_count = cz->abs_code.count;
+    abs_func_t laid_out;
+    b32 is_laid_out = compiler->layout_profile && compiler->layout_program
+                   && vm_layout_blocks(compiler, cz, func_ref, &laid_out);
+    if (is_laid_out) {
+        func = &laid_out;
+    }
+
+    u32 object_offset = compiler->objects.count;
+    (void)object_offset; // TODO: Useful when working with nested functions (closures).
+
+    u32 input_offset = compiler->objects.count;
+    compiler->input_offset = input_offset;
+
+    for (u32 i = 0; i < func->in_count; ++i) {
+        type_ref_t type = cz->abs_func_ins.data[func->in_offset + i];
+        vm_object_t object = vm_alloc_object(compiler, cz, type);
+        dck_stretchy_push(compiler->objects, object);
+    }
+
+    // TODO: return address + base pointer + Closure base pointers.
+
+    u32 input_size = compiler->allocated_memory;
+
+    u32 variable_offset = compiler->objects.count;
+    compiler->variable_offset = variable_offset;
+
+    for (u32 i = 0; i < func->var_count; ++i) {
+        type_ref_t type = cz->abs_func_vars.data[func->var_offset + i];
+        vm_object_t object = vm_alloc_object(compiler, cz, type);
+        dck_stretchy_push(compiler->objects, object);
+    }
+
+    compiler->locals_size = compiler->allocated_memory;
+    compiler->max_memory  = compiler->allocated_memory;
+
+    u32 frame_patch = CZ_NO_ID;
+
+    // The prologue belongs to the first instruction.
+    dck_stretchy_push(program->abs_locs, (vm_abs_loc_t) {
+        .code_offset = code_offset,
+        .func_index  = func_ref.func_index,
+        .inst_index  = 0,
+    });
+
+    if (compiler->mode == vm_compile_mode_Register) {
+        // The whole frame including the evaluation slots, patched once we know its size.
+        dck_stretchy_push(program->code, vm_inst_IncSP);
+        frame_patch = program->code.count;
+        dck_stretchy_push(program->code, 0);
+    }
+    else if (compiler->allocated_memory != input_size) {
+        // Variables live right after the inputs, make room for them.
+        dck_stretchy_push(program->code, vm_inst_IncSP);
+        dck_stretchy_push(program->code, compiler->allocated_memory - input_size);
+    }
+
+    u32 eval_offset = compiler->objects.count;
+    compiler->eval_offset = eval_offset;
+
+    vm_find_results(compiler, cz, func);
+
+    for (u32 inst_index = 0; inst_index < func->code_count; ++inst_index) {
+        abs_code_t code = cz->abs_code.data[func->code_offset + inst_index];
+
+        /* Instructions that emit nothing, like deferred register mode loads, leave entries at the
+         * same offset, the last one wins so the code goes to the instruction that emitted it.
+         */
+        dck_stretchy_push(program->abs_locs, (vm_abs_loc_t) {
+            .code_offset = program->code.count,
+            .func_index  = func_ref.func_index,
+            .inst_index  = is_laid_out ? compiler->layout_map.data[inst_index] : inst_index,
+        });
+
+        if (compiler->mode != vm_compile_mode_Register && !compiler->disable_fusion) {
+            u32 fused_count = vm_compile_fused(program, compiler, cz, func, inst_index);
+
+            if (fused_count != 0) {
+                inst_index += fused_count - 1;
+                continue;
+            }
+        }
+
+        vm_object_t object;
+        vm_object_t object_r;
+        vm_object_t object_l;
+
+        switch (code.inst) {
+            case abs_inst_Add: /* fallthrough */
+            case abs_inst_Sub: {
+                // NOTE: Types need to be tilable.
+
+                ASSERT(eval_offset + 2 <= compiler->allocated_memory);
+                
+                object_r = vm_pop_object(compiler, cz);
+                ASSERT(object_r.type_ref.tag == data_type_Basic); // TODO:
+                ASSERT(object_r.type_ref.index_for_tag == data_basic_Int);
+
+                object_l = vm_pop_object(compiler, cz);
+                ASSERT(object_l.type_ref.tag == data_type_Basic); // TODO:
+                ASSERT(object_l.type_ref.index_for_tag == data_basic_Int);
+
+                u32 dst = compiler->result_dsts.data[inst_index];
+
+                if (compiler->mode == vm_compile_mode_Register) {
+                    u32 l = vm_operand(program, compiler, cz, &object_l);
+                    u32 r = vm_operand(program, compiler, cz, &object_r);
+
+                    if (dst != CZ_NO_ID) {
+                        vm_clear_result_slot(program, compiler, cz, dst, object_l.size);
+                        object = vm_push_result(compiler, cz, object_l.type_ref, dst);
+                    }
+                    else {
+                        object = vm_push_type(program, compiler, cz, object_l.type_ref);
+                    }
+
+                    dck_stretchy_push(program->code, code.inst == abs_inst_Add ? vm_inst_AddIntReg
+                                                                          : vm_inst_SubIntReg);
+                    compiler->last_dst = program->code.count;
+                    dck_stretchy_push(program->code, object.base_offset);
+                    dck_stretchy_push(program->code, l);
+                    dck_stretchy_push(program->code, r);
+                    break;
+                }
+
+                if (compiler->mode == vm_compile_mode_Cached) {
+                    vm_cache_fill(program, compiler, 2);
+
+                    dck_stretchy_push(program->code, code.inst == abs_inst_Add ? vm_inst_AddIntAB
+                                                                          : vm_inst_SubIntAB);
+
+                    if (dst != CZ_NO_ID) {
+                        dck_stretchy_push(program->code, vm_inst_StoreA);
+                        dck_stretchy_push(program->code, dst);
+                        compiler->cached_count = 0;
+
+                        vm_push_result(compiler, cz, object_l.type_ref, dst);
+                        break;
+                    }
+
+                    compiler->cached_count = 1;
+
+                    vm_push_type(program, compiler, cz, object_l.type_ref);
+                    break;
+                }
+
+                // The operands stay on the stack, nothing but the epilogue comes after it.
+                if (dst != CZ_NO_ID && vm_reaches_ret(cz, func, inst_index + 1)) {
+                    dck_stretchy_push(program->code, code.inst == abs_inst_Add ? vm_inst_AddIntReg
+                                                                          : vm_inst_SubIntReg);
+                    dck_stretchy_push(program->code, dst);
+                    dck_stretchy_push(program->code, object_l.base_offset);
+                    dck_stretchy_push(program->code, object_r.base_offset);
+
+                    vm_push_result(compiler, cz, object_l.type_ref, dst);
+                    break;
+                }
+
+                if (code.inst == abs_inst_Add) {
+                    dck_stretchy_push(program->code, vm_inst_AddInt);
+                }
+                else {
+                    dck_stretchy_push(program->code, vm_inst_SubInt);
+                }
+
+                vm_push_type(program, compiler, cz, object_l.type_ref);
+            } break;
+
+            case abs_inst_LoadIn: /* fallthrough */
+            case abs_inst_LoadVar: {
+                // TODO: Make work for closures.
+
+                u32 dst = compiler->result_dsts.data[inst_index];
+
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 local_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+
+                if (code.inst == abs_inst_LoadIn) {
+                    object = compiler->objects.data[input_offset + local_index - func->in_base];
+                }
+                else {
+                    object = compiler->objects.data[variable_offset + local_index - func->var_base];
+                }
+
+                if (dst != CZ_NO_ID) {
+                    // Already there when it's loaded onto itself.
+                    if (dst != object.base_offset) {
+                        vm_clear_result_slot(program, compiler, cz, dst, object.size);
+
+                        dck_stretchy_push(program->code, vm_inst_MemMove);
+                        dck_stretchy_push(program->code, dst);
+                        dck_stretchy_push(program->code, object.base_offset);
+                        dck_stretchy_push(program->code, object.size);
+                    }
+
+                    vm_push_result(compiler, cz, object.type_ref, dst);
+                    break;
+                }
+
+                vm_push_type(program, compiler, cz, object.type_ref);
+
+                if (compiler->mode == vm_compile_mode_Register) {
+                    vm_object_t *top = compiler->objects.data + compiler->objects.count - 1;
+                    top->location       = vm_location_Local;
+                    top->location_index = object.base_offset;
+                    break;
+                }
+
+                // What doesn't fit a register goes on the memory stack, with everything cached below it.
+                if (compiler->mode == vm_compile_mode_Cached && object.size != sizeof(i32)) {
+                    vm_cache_spill(program, compiler, 0);
+                }
+                else if (compiler->mode == vm_compile_mode_Cached) {
+                    vm_cache_spill(program, compiler, 1);
+
+                    dck_stretchy_push(program->code, compiler->cached_count == 0 ? vm_inst_LoadA : vm_inst_LoadB);
+                    dck_stretchy_push(program->code, object.base_offset);
+                    compiler->cached_count++;
+                    break;
+                }
+
+                dck_stretchy_push(program->code, vm_inst_Load);
+                dck_stretchy_push(program->code, object.base_offset);
+                dck_stretchy_push(program->code, object.size);
+            } break;
+
+            case abs_inst_LoadImm: {
+                u32 dst = compiler->result_dsts.data[inst_index];
+
+                ASSERT(inst_index + 1 < func->code_count);
+
+                u32 imm_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+                immediate_t immediate = cz->immediates.data[imm_index];
+
+                if (dst != CZ_NO_ID) {
+                    vm_allocation_t allocation = vm_type_to_allocation(cz, immediate.type);
+                    vm_clear_result_slot(program, compiler, cz, dst, allocation.size);
+
+                    dck_stretchy_push(program->code, vm_inst_MoveImmReg);
+                    dck_stretchy_push(program->code, dst);
+                    vm_emit_imm(program, cz, imm_index);
+
+                    vm_push_result(compiler, cz, immediate.type, dst);
+                    break;
+                }
+
+                object = vm_push_type(program, compiler, cz, immediate.type);
+
+                if (compiler->mode == vm_compile_mode_Register) {
+                    vm_object_t *top = compiler->objects.data + compiler->objects.count - 1;
+                    top->location       = vm_location_Imm;
+                    top->location_index = imm_index;
+                    break;
+                }
+
+                if (compiler->mode == vm_compile_mode_Cached && !vm_is_int_imm(cz, imm_index)) {
+                    vm_cache_spill(program, compiler, 0);
+                }
+                else if (compiler->mode == vm_compile_mode_Cached) {
+                    vm_cache_spill(program, compiler, 1);
+
+                    dck_stretchy_push(program->code, compiler->cached_count == 0 ? vm_inst_LoadImmA : vm_inst_LoadImmB);
+                    dck_stretchy_push(program->code, *(u32 *)(cz->imm_data.data + immediate.data_offset));
+                    compiler->cached_count++;
+                    break;
+                }
+
+                dck_stretchy_push(program->code, vm_inst_LoadImm);
+                vm_emit_imm(program, cz, imm_index);
+            } break;
+
+            case abs_inst_StoreIn: /* fallthrough */
+            case abs_inst_StoreVar: {
+                // TODO: Make work for closures.
+
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 local_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+
+                if (code.inst == abs_inst_StoreIn) {
+                    object = compiler->objects.data[input_offset + local_index - func->in_base];
+                }
+                else {
+                    object = compiler->objects.data[variable_offset + local_index - func->var_base];
+                }
+
+                vm_object_t stack_object = vm_pop_object(compiler, cz);
+
+                if (compiler->mode == vm_compile_mode_Register) {
+                    // Values still referring to the old contents need their own copy first.
+                    for (u32 i = eval_offset; i < compiler->objects.count; ++i) {
+                        vm_object_t *alias = compiler->objects.data + i;
+
+                        if (alias->location == vm_location_Local
+                         && alias->location_index == object.base_offset) {
+                            vm_materialize(program, compiler, cz, alias);
+                        }
+                    }
+
+                    // Retarget the instruction that just produced the value.
+                    if (stack_object.location == vm_location_Slot
+                     && compiler->last_dst != CZ_NO_ID
+                     && program->code.data[compiler->last_dst] == stack_object.base_offset) {
+                        program->code.data[compiler->last_dst] = object.base_offset;
+                        compiler->last_dst = CZ_NO_ID;
+                        break;
+                    }
+
+                    if (stack_object.location == vm_location_Imm) {
+                        dck_stretchy_push(program->code, vm_inst_MoveImmReg);
+                        compiler->last_dst = program->code.count;
+                        dck_stretchy_push(program->code, object.base_offset);
+                        vm_emit_imm(program, cz, stack_object.location_index);
+                        break;
+                    }
+
+                    u32 src = vm_operand(program, compiler, cz, &stack_object);
+
+                    dck_stretchy_push(program->code, vm_inst_MemMove);
+                    compiler->last_dst = program->code.count;
+                    dck_stretchy_push(program->code, object.base_offset);
+                    dck_stretchy_push(program->code, src);
+                    dck_stretchy_push(program->code, stack_object.size);
+                    break;
+                }
+
+                if (compiler->mode == vm_compile_mode_Cached && compiler->cached_count > 0) {
+                    dck_stretchy_push(program->code, compiler->cached_count == 2 ? vm_inst_StoreB : vm_inst_StoreA);
+                    dck_stretchy_push(program->code, object.base_offset);
+                    compiler->cached_count--;
+                    break;
+                }
+
+                dck_stretchy_push(program->code, vm_inst_Store);
+                dck_stretchy_push(program->code, object.base_offset);
+                dck_stretchy_push(program->code, stack_object.size);
+            } break;
+
+            case abs_inst_Label: {
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 label_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+
+                if (!compiler->unreachable) {
+                    vm_flush_objects(program, compiler, cz);
+                }
+
+                u32 object_count = compiler->objects.count;
+                b32 is_known     = !compiler->unreachable;
+
+                vm_patch_t arrival = {0};
+
+                for (u32 i = 0; i < compiler->jump_patches.count;) {
+                    vm_patch_t patch = compiler->jump_patches.data[i];
+
+                    if (patch.label_index == label_index) {
+                        // Offset by one cuz the IP points to the next instruction, not current.
+                        i32 rel_offset = (i32)(program->code.count) - ((i32)patch.absolute_offset + 1);
+                        program->code.data[patch.absolute_offset] = *((u32*)&rel_offset);
+
+                        ASSERT(!is_known || patch.object_count == object_count);
+                        object_count = patch.object_count;
+                        (void)object_count;
+                        is_known     = true;
+                        arrival      = patch;
+
+                        compiler->jump_patches.data[i] = compiler->jump_patches.data[--(compiler->jump_patches.count)];
+                    }
+                    else {
+                        ++i;
+                    }
+                }
+
+                // Code after an unconditional jump or a return left its values on the compile time stack.
+                if (compiler->unreachable && is_known) {
+                    vm_restore_objects(compiler, arrival);
+                }
+
+                compiler->unreachable = false;
+                compiler->last_dst    = CZ_NO_ID;
+
+                dck_stretchy_push(compiler->labels, (vm_patch_t) {
+                    .label_index     = label_index,
+                    .absolute_offset = program->code.count,
+                    .object_count    = compiler->objects.count,
+                });
+            } break;
+
+            case abs_inst_Call: {
+                ASSERT(inst_index + 1 < func->code_count);
+                func_ref_t callee_ref = { .func_index = cz->abs_code.data[func->code_offset + ++inst_index].index };
+                abs_func_t *callee = cz->abs_funcs.data + callee_ref.func_index;
+
+                // Nothing else is on the stack, so the frame isn't needed after the call.
+                b32 is_tail = compiler->objects.count - eval_offset == callee->in_count
+                           && !compiler->disable_tail_calls
+                           && vm_is_tail_call(cz, func, callee, inst_index + 1);
+
+                // The callee starts from memory, nothing stays in registers across the call.
+                vm_flush_objects(program, compiler, cz);
+
+                u32 in_size;
+                u32 args = vm_emit_call_args(program, compiler, cz, callee, &in_size);
+
+                for (u32 i = 0; i < callee->out_count; ++i) {
+                    object = vm_alloc_object(compiler, cz, cz->abs_func_outs.data[callee->out_offset + i]);
+                    dck_stretchy_push(compiler->objects, object);
+                }
+
+                if (compiler->max_memory < compiler->allocated_memory) {
+                    compiler->max_memory = compiler->allocated_memory;
+                }
+
+                u32 call_offset = program->code.count;
+
+                if (is_tail) {
+                    // Arguments move down into the inputs and the callee returns straight to our caller.
+                    dck_stretchy_push(program->code, vm_inst_TailCall);
+                    dck_stretchy_push(program->code, args);
+                    dck_stretchy_push(program->code, in_size);
+                }
+                else {
+                    dck_stretchy_push(program->code, vm_inst_Call);
+                    dck_stretchy_push(program->code, args);
+                    dck_stretchy_push(program->code, in_size);
+
+                    if (compiler->mode == vm_compile_mode_Register) {
+                        // The frame keeps its full size, patched at the end.
+                        dck_stretchy_push(compiler->sp_patches, program->code.count);
+                    }
+                    dck_stretchy_push(program->code, compiler->allocated_memory);
+                }
+
+                if (callee_ref.func_index == func_ref.func_index) {
+                    dck_stretchy_push(program->code, code_offset);
+                }
+                else {
+                    vm_emit_call_target(program, callee_ref, call_offset);
+                }
+
+                compiler->has_calls = true;
+                compiler->last_dst  = CZ_NO_ID;
+            } break;
+
+            case abs_inst_Ret:
+                vm_emit_epilogue(program, compiler, cz);
+
+                // Cold blocks may be laid out after the return.
+                compiler->unreachable = true;
+                break;
+
+            case abs_inst_JmpGe: /* fallthrough */
+            case abs_inst_JmpLe: /* fallthrough */
+            case abs_inst_JmpGt: /* fallthrough */
+            case abs_inst_JmpLt: /* fallthrough */
+            case abs_inst_JmpNe: /* fallthrough */
+            case abs_inst_JmpEq:
+                object_r = vm_pop_object(compiler, cz);
+                ASSERT(object_r.type_ref.tag == data_type_Basic); // TODO:
+                ASSERT(object_r.type_ref.index_for_tag == data_basic_Int);
+                /* fallthrough */
+            case abs_inst_JmpZe: /* fallthrough */
+            case abs_inst_JmpNz:
+                object_l = vm_pop_object(compiler, cz);
+                ASSERT(object_l.type_ref.tag == data_type_Basic); // TODO:
+                ASSERT(object_l.type_ref.index_for_tag == data_basic_Int);
+                /* fallthrough */
+            case abs_inst_JmpUc: {
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 label_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+
+                // Nothing to jump over on the way to the return, it gets emitted right here.
+                if (code.inst == abs_inst_JmpUc && vm_reaches_ret(cz, func, inst_index - 1)) {
+                    vm_emit_epilogue(program, compiler, cz);
+                    compiler->unreachable = true;
+                    break;
+                }
+
+                if (compiler->mode == vm_compile_mode_Register && code.inst != abs_inst_JmpUc) {
+                    u32 l = vm_operand(program, compiler, cz, &object_l);
+                    u32 r = 0;
+                    if (code.inst != abs_inst_JmpNz && code.inst != abs_inst_JmpZe) {
+                        r = vm_operand(program, compiler, cz, &object_r);
+                    }
+
+                    vm_flush_objects(program, compiler, cz);
+
+                    dck_stretchy_push(program->code, vm_inst_JmpIntNzReg + (code.inst - abs_inst_JmpNz));
+                    dck_stretchy_push(program->code, l);
+                    if (code.inst != abs_inst_JmpNz && code.inst != abs_inst_JmpZe) {
+                        dck_stretchy_push(program->code, r);
+                    }
+                }
+                else if (compiler->mode == vm_compile_mode_Cached && code.inst != abs_inst_JmpUc) {
+                    // Conditional operands are consumed straight from the registers.
+                    if (code.inst == abs_inst_JmpNz || code.inst == abs_inst_JmpZe) {
+                        vm_cache_spill(program, compiler, 1);
+                        vm_cache_fill(program, compiler, 1);
+                        dck_stretchy_push(program->code, vm_inst_JmpIntNzA + (code.inst - abs_inst_JmpNz));
+                    }
+                    else {
+                        vm_cache_fill(program, compiler, 2);
+                        dck_stretchy_push(program->code, vm_inst_JmpIntEqAB + (code.inst - abs_inst_JmpEq));
+                    }
+                    compiler->cached_count = 0;
+                }
+                else {
+                    vm_flush_objects(program, compiler, cz);
+
+                    vm_inst_t jmp_inst = vm_inst_JmpUc + (code.inst - abs_inst_JmpUc);
+                    dck_stretchy_push(program->code, jmp_inst);
+                }
+
+                vm_emit_jump_offset(program, compiler, label_index);
+
+                compiler->last_dst = CZ_NO_ID;
+
+                if (code.inst == abs_inst_JmpUc) {
+                    compiler->unreachable = true;
+                }
+            } break;
+        }
+    }
+
+
+    if (frame_patch != CZ_NO_ID) {
+        program->code.data[frame_patch] = compiler->max_memory - input_size;
+    }
+
+    for (u32 i = 0; i < compiler->sp_patches.count; ++i) {
+        program->code.data[compiler->sp_patches.data[i]] = compiler->max_memory;
+    }
+
+    cz->abs_code.count = abs_code_count;
+
+    vm_function_t function = {
+        .func_ref    = func_ref,
+        .code_offset = code_offset,
+        .op_offset   = program->ops.count,
+        .in_size     = input_size,
+        .out_size    = 0,
+        .frame_size  = compiler->max_memory,
+        .has_calls   = compiler->has_calls,
+    };
+
+    for (u32 i = 0; i < func->out_count; ++i) {
+        vm_allocation_t allocation = vm_type_to_allocation(cz, cz->abs_func_outs.data[func->out_offset + i]);
+        function.out_size = vm_align(function.out_size, allocation.alignment) + allocation.size;
+    }
+
+    dck_stretchy_push(program->functions, function);
+
+    if (compiler->lazy_calls) {
+        vm_emit_stubs(program, patch_offset);
+    }
+
+    // The interpreters take the code as it is from here on.
+    vm_verify_error_t error;
+    if (!vm_verify(program, code_offset, &error)) {
+        printf("vm: compiled code doesn't verify at %u: %s\n", error.code_offset, error.message);
+        exit(1);
+    }
+
+    vm_decode(program, code_offset);
+
+    // Earlier functions calling this one.
+    for (u32 i = 0; i < program->call_patches.count;) {
+        vm_call_patch_t patch = program->call_patches.data[i];
+
+        if (patch.func_ref.func_index == func_ref.func_index) {
+            // The target is always the last operand.
+            program->code.data[patch.call_offset + vm_inst_size(program, patch.call_offset) - 1] = code_offset;
+            program->ops.data[program->code_ops.data[patch.call_offset]].call.target = function.op_offset;
+            program->ops.data[program->code_ops.data[patch.call_offset]].call.frame  = function.frame_size;
+
+            program->call_patches.data[i] = program->call_patches.data[--(program->call_patches.count)];
+        }
+        else {
+            ++i;
+        }
+    }
+
+    return code_offset;
+}
+
+static u32
+vm_inst_size(const vm_program_t *program, u32 ip)
+{
+    vm_inst_t inst = program->code.data[ip];
+
+    switch (inst) {
+        case vm_inst_Halt:    return 1;
+        case vm_inst_IncSP:   return 2;
+        case vm_inst_MemMove: return 4;
+        case vm_inst_AddInt:  return 1;
+        case vm_inst_SubInt:  return 1;
+        case vm_inst_Load:    return 3;
+        case vm_inst_Store:   return 3;
+        case vm_inst_Call:    return 5;
+        case vm_inst_TailCall: return 4;
+        case vm_inst_Ret:     return 1;
+        case vm_inst_Stub:    return 2;
+
+        case vm_inst_LoadImm: {
+            u32 size = program->code.data[ip + 1];
+            return 2 + (size + sizeof(vm_inst_t) - 1) / sizeof(vm_inst_t);
+        }
+
+        case vm_inst_JmpUc:    /* fallthrough */
+        case vm_inst_JmpIntNz: /* fallthrough */
+        case vm_inst_JmpIntZe: /* fallthrough */
+        case vm_inst_JmpIntEq: /* fallthrough */
+        case vm_inst_JmpIntNe: /* fallthrough */
+        case vm_inst_JmpIntLt: /* fallthrough */
+        case vm_inst_JmpIntGt: /* fallthrough */
+        case vm_inst_JmpIntLe: /* fallthrough */
+        case vm_inst_JmpIntGe: return 2;
+
+        case vm_inst_AddIntReg: return 4;
+        case vm_inst_SubIntReg: return 4;
+
+        case vm_inst_MoveImmReg: {
+            u32 size = program->code.data[ip + 2];
+            return 3 + (size + sizeof(vm_inst_t) - 1) / sizeof(vm_inst_t);
+        }
+
+        case vm_inst_JmpIntNzReg: /* fallthrough */
+        case vm_inst_JmpIntZeReg: return 3;
+
+        case vm_inst_JmpIntEqReg: /* fallthrough */
+        case vm_inst_JmpIntNeReg: /* fallthrough */
+        case vm_inst_JmpIntLtReg: /* fallthrough */
+        case vm_inst_JmpIntGtReg: /* fallthrough */
+        case vm_inst_JmpIntLeReg: /* fallthrough */
+        case vm_inst_JmpIntGeReg: return 4;
+
+        case vm_inst_AddIntLL:  /* fallthrough */
+        case vm_inst_SubIntLL:  /* fallthrough */
+        case vm_inst_AddIntLI:  /* fallthrough */
+        case vm_inst_SubIntLI:  return 3;
+        case vm_inst_LoadStore: return 4;
+
+        case vm_inst_JmpIntEqLL: /* fallthrough */
+        case vm_inst_JmpIntNeLL: /* fallthrough */
+        case vm_inst_JmpIntLtLL: /* fallthrough */
+        case vm_inst_JmpIntGtLL: /* fallthrough */
+        case vm_inst_JmpIntLeLL: /* fallthrough */
+        case vm_inst_JmpIntGeLL: /* fallthrough */
+        case vm_inst_JmpIntEqLI: /* fallthrough */
+        case vm_inst_JmpIntNeLI: /* fallthrough */
+        case vm_inst_JmpIntLtLI: /* fallthrough */
+        case vm_inst_JmpIntGtLI: /* fallthrough */
+        case vm_inst_JmpIntLeLI: /* fallthrough */
+        case vm_inst_JmpIntGeLI: return 4;
+
+        case vm_inst_LoadA:    /* fallthrough */
+        case vm_inst_LoadB:    /* fallthrough */
+        case vm_inst_LoadImmA: /* fallthrough */
+        case vm_inst_LoadImmB: /* fallthrough */
+        case vm_inst_StoreA:   /* fallthrough */
+        case vm_inst_StoreB:   return 2;
+        case vm_inst_SpillA:   /* fallthrough */
+        case vm_inst_FillA:    /* fallthrough */
+        case vm_inst_AddIntAB: /* fallthrough */
+        case vm_inst_SubIntAB: return 1;
+
+        case vm_inst_JmpIntNzA:  /* fallthrough */
+        case vm_inst_JmpIntZeA:  /* fallthrough */
+        case vm_inst_JmpIntEqAB: /* fallthrough */
+        case vm_inst_JmpIntNeAB: /* fallthrough */
+        case vm_inst_JmpIntLtAB: /* fallthrough */
+        case vm_inst_JmpIntGtAB: /* fallthrough */
+        case vm_inst_JmpIntLeAB: /* fallthrough */
+        case vm_inst_JmpIntGeAB: return 2;
+
+        case VM_INST_COUNT: UNREACHABLE();
+    }
+
+    UNREACHABLE();
+}
+
+#if defined(VM_STATS)
+static inline void
+vm_stats_record(vm_thread_t *thread, vm_inst_t inst)
+{
+    vm_stats_t *stats = thread->stats;
+    if (stats == NULL)
+        return;
+
+    stats->counts[inst]++;
+    if (stats->last != 0) {
+        stats->pairs[stats->last - 1][inst]++;
+    }
+    stats->last = inst + 1;
+}
+
+    #define VM_STATS_RECORD(m_thread, m_inst) vm_stats_record((m_thread), (m_inst))
+#else
+    #define VM_STATS_RECORD(m_thread, m_inst) ((void)0)
+#endif
+
+// Same frames as `vm_run`: entering a function reserves all of it, pushes inside don't check.
+static void
+vm_step_reserve(const vm_program_t *program, vm_thread_t *thread, u32 code_offset)
+{
+    // Stubs don't have a frame yet, they reserve it once their function is compiled.
+    const vm_function_t *function = vm_find_function(program, code_offset);
+    if (!function)
+        return;
+
+    u32 end = thread->bp + function->frame_size;
+    if (end > thread->memory.count) {
+        dck_stretchy_reserve(thread->memory, end - thread->memory.count);
+    }
+}
+
+void
+vm_init(const vm_program_t *program, vm_thread_t *thread, u32 code_offset)
+{
+    thread->ip = code_offset;
+    thread->bp = 0;
+
+    thread->popped_pos = 0;
+
+    thread->frames.count = 0;
+
+    vm_step_reserve(program, thread, code_offset);
+
+#if defined(VM_STATS)
+    if (thread->stats) {
+        thread->stats->last = 0;
+    }
+#endif
+}
+
+void
+vm_clear(vm_thread_t *thread)
+{
+    thread->memory.count = 0;
+}
+
+void
+vm_thread_free(vm_thread_t *thread)
+{
+    if (!thread->is_mapped) {
+        free(thread->memory.data);
+        memset(&thread->memory, 0, sizeof(thread->memory));
+    }
+
+    free(thread->frames.data);
+    memset(&thread->frames, 0, sizeof(thread->frames));
+}
+
+// Everything `vm_compile` emits is verified, nothing here gets checked again per instruction.
+void
+vm_step(const vm_program_t *program, vm_thread_t *thread, cz_t *cz)
+{
+    vm_inst_t inst = program->code.data[thread->ip];
+
+    if (inst == vm_inst_Halt || (inst == vm_inst_Ret && thread->frames.count == 0))
+        return;
+
+    VM_STATS_RECORD(thread, inst);
+
+    thread->ip++;
+
+    switch (inst) {
+        case vm_inst_IncSP: {
+            u32 amount = program->code.data[thread->ip++];
+
+            thread->memory.count += amount;
+        } break;
+
+        case vm_inst_MemMove: {
+            u32 dst  = program->code.data[thread->ip++];
+            u32 src  = program->code.data[thread->ip++];
+            u32 size = program->code.data[thread->ip++];
+
+            memmove(thread->memory.data + thread->bp + dst, thread->memory.data + thread->bp + src, size);
+        } break;
+
+        case vm_inst_AddInt: /* fallthrough */
+        case vm_inst_SubInt: {
+            thread->memory.count -= sizeof(i32);
+            i32 b = *(i32 *)(thread->memory.data + thread->memory.count);
+            thread->memory.count -= sizeof(i32);
+            i32 a = *(i32 *)(thread->memory.data + thread->memory.count);
+
+            i32 res;
+            if      (inst == vm_inst_AddInt) res = a + b;
+            else if (inst == vm_inst_SubInt) res = a - b;
+            else UNREACHABLE();
+
+            *(i32 *)(thread->memory.data + thread->memory.count) = res;
+            thread->memory.count += sizeof(i32);
+        } break;
+
+        case vm_inst_Load: {
+            u32 base_offset = program->code.data[thread->ip++];
+            u32 size        = program->code.data[thread->ip++];
+
+            u32 abs_offset  = thread->bp + base_offset;
+            memcpy(thread->memory.data + thread->memory.count, thread->memory.data + abs_offset, size);
+            thread->memory.count += size;
+        } break;
+
+        case vm_inst_LoadImm: {
+            u32 size = program->code.data[thread->ip++];
+
+            u32 rounded_size = (size + sizeof(vm_inst_t) - 1) / sizeof(vm_inst_t);
+
+            memcpy(thread->memory.data + thread->memory.count, program->code.data + thread->ip, size);
+            thread->memory.count += size;
+            thread->ip += rounded_size;
+        } break;
+
+        case vm_inst_Store: {
+            u32 base_offset = program->code.data[thread->ip++];
+            u32 size        = program->code.data[thread->ip++];
+
+            thread->memory.count -= size;
+
+            u32 abs_offset  = thread->bp + base_offset;
+            memcpy(thread->memory.data + abs_offset, thread->memory.data + thread->memory.count, size);
+        } break;
+
+        case vm_inst_Call: {
+            u32 args   = program->code.data[thread->ip++];
+            u32 size   = program->code.data[thread->ip++];
+            u32 sp     = program->code.data[thread->ip++];
+            u32 target = program->code.data[thread->ip++];
+
+            ASSERT(target != CZ_NO_ID); // Callee never compiled.
+
+            dck_stretchy_push(thread->frames, (vm_frame_t) {
+                .ret = thread->ip,
+                .bp  = thread->bp,
+                .sp  = thread->bp + sp,
+            });
+
+            thread->bp += args;
+            thread->memory.count = thread->bp;
+            vm_step_reserve(program, thread, target);
+            thread->memory.count += size;
+
+            thread->ip = target;
+        } break;
+
+        case vm_inst_TailCall: {
+            u32 args   = program->code.data[thread->ip++];
+            u32 size   = program->code.data[thread->ip++];
+            u32 target = program->code.data[thread->ip++];
+
+            ASSERT(target != CZ_NO_ID); // Callee never compiled.
+
+            u8 *frame = thread->memory.data + thread->bp;
+            memmove(frame, frame + args, size);
+            thread->memory.count = thread->bp + size;
+            vm_step_reserve(program, thread, target);
+
+            thread->ip = target;
+        } break;
+
+        case vm_inst_Ret: {
+            vm_frame_t frame = thread->frames.data[--(thread->frames.count)];
+
+            thread->ip = frame.ret;
+            thread->bp = frame.bp;
+            thread->memory.count = frame.sp;
+        } break;
+
+        case vm_inst_Stub: {
+            func_ref_t func_ref = { .func_index = program->code.data[thread->ip++] };
+
+            // Already in the callee's frame, the call sites go straight to it from now on.
+            ASSERT(thread->lazy_program == program && thread->lazy_compiler);
+            thread->ip = vm_compile(thread->lazy_program, thread->lazy_compiler, cz, func_ref);
+            vm_step_reserve(program, thread, thread->ip);
+        } break;
+
+        case vm_inst_JmpUc: {
+            i32 offset = *(i32 *)(program->code.data + thread->ip++);
+
+            thread->ip = (u32)(*(i32 *)(&thread->ip) + offset);
+        } break;
+
+        case vm_inst_JmpIntGe: /* fallthrough */
+        case vm_inst_JmpIntLe: /* fallthrough */
+        case vm_inst_JmpIntGt: /* fallthrough */
+        case vm_inst_JmpIntLt: /* fallthrough */
+        case vm_inst_JmpIntNe: /* fallthrough */
+        case vm_inst_JmpIntEq: /* fallthrough */
+        case vm_inst_JmpIntZe: /* fallthrough */
+        case vm_inst_JmpIntNz: {
+            i32 offset = *(i32 *)(program->code.data + thread->ip++);
+
+            i32 a, b;
+            if (inst != vm_inst_JmpIntZe && inst != vm_inst_JmpIntNz) {
+                thread->memory.count -= sizeof(i32);
+                b = *(i32 *)(thread->memory.data + thread->memory.count);
+            }
+
+            thread->memory.count -= sizeof(i32);
+            a = *(i32 *)(thread->memory.data + thread->memory.count);
+
+            b32 do_jump;
+            switch (inst) {
+                case vm_inst_JmpIntGe: do_jump = a >= b; break;
+                case vm_inst_JmpIntLe: do_jump = a <= b; break;
+                case vm_inst_JmpIntGt: do_jump = a > b;  break;
+                case vm_inst_JmpIntLt: do_jump = a < b;  break;
+                case vm_inst_JmpIntNe: do_jump = a != b; break;
+                case vm_inst_JmpIntEq: do_jump = a == b; break;
+                case vm_inst_JmpIntZe: do_jump = a == 0; break;
+                case vm_inst_JmpIntNz: do_jump = a != 0; break;
+                default: UNREACHABLE();
+            }
+
+            if (do_jump) {
+                thread->ip = (u32)(*(i32 *)(&thread->ip) + offset);
+            }
+        } break;
+
+        case vm_inst_AddIntReg: /* fallthrough */
+        case vm_inst_SubIntReg: {
+            u32 dst = program->code.data[thread->ip++];
+            u32 l   = program->code.data[thread->ip++];
+            u32 r   = program->code.data[thread->ip++];
+
+            u8 *frame = thread->memory.data + thread->bp;
+
+            i32 a = *(i32 *)(frame + l);
+            i32 b = *(i32 *)(frame + r);
+
+            *(i32 *)(frame + dst) = inst == vm_inst_AddIntReg ? a + b : a - b;
+        } break;
+
+        case vm_inst_MoveImmReg: {
+            u32 dst  = program->code.data[thread->ip++];
+            u32 size = program->code.data[thread->ip++];
+
+            u32 rounded_size = (size + sizeof(vm_inst_t) - 1) / sizeof(vm_inst_t);
+
+            memcpy(thread->memory.data + thread->bp + dst, program->code.data + thread->ip, size);
+            thread->ip += rounded_size;
+        } break;
+
+        case vm_inst_JmpIntGeReg: /* fallthrough */
+        case vm_inst_JmpIntLeReg: /* fallthrough */
+        case vm_inst_JmpIntGtReg: /* fallthrough */
+        case vm_inst_JmpIntLtReg: /* fallthrough */
+        case vm_inst_JmpIntNeReg: /* fallthrough */
+        case vm_inst_JmpIntEqReg: /* fallthrough */
+        case vm_inst_JmpIntZeReg: /* fallthrough */
+        case vm_inst_JmpIntNzReg: {
+            u8 *frame = thread->memory.data + thread->bp;
+
+            i32 a = *(i32 *)(frame + program->code.data[thread->ip++]);
+
+            i32 b = 0;
+            if (inst != vm_inst_JmpIntZeReg && inst != vm_inst_JmpIntNzReg) {
+                b = *(i32 *)(frame + program->code.data[thread->ip++]);
+            }
+
+            i32 offset = *(i32 *)(program->code.data + thread->ip++);
+
+            b32 do_jump;
+            switch (inst) {
+                case vm_inst_JmpIntGeReg: do_jump = a >= b; break;
+                case vm_inst_JmpIntLeReg: do_jump = a <= b; break;
+                case vm_inst_JmpIntGtReg: do_jump = a > b;  break;
+                case vm_inst_JmpIntLtReg: do_jump = a < b;  break;
+                case vm_inst_JmpIntNeReg: do_jump = a != b; break;
+                case vm_inst_JmpIntEqReg: do_jump = a == b; break;
+                case vm_inst_JmpIntZeReg: do_jump = a == 0; break;
+                case vm_inst_JmpIntNzReg: do_jump = a != 0; break;
+                default: UNREACHABLE();
+            }
+
+            if (do_jump) {
+                thread->ip = (u32)(*(i32 *)(&thread->ip) + offset);
+            }
+        } break;
+
+        case vm_inst_AddIntLL: /* fallthrough */
+        case vm_inst_SubIntLL: /* fallthrough */
+        case vm_inst_AddIntLI: /* fallthrough */
+        case vm_inst_SubIntLI: {
+            u32 l = program->code.data[thread->ip++];
+            u32 r = program->code.data[thread->ip++];
+
+            u8 *frame = thread->memory.data + thread->bp;
+
+            i32 a = *(i32 *)(frame + l);
+            i32 b = inst == vm_inst_AddIntLI || inst == vm_inst_SubIntLI ? (i32)r
+                                                                        : *(i32 *)(frame + r);
+
+            i32 res;
+            if (inst == vm_inst_AddIntLL || inst == vm_inst_AddIntLI) res = a + b;
+            else                                                      res = a - b;
+
+            *(i32 *)(thread->memory.data + thread->memory.count) = res;
+            thread->memory.count += sizeof(i32);
+        } break;
+
+        case vm_inst_LoadStore: {
+            u32 dst  = program->code.data[thread->ip++];
+            u32 src  = program->code.data[thread->ip++];
+            u32 size = program->code.data[thread->ip++];
+
+            memcpy(thread->memory.data + thread->bp + dst, thread->memory.data + thread->bp + src, size);
+        } break;
+
+        case vm_inst_JmpIntEqLL: /* fallthrough */
+        case vm_inst_JmpIntNeLL: /* fallthrough */
+        case vm_inst_JmpIntLtLL: /* fallthrough */
+        case vm_inst_JmpIntGtLL: /* fallthrough */
+        case vm_inst_JmpIntLeLL: /* fallthrough */
+        case vm_inst_JmpIntGeLL: /* fallthrough */
+        case vm_inst_JmpIntEqLI: /* fallthrough */
+        case vm_inst_JmpIntNeLI: /* fallthrough */
+        case vm_inst_JmpIntLtLI: /* fallthrough */
+        case vm_inst_JmpIntGtLI: /* fallthrough */
+        case vm_inst_JmpIntLeLI: /* fallthrough */
+        case vm_inst_JmpIntGeLI: {
+            u32 l = program->code.data[thread->ip++];
+            u32 r = program->code.data[thread->ip++];
+            i32 offset = *(i32 *)(program->code.data + thread->ip++);
+
+            u8 *frame = thread->memory.data + thread->bp;
+
+            b32 is_imm = inst >= vm_inst_JmpIntEqLI;
+
+            i32 a = *(i32 *)(frame + l);
+            i32 b = is_imm ? (i32)r : *(i32 *)(frame + r);
+
+            b32 do_jump;
+            switch (inst - (is_imm ? vm_inst_JmpIntEqLI : vm_inst_JmpIntEqLL)) {
+                case 0: do_jump = a == b; break;
+                case 1: do_jump = a != b; break;
+                case 2: do_jump = a < b;  break;
+                case 3: do_jump = a > b;  break;
+                case 4: do_jump = a <= b; break;
+                case 5: do_jump = a >= b; break;
+                default: UNREACHABLE();
+            }
+
+            if (do_jump) {
+                thread->ip = (u32)(*(i32 *)(&thread->ip) + offset);
+            }
+        } break;
+
+        case vm_inst_LoadA:  /* fallthrough */
+        case vm_inst_LoadB:  /* fallthrough */
+        case vm_inst_StoreA: /* fallthrough */
+        case vm_inst_StoreB: {
+            u32 base_offset = program->code.data[thread->ip++];
+
+            i32 *slot = (i32 *)(thread->memory.data + thread->bp + base_offset);
+            switch (inst) {
+                case vm_inst_LoadA:  thread->registers.int_a = *slot; break;
+                case vm_inst_LoadB:  thread->registers.int_b = *slot; break;
+                case vm_inst_StoreA: *slot = thread->registers.int_a; break;
+                case vm_inst_StoreB: *slot = thread->registers.int_b; break;
+                default: UNREACHABLE();
+            }
+        } break;
+
+        case vm_inst_LoadImmA: /* fallthrough */
+        case vm_inst_LoadImmB: {
+            i32 imm = *(i32 *)(program->code.data + thread->ip++);
+
+            if (inst == vm_inst_LoadImmA) thread->registers.int_a = imm;
+            else                          thread->registers.int_b = imm;
+        } break;
+
+        case vm_inst_SpillA: {
+            *(i32 *)(thread->memory.data + thread->memory.count) = thread->registers.int_a;
+            thread->memory.count += sizeof(i32);
+            thread->registers.int_a = thread->registers.int_b;
+        } break;
+
+        case vm_inst_FillA: {
+            thread->memory.count -= sizeof(i32);
+
+            thread->registers.int_b = thread->registers.int_a;
+            thread->registers.int_a = *(i32 *)(thread->memory.data + thread->memory.count);
+        } break;
+
+        case vm_inst_AddIntAB: thread->registers.int_a += thread->registers.int_b; break;
+        case vm_inst_SubIntAB: thread->registers.int_a -= thread->registers.int_b; break;
+
+        case vm_inst_JmpIntGeAB: /* fallthrough */
+        case vm_inst_JmpIntLeAB: /* fallthrough */
+        case vm_inst_JmpIntGtAB: /* fallthrough */
+        case vm_inst_JmpIntLtAB: /* fallthrough */
+        case vm_inst_JmpIntNeAB: /* fallthrough */
+        case vm_inst_JmpIntEqAB: /* fallthrough */
+        case vm_inst_JmpIntZeA:  /* fallthrough */
+        case vm_inst_JmpIntNzA: {
+            i32 offset = *(i32 *)(program->code.data + thread->ip++);
+
+            i32 a = thread->registers.int_a;
+            i32 b = thread->registers.int_b;
+
+            b32 do_jump;
+            switch (inst) {
+                case vm_inst_JmpIntGeAB: do_jump = a >= b; break;
+                case vm_inst_JmpIntLeAB: do_jump = a <= b; break;
+                case vm_inst_JmpIntGtAB: do_jump = a > b;  break;
+                case vm_inst_JmpIntLtAB: do_jump = a < b;  break;
+                case vm_inst_JmpIntNeAB: do_jump = a != b; break;
+                case vm_inst_JmpIntEqAB: do_jump = a == b; break;
+                case vm_inst_JmpIntZeA:  do_jump = a == 0; break;
+                case vm_inst_JmpIntNzA:  do_jump = a != 0; break;
+                default: UNREACHABLE();
+            }
+
+            if (do_jump) {
+                thread->ip = (u32)(*(i32 *)(&thread->ip) + offset);
+            }
+        } break;
+
+        default:
+            printf("vm: executing unknown instruction: %d\n", inst);
+            exit(1);
+    }
+}
+
+b32
+vm_is_running(const vm_program_t *program, vm_thread_t *thread)
+{
+    vm_inst_t inst = program->code.data[thread->ip];
+
+    return inst != vm_inst_Halt && (inst != vm_inst_Ret || thread->frames.count > 0);
+}
+
+#if defined(COMPILER_GNUC) || defined(COMPILER_CLANG)
+    #define VM_THREADED_DISPATCH
+#endif
+
+/* Threaded interpreter over the decoded instruction stream.
+ * Every handler reads its already resolved operands and jumps straight to the handler
+ * of the next record, so there is no central loop and no shared indirect branch.
+ * `vm_inst_Halt` and returning from the outermost function are the only ways out.
+ * Without labels-as-values the same handlers are compiled into a switch loop.
+ * Calling it with `program == NULL` returns the handler table used by the decoder.
+ */
+
+#if defined(VM_THREADED_DISPATCH)
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+static const void **
+vm_run(const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 op_index)
+{
+    (void)cz;
+
+#if defined(VM_THREADED_DISPATCH)
+    static const void *handlers[VM_INST_COUNT] = {
+        [vm_inst_Halt]     = &&op_Halt,
+        [vm_inst_IncSP]    = &&op_IncSP,
+        [vm_inst_MemMove]  = &&op_MemMove,
+        [vm_inst_AddInt]   = &&op_AddInt,
+        [vm_inst_SubInt]   = &&op_SubInt,
+        [vm_inst_Load]     = &&op_Load,
+        [vm_inst_LoadImm]  = &&op_LoadImm,
+        [vm_inst_Store]    = &&op_Store,
+        [vm_inst_Call]     = &&op_Call,
+        [vm_inst_TailCall] = &&op_TailCall,
+        [vm_inst_Ret]      = &&op_Ret,
+        [vm_inst_Stub]     = &&op_Stub,
+        [vm_inst_JmpUc]    = &&op_JmpUc,
+        [vm_inst_JmpIntNz] = &&op_JmpIntNz,
+        [vm_inst_JmpIntZe] = &&op_JmpIntZe,
+        [vm_inst_JmpIntEq] = &&op_JmpIntEq,
+        [vm_inst_JmpIntNe] = &&op_JmpIntNe,
+        [vm_inst_JmpIntLt] = &&op_JmpIntLt,
+        [vm_inst_JmpIntGt] = &&op_JmpIntGt,
+        [vm_inst_JmpIntLe] = &&op_JmpIntLe,
+        [vm_inst_JmpIntGe] = &&op_JmpIntGe,
+
+        [vm_inst_AddIntReg]   = &&op_AddIntReg,
+        [vm_inst_SubIntReg]   = &&op_SubIntReg,
+        [vm_inst_MoveImmReg]  = &&op_MoveImmReg,
+        [vm_inst_JmpIntNzReg] = &&op_JmpIntNzReg,
+        [vm_inst_JmpIntZeReg] = &&op_JmpIntZeReg,
+        [vm_inst_JmpIntEqReg] = &&op_JmpIntEqReg,
+        [vm_inst_JmpIntNeReg] = &&op_JmpIntNeReg,
+        [vm_inst_JmpIntLtReg] = &&op_JmpIntLtReg,
+        [vm_inst_JmpIntGtReg] = &&op_JmpIntGtReg,
+        [vm_inst_JmpIntLeReg] = &&op_JmpIntLeReg,
+        [vm_inst_JmpIntGeReg] = &&op_JmpIntGeReg,
+
+        [vm_inst_AddIntLL]   = &&op_AddIntLL,
+        [vm_inst_SubIntLL]   = &&op_SubIntLL,
+        [vm_inst_AddIntLI]   = &&op_AddIntLI,
+        [vm_inst_SubIntLI]   = &&op_SubIntLI,
+        [vm_inst_LoadStore]  = &&op_LoadStore,
+        [vm_inst_JmpIntEqLL] = &&op_JmpIntEqLL,
+        [vm_inst_JmpIntNeLL] = &&op_JmpIntNeLL,
+        [vm_inst_JmpIntLtLL] = &&op_JmpIntLtLL,
+        [vm_inst_JmpIntGtLL] = &&op_JmpIntGtLL,
+        [vm_inst_JmpIntLeLL] = &&op_JmpIntLeLL,
+        [vm_inst_JmpIntGeLL] = &&op_JmpIntGeLL,
+        [vm_inst_JmpIntEqLI] = &&op_JmpIntEqLI,
+        [vm_inst_JmpIntNeLI] = &&op_JmpIntNeLI,
+        [vm_inst_JmpIntLtLI] = &&op_JmpIntLtLI,
+        [vm_inst_JmpIntGtLI] = &&op_JmpIntGtLI,
+        [vm_inst_JmpIntLeLI] = &&op_JmpIntLeLI,
+        [vm_inst_JmpIntGeLI] = &&op_JmpIntGeLI,
+
+        [vm_inst_LoadA]      = &&op_LoadA,
+        [vm_inst_LoadB]      = &&op_LoadB,
+        [vm_inst_LoadImmA]   = &&op_LoadImmA,
+        [vm_inst_LoadImmB]   = &&op_LoadImmB,
+        [vm_inst_StoreA]     = &&op_StoreA,
+        [vm_inst_StoreB]     = &&op_StoreB,
+        [vm_inst_SpillA]     = &&op_SpillA,
+        [vm_inst_FillA]      = &&op_FillA,
+        [vm_inst_AddIntAB]   = &&op_AddIntAB,
+        [vm_inst_SubIntAB]   = &&op_SubIntAB,
+        [vm_inst_JmpIntNzA]  = &&op_JmpIntNzA,
+        [vm_inst_JmpIntZeA]  = &&op_JmpIntZeA,
+        [vm_inst_JmpIntEqAB] = &&op_JmpIntEqAB,
+        [vm_inst_JmpIntNeAB] = &&op_JmpIntNeAB,
+        [vm_inst_JmpIntLtAB] = &&op_JmpIntLtAB,
+        [vm_inst_JmpIntGtAB] = &&op_JmpIntGtAB,
+        [vm_inst_JmpIntLeAB] = &&op_JmpIntLeAB,
+        [vm_inst_JmpIntGeAB] = &&op_JmpIntGeAB,
+    };
+
+    if (!program)
+        return handlers;
+
+    #define VM_CASE(m_name) op_##m_name: VM_STATS_RECORD(thread, vm_inst_##m_name);
+    #define VM_NEXT()       goto *op->handler
+    #define VM_LOOP()       VM_NEXT();
+    #define VM_LOOP_END()
+#else
+    if (!program)
+        return NULL;
+
+    #define VM_CASE(m_name) case vm_inst_##m_name: VM_STATS_RECORD(thread, vm_inst_##m_name);
+    #define VM_NEXT()       continue
+    #define VM_LOOP()       for (;;) switch (op->inst) {
+    #define VM_LOOP_END()   default: UNREACHABLE(); }
+#endif
+
+#if defined(VM_STATS)
+    if (thread->stats) {
+        thread->stats->last = 0;
+    }
+#endif
+
+    const vm_op_t *ops = program->ops.data;
+    const vm_op_t *op  = ops + op_index;
+
+    u8 *mem = thread->memory.data;
+    u32 sp  = thread->memory.count;
+    u32 bp  = thread->bp;
+
+    // Cached stack values live in locals so the compiler can keep them in machine registers.
+    i32 int_a = thread->registers.int_a;
+    i32 int_b = thread->registers.int_b;
+
+    vm_back_edge_t back_edge = thread->back_edge;
+    const vm_op_t *back_edge_target;
+
+    vm_call_t call = thread->call;
+
+/* Where the sampling profiler finds us, refreshed on entry and on every jump, call and return only.
+ * Falling through into a label keeps the old position, see `sampler.h`.
+ * The fences keep the frame stack complete whenever the position is set.
+ */
+#define VM_SAMPLE_POS() (thread->sample_pos = (u32)(op - ops) + 1)
+#define VM_SAMPLE_HIDE() (thread->sample_pos = 0, atomic_signal_fence(memory_order_seq_cst))
+#define VM_SAMPLE_SHOW() (atomic_signal_fence(memory_order_seq_cst), VM_SAMPLE_POS())
+
+/* Only entering a function reserves, `vm_verify` holds every push below `frame_size`.
+ * The stretchy may move here, nothing else does. Mapped stacks never do, see `stack.h`.
+ */
+#define VM_RESERVE_FRAME(m_frame_size) \
+do { \
+    if (bp + (m_frame_size) > thread->memory.capacity) { \
+        thread->memory.count = bp; \
+        dck_stretchy_reserve(thread->memory, (m_frame_size)); \
+        mem = thread->memory.data; \
+    } \
+} while (0)
+
+#define VM_POP_INT() (sp -= sizeof(i32), *(i32 *)(mem + sp))
+
+// Every jump goes through here, taken backward ones are loop iterations for `back_edge`.
+#define VM_JUMP(m_next) \
+do { \
+    back_edge_target = (m_next); \
+    if (back_edge && back_edge_target <= op) \
+        goto vm_back_edge; \
+    op = back_edge_target; \
+    VM_SAMPLE_POS(); \
+} while (0)
+
+#define VM_JMP_INT_1(m_name, m_cond) \
+    VM_CASE(m_name) { \
+        i32 a = VM_POP_INT(); \
+        VM_JUMP((m_cond) ? ops + op->jmp.target : op + 1); \
+    } VM_NEXT();
+
+#define VM_JMP_INT_2(m_name, m_cond) \
+    VM_CASE(m_name) { \
+        i32 b = VM_POP_INT(); \
+        i32 a = VM_POP_INT(); \
+        VM_JUMP((m_cond) ? ops + op->jmp.target : op + 1); \
+    } VM_NEXT();
+
+#define VM_FRAME_INT(m_offset) (*(i32 *)(mem + bp + (m_offset)))
+
+#define VM_JMP_INT_REG_1(m_name, m_cond) \
+    VM_CASE(m_name) { \
+        i32 a = VM_FRAME_INT(op->reg_jmp.a); \
+        VM_JUMP((m_cond) ? ops + op->reg_jmp.target : op + 1); \
+    } VM_NEXT();
+
+#define VM_JMP_INT_REG_2(m_name, m_cond) \
+    VM_CASE(m_name) { \
+        i32 a = VM_FRAME_INT(op->reg_jmp.a); \
+        i32 b = VM_FRAME_INT(op->reg_jmp.b); \
+        VM_JUMP((m_cond) ? ops + op->reg_jmp.target : op + 1); \
+    } VM_NEXT();
+
+#define VM_ARITH_FUSED(m_name, m_op, m_rhs) \
+    VM_CASE(m_name) { \
+        *(i32 *)(mem + sp) = VM_FRAME_INT(op->fused.l) m_op (m_rhs); \
+        sp += sizeof(i32); \
+        op++; \
+    } VM_NEXT();
+
+#define VM_JMP_INT_FUSED(m_name, m_op, m_rhs) \
+    VM_CASE(m_name) { \
+        VM_JUMP(VM_FRAME_INT(op->fused.l) m_op (m_rhs) ? ops + op->fused.target : op + 1); \
+    } VM_NEXT();
+
+#define VM_JMP_INT_CACHED(m_name, m_cond) \
+    VM_CASE(m_name) { \
+        VM_JUMP((m_cond) ? ops + op->jmp.target : op + 1); \
+    } VM_NEXT();
+
+    VM_SAMPLE_SHOW();
+
+    VM_LOOP()
+
+    VM_CASE(IncSP) {
+        sp += op->inc_sp.amount;
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(MemMove) {
+        u32 dst  = op->mem_move.dst;
+        u32 src  = op->mem_move.src;
+        u32 size = op->mem_move.size;
+
+        memmove(mem + bp + dst, mem + bp + src, size);
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(AddInt) {
+        i32 b = VM_POP_INT();
+        i32 a = VM_POP_INT();
+        *(i32 *)(mem + sp) = a + b;
+        sp += sizeof(i32);
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(SubInt) {
+        i32 b = VM_POP_INT();
+        i32 a = VM_POP_INT();
+        *(i32 *)(mem + sp) = a - b;
+        sp += sizeof(i32);
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(Load) {
+        memcpy(mem + sp, mem + bp + op->mem.offset, op->mem.size);
+        sp += op->mem.size;
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(LoadImm) {
+        memcpy(mem + sp, op->imm.data, op->imm.size);
+        sp += op->imm.size;
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(Store) {
+        sp -= op->mem.size;
+        memcpy(mem + bp + op->mem.offset, mem + sp, op->mem.size);
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(JmpUc) {
+        VM_JUMP(ops + op->jmp.target);
+    } VM_NEXT();
+
+    VM_JMP_INT_1(JmpIntNz, a != 0)
+    VM_JMP_INT_1(JmpIntZe, a == 0)
+    VM_JMP_INT_2(JmpIntEq, a == b)
+    VM_JMP_INT_2(JmpIntNe, a != b)
+    VM_JMP_INT_2(JmpIntLt, a <  b)
+    VM_JMP_INT_2(JmpIntGt, a >  b)
+    VM_JMP_INT_2(JmpIntLe, a <= b)
+    VM_JMP_INT_2(JmpIntGe, a >= b)
+
+    VM_CASE(AddIntReg) {
+        VM_FRAME_INT(op->reg.dst) = VM_FRAME_INT(op->reg.l) + VM_FRAME_INT(op->reg.r);
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(SubIntReg) {
+        VM_FRAME_INT(op->reg.dst) = VM_FRAME_INT(op->reg.l) - VM_FRAME_INT(op->reg.r);
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(MoveImmReg) {
+        memcpy(mem + bp + op->reg_imm.dst, op->reg_imm.data, op->reg_imm.size);
+        op++;
+    } VM_NEXT();
+
+    VM_JMP_INT_REG_1(JmpIntNzReg, a != 0)
+    VM_JMP_INT_REG_1(JmpIntZeReg, a == 0)
+    VM_JMP_INT_REG_2(JmpIntEqReg, a == b)
+    VM_JMP_INT_REG_2(JmpIntNeReg, a != b)
+    VM_JMP_INT_REG_2(JmpIntLtReg, a <  b)
+    VM_JMP_INT_REG_2(JmpIntGtReg, a >  b)
+    VM_JMP_INT_REG_2(JmpIntLeReg, a <= b)
+    VM_JMP_INT_REG_2(JmpIntGeReg, a >= b)
+
+    VM_ARITH_FUSED(AddIntLL, +, VM_FRAME_INT(op->fused.r))
+    VM_ARITH_FUSED(SubIntLL, -, VM_FRAME_INT(op->fused.r))
+    VM_ARITH_FUSED(AddIntLI, +, op->fused.imm)
+    VM_ARITH_FUSED(SubIntLI, -, op->fused.imm)
+
+    VM_CASE(LoadStore) {
+        memcpy(mem + bp + op->mem_move.dst, mem + bp + op->mem_move.src, op->mem_move.size);
+        op++;
+    } VM_NEXT();
+
+    VM_JMP_INT_FUSED(JmpIntEqLL, ==, VM_FRAME_INT(op->fused.r))
+    VM_JMP_INT_FUSED(JmpIntNeLL, !=, VM_FRAME_INT(op->fused.r))
+    VM_JMP_INT_FUSED(JmpIntLtLL, <,  VM_FRAME_INT(op->fused.r))
+    VM_JMP_INT_FUSED(JmpIntGtLL, >,  VM_FRAME_INT(op->fused.r))
+    VM_JMP_INT_FUSED(JmpIntLeLL, <=, VM_FRAME_INT(op->fused.r))
+    VM_JMP_INT_FUSED(JmpIntGeLL, >=, VM_FRAME_INT(op->fused.r))
+    VM_JMP_INT_FUSED(JmpIntEqLI, ==, op->fused.imm)
+    VM_JMP_INT_FUSED(JmpIntNeLI, !=, op->fused.imm)
+    VM_JMP_INT_FUSED(JmpIntLtLI, <,  op->fused.imm)
+    VM_JMP_INT_FUSED(JmpIntGtLI, >,  op->fused.imm)
+    VM_JMP_INT_FUSED(JmpIntLeLI, <=, op->fused.imm)
+    VM_JMP_INT_FUSED(JmpIntGeLI, >=, op->fused.imm)
+
+    VM_CASE(LoadA) {
+        int_a = VM_FRAME_INT(op->cached.offset);
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(LoadB) {
+        int_b = VM_FRAME_INT(op->cached.offset);
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(LoadImmA) {
+        int_a = op->cached.imm;
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(LoadImmB) {
+        int_b = op->cached.imm;
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(StoreA) {
+        VM_FRAME_INT(op->cached.offset) = int_a;
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(StoreB) {
+        VM_FRAME_INT(op->cached.offset) = int_b;
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(SpillA) {
+        *(i32 *)(mem + sp) = int_a;
+        sp += sizeof(i32);
+        int_a = int_b;
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(FillA) {
+        int_b = int_a;
+        int_a = VM_POP_INT();
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(AddIntAB) {
+        int_a += int_b;
+        op++;
+    } VM_NEXT();
+
+    VM_CASE(SubIntAB) {
+        int_a -= int_b;
+        op++;
+    } VM_NEXT();
+
+    VM_JMP_INT_CACHED(JmpIntNzA,  int_a != 0)
+    VM_JMP_INT_CACHED(JmpIntZeA,  int_a == 0)
+    VM_JMP_INT_CACHED(JmpIntEqAB, int_a == int_b)
+    VM_JMP_INT_CACHED(JmpIntNeAB, int_a != int_b)
+    VM_JMP_INT_CACHED(JmpIntLtAB, int_a <  int_b)
+    VM_JMP_INT_CACHED(JmpIntGtAB, int_a >  int_b)
+    VM_JMP_INT_CACHED(JmpIntLeAB, int_a <= int_b)
+    VM_JMP_INT_CACHED(JmpIntGeAB, int_a >= int_b)
+
+    VM_CASE(Call) {
+        if (call) {
+            thread->memory.count = sp;
+            thread->bp = bp + op->call.args;
+
+            b32 is_done = call(thread->call_context, program, thread, op->call.target);
+
+            thread->bp = bp;
+            mem = thread->memory.data;
+
+            // Same as returning from it.
+            if (is_done) {
+                sp = bp + op->call.sp;
+                op++;
+                VM_NEXT();
+            }
+        }
+
+        VM_SAMPLE_HIDE();
+        dck_stretchy_push(thread->frames, (vm_frame_t) {
+            .ret = (u32)(op + 1 - ops),
+            .bp  = bp,
+            .sp  = bp + op->call.sp,
+        });
+
+        bp += op->call.args;
+        VM_RESERVE_FRAME(op->call.frame);
+        sp  = bp + op->call.size;
+
+        op = ops + op->call.target;
+        VM_SAMPLE_SHOW();
+    } VM_NEXT();
+
+    VM_CASE(TailCall) {
+        VM_RESERVE_FRAME(op->call.frame);
+        memmove(mem + bp, mem + bp + op->call.args, op->call.size);
+        sp = bp + op->call.size;
+
+        op = ops + op->call.target;
+        VM_SAMPLE_POS();
+    } VM_NEXT();
+
+    VM_CASE(Ret) {
+        if (thread->frames.count == 0)
+            goto vm_halt;
+
+        VM_SAMPLE_HIDE();
+        vm_frame_t frame = thread->frames.data[--(thread->frames.count)];
+
+        bp = frame.bp;
+        sp = frame.sp;
+        op = ops + frame.ret;
+        VM_SAMPLE_SHOW();
+    } VM_NEXT();
+
+    VM_CASE(Stub) {
+        ASSERT(thread->lazy_program == program && thread->lazy_compiler);
+        u32 code_offset = vm_compile(thread->lazy_program, thread->lazy_compiler, cz,
+                                     (func_ref_t) { .func_index = op->stub.func_index });
+        VM_RESERVE_FRAME(vm_find_function(program, code_offset)->frame_size);
+
+        // Compiling grows the ops, the old pointers are gone.
+        ops = program->ops.data;
+        op  = ops + program->code_ops.data[code_offset];
+        VM_SAMPLE_POS();
+    } VM_NEXT();
+
+    // Out of line so the jumps stay small, the state only has to be written back here.
+    vm_back_edge: {
+        thread->memory.count = sp;
+        thread->bp = bp;
+        thread->registers.int_a = int_a;
+        thread->registers.int_b = int_b;
+
+        op = ops + back_edge(thread->back_edge_context, program, thread, cz, (u32)(back_edge_target - ops));
+
+        mem   = thread->memory.data;
+        sp    = thread->memory.count;
+        int_a = thread->registers.int_a;
+        int_b = thread->registers.int_b;
+        VM_SAMPLE_POS();
+    } VM_NEXT();
+
+    VM_CASE(Halt) {
+    vm_halt:
+        thread->sample_pos = 0;
+
+        // Leave the IP on the halt, same as stepping does.
+        thread->ip = op->code_offset;
+        thread->memory.count = sp;
+
+        thread->registers.int_a = int_a;
+        thread->registers.int_b = int_b;
+    } return NULL;
+
+    VM_LOOP_END()
+
+#undef VM_JMP_INT_CACHED
+#undef VM_JMP_INT_FUSED
+#undef VM_ARITH_FUSED
+#undef VM_JMP_INT_REG_2
+#undef VM_JMP_INT_REG_1
+#undef VM_FRAME_INT
+#undef VM_JMP_INT_2
+#undef VM_JMP_INT_1
+#undef VM_JUMP
+#undef VM_POP_INT
+#undef VM_SAMPLE_SHOW
+#undef VM_SAMPLE_HIDE
+#undef VM_SAMPLE_POS
+#undef VM_RESERVE_FRAME
+#undef VM_LOOP_END
+#undef VM_LOOP
+#undef VM_NEXT
+#undef VM_CASE
+}
+
+#if defined(VM_THREADED_DISPATCH)
+    #pragma GCC diagnostic pop
+#endif
+
+// Stubs and callees that aren't compiled yet have no frame, the call reserves it once they do.
+static u32
+vm_callee_frame_size(const vm_program_t *program, u32 target)
+{
+    if (target == CZ_NO_ID)
+        return 0;
+
+    const vm_function_t *function = vm_find_function(program, target);
+    return function ? function->frame_size : 0;
+}
+
+static void
+vm_decode(vm_program_t *program, u32 code_offset)
+{
+    ASSERT(program->code_ops.count == code_offset);
+
+    const void **handlers = vm_run(NULL, NULL, NULL, 0);
+
+    // Number the instructions first so that forward jumps can be resolved.
+    u32 op_index = program->ops.count;
+
+    for (u32 ip = code_offset; ip < program->code.count;) {
+        u32 size = vm_inst_size(program, ip);
+
+        dck_stretchy_push(program->code_ops, op_index++);
+        for (u32 i = 1; i < size; ++i) {
+            dck_stretchy_push(program->code_ops, CZ_NO_ID);
+        }
+
+        ip += size;
+    }
+
+    for (u32 ip = code_offset; ip < program->code.count; ip += vm_inst_size(program, ip)) {
+        vm_inst_t inst = program->code.data[ip];
+        const u32 *args = program->code.data + ip + 1;
+
+        vm_op_t op = {
+            .handler     = handlers ? handlers[inst] : NULL,
+            .inst        = inst,
+            .code_offset = ip,
+        };
+
+        switch (inst) {
+            case vm_inst_Halt:   /* fallthrough */
+            case vm_inst_Ret:    /* fallthrough */
+            case vm_inst_AddInt: /* fallthrough */
+            case vm_inst_SubInt:
+                break;
+
+            case vm_inst_Call:
+                op.call.args   = args[0];
+                op.call.size   = args[1];
+                op.call.sp     = args[2];
+                // Patched by `vm_compile` once the callee is compiled.
+                op.call.target = args[3] != CZ_NO_ID ? program->code_ops.data[args[3]] : CZ_NO_ID;
+                op.call.frame  = vm_callee_frame_size(program, args[3]);
+                break;
+
+            case vm_inst_TailCall:
+                op.call.args   = args[0];
+                op.call.size   = args[1];
+                op.call.target = args[2] != CZ_NO_ID ? program->code_ops.data[args[2]] : CZ_NO_ID;
+                op.call.frame  = vm_callee_frame_size(program, args[2]);
+                break;
+
+            case vm_inst_Stub:
+                op.stub.func_index = args[0];
+                break;
+
+            case vm_inst_IncSP:
+                op.inc_sp.amount = args[0];
+                break;
+
+            case vm_inst_MemMove:
+                op.mem_move.dst  = args[0];
+                op.mem_move.src  = args[1];
+                op.mem_move.size = args[2];
+                break;
+
+            case vm_inst_Load: /* fallthrough */
+            case vm_inst_Store:
+                op.mem.offset = args[0];
+                op.mem.size   = args[1];
+                break;
+
+            case vm_inst_LoadImm:
+                op.imm.size = args[0];
+                ASSERT(op.imm.size <= sizeof(op.imm.data)); // TODO: Pool for big immediates.
+                memcpy(op.imm.data, args + 1, op.imm.size);
+                break;
+
+            case vm_inst_JmpUc:    /* fallthrough */
+            case vm_inst_JmpIntNz: /* fallthrough */
+            case vm_inst_JmpIntZe: /* fallthrough */
+            case vm_inst_JmpIntEq: /* fallthrough */
+            case vm_inst_JmpIntNe: /* fallthrough */
+            case vm_inst_JmpIntLt: /* fallthrough */
+            case vm_inst_JmpIntGt: /* fallthrough */
+            case vm_inst_JmpIntLe: /* fallthrough */
+            case vm_inst_JmpIntGe: {
+                u32 target = (u32)((i32)(ip + 2) + (i32)args[0]);
+                ASSERT(target < program->code_ops.count);
+                op.jmp.target = program->code_ops.data[target];
+                ASSERT(op.jmp.target != CZ_NO_ID);
+            } break;
+
+            case vm_inst_AddIntReg: /* fallthrough */
+            case vm_inst_SubIntReg:
+                op.reg.dst = args[0];
+                op.reg.l   = args[1];
+                op.reg.r   = args[2];
+                break;
+
+            case vm_inst_MoveImmReg:
+                op.reg_imm.dst  = args[0];
+                op.reg_imm.size = args[1];
+                ASSERT(op.reg_imm.size <= sizeof(op.reg_imm.data)); // TODO: Pool for big immediates.
+                memcpy(op.reg_imm.data, args + 2, op.reg_imm.size);
+                break;
+
+            case vm_inst_JmpIntNzReg: /* fallthrough */
+            case vm_inst_JmpIntZeReg: /* fallthrough */
+            case vm_inst_JmpIntEqReg: /* fallthrough */
+            case vm_inst_JmpIntNeReg: /* fallthrough */
+            case vm_inst_JmpIntLtReg: /* fallthrough */
+            case vm_inst_JmpIntGtReg: /* fallthrough */
+            case vm_inst_JmpIntLeReg: /* fallthrough */
+            case vm_inst_JmpIntGeReg: {
+                u32 size = vm_inst_size(program, ip);
+
+                op.reg_jmp.a = args[0];
+                op.reg_jmp.b = size == 4 ? args[1] : 0;
+
+                u32 target = (u32)((i32)(ip + size) + (i32)args[size - 2]);
+                ASSERT(target < program->code_ops.count);
+                op.reg_jmp.target = program->code_ops.data[target];
+                ASSERT(op.reg_jmp.target != CZ_NO_ID);
+            } break;
+
+            case vm_inst_AddIntLL: /* fallthrough */
+            case vm_inst_SubIntLL: /* fallthrough */
+            case vm_inst_AddIntLI: /* fallthrough */
+            case vm_inst_SubIntLI:
+                op.fused.l = args[0];
+                op.fused.r = args[1];
+                break;
+
+            case vm_inst_LoadStore:
+                op.mem_move.dst  = args[0];
+                op.mem_move.src  = args[1];
+                op.mem_move.size = args[2];
+                break;
+
+            case vm_inst_JmpIntEqLL: /* fallthrough */
+            case vm_inst_JmpIntNeLL: /* fallthrough */
+            case vm_inst_JmpIntLtLL: /* fallthrough */
+            case vm_inst_JmpIntGtLL: /* fallthrough */
+            case vm_inst_JmpIntLeLL: /* fallthrough */
+            case vm_inst_JmpIntGeLL: /* fallthrough */
+            case vm_inst_JmpIntEqLI: /* fallthrough */
+            case vm_inst_JmpIntNeLI: /* fallthrough */
+            case vm_inst_JmpIntLtLI: /* fallthrough */
+            case vm_inst_JmpIntGtLI: /* fallthrough */
+            case vm_inst_JmpIntLeLI: /* fallthrough */
+            case vm_inst_JmpIntGeLI: {
+                op.fused.l = args[0];
+                op.fused.r = args[1];
+
+                u32 target = (u32)((i32)(ip + 4) + (i32)args[2]);
+                ASSERT(target < program->code_ops.count);
+                op.fused.target = program->code_ops.data[target];
+                ASSERT(op.fused.target != CZ_NO_ID);
+            } break;
+
+            case vm_inst_LoadA:  /* fallthrough */
+            case vm_inst_LoadB:  /* fallthrough */
+            case vm_inst_StoreA: /* fallthrough */
+            case vm_inst_StoreB:
+                op.cached.offset = args[0];
+                break;
+
+            case vm_inst_LoadImmA: /* fallthrough */
+            case vm_inst_LoadImmB:
+                op.cached.imm = (i32)args[0];
+                break;
+
+            case vm_inst_SpillA:   /* fallthrough */
+            case vm_inst_FillA:    /* fallthrough */
+            case vm_inst_AddIntAB: /* fallthrough */
+            case vm_inst_SubIntAB:
+                break;
+
+            case vm_inst_JmpIntNzA:  /* fallthrough */
+            case vm_inst_JmpIntZeA:  /* fallthrough */
+            case vm_inst_JmpIntEqAB: /* fallthrough */
+            case vm_inst_JmpIntNeAB: /* fallthrough */
+            case vm_inst_JmpIntLtAB: /* fallthrough */
+            case vm_inst_JmpIntGtAB: /* fallthrough */
+            case vm_inst_JmpIntLeAB: /* fallthrough */
+            case vm_inst_JmpIntGeAB: {
+                u32 target = (u32)((i32)(ip + 2) + (i32)args[0]);
+                ASSERT(target < program->code_ops.count);
+                op.jmp.target = program->code_ops.data[target];
+                ASSERT(op.jmp.target != CZ_NO_ID);
+            } break;
+
+            case VM_INST_COUNT: UNREACHABLE();
+        }
+
+        dck_stretchy_push(program->ops, op);
+    }
+}
+
+void
+vm_execute(const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset)
+{
+    // Calls reserve the frames of their callees, the outermost one is reserved here.
+    vm_init(program, thread, code_offset);
+
+    ASSERT(code_offset < program->code_ops.count);
+    u32 op_index = program->code_ops.data[code_offset];
+    ASSERT(op_index != CZ_NO_ID);
+
+    vm_run(program, thread, cz, op_index);
+}
+
+const vm_function_t *
+vm_find_function(const vm_program_t *program, u32 code_offset)
+{
+    for (u32 i = 0; i < program->functions.count; ++i) {
+        if (program->functions.data[i].code_offset == code_offset)
+            return program->functions.data + i;
+    }
+
+    return NULL;
+}
+
+// Functions are compiled back to back, the next one starts where this one ends.
+static u32
+vm_function_end(const vm_program_t *program, u32 code_offset)
+{
+    u32 end = program->code.count;
+
+    for (u32 i = 0; i < program->functions.count; ++i) {
+        u32 start = program->functions.data[i].code_offset;
+
+        if (start > code_offset && start < end) {
+            end = start;
+        }
+    }
+
+    return end;
+}
+
+vm_abs_loc_t
+vm_find_abs_loc(const vm_program_t *program, u32 code_offset)
+{
+    ASSERT(program->abs_locs.count > 0);
+    ASSERT(program->abs_locs.data[0].code_offset <= code_offset);
+
+    // Last entry at or before `code_offset`.
+    u32 lo = 0;
+    u32 hi = program->abs_locs.count;
+
+    while (hi - lo > 1) {
+        u32 mid = lo + (hi - lo) / 2;
+
+        if (program->abs_locs.data[mid].code_offset <= code_offset) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return program->abs_locs.data[lo];
+}
+
+static b32
+vm_verify_fail(vm_verify_error_t *error, u32 code_offset, const char *message)
+{
+    if (error) {
+        error->code_offset = code_offset;
+        error->message     = message;
+    }
+
+    return false;
+}
+
+// Call targets are either unresolved, a compiled function or a stub.
+static b32
+vm_verify_target(const vm_program_t *program, u32 target)
+{
+    if (target == CZ_NO_ID || vm_find_function(program, target))
+        return true;
+
+    return target < program->code.count && program->code.data[target] == vm_inst_Stub
+        && target + 2 <= program->code.count;
+}
+
+b32
+vm_verify(const vm_program_t *program, u32 code_offset, vm_verify_error_t *error)
+{
+    const vm_function_t *function = vm_find_function(program, code_offset);
+    if (function == NULL)
+        return vm_verify_fail(error, code_offset, "not the start of a function");
+
+    const u32 *code = program->code.data;
+    u32 start = code_offset;
+    u32 end   = vm_function_end(program, code_offset);
+    u32 count = end - start;
+
+    // Both indexed from `start`, depths are `CZ_NO_ID` until some path gets there.
+    u8  *is_start = calloc(count, sizeof(u8));
+    u32 *depths   = malloc(count * sizeof(u32));
+    if (is_start == NULL || (depths == NULL && count > 0)) {
+        fprintf(stderr, "%s:%d: alloc failure! exiting...\n", __FILE__, __LINE__);
+        exit(666);
+    }
+
+    dck_stretchy_t (u32, u32) work = {0};
+
+    b32 result = true;
+    u32 ip = start;
+
+#define VM_VERIFY(m_cond, m_message) \
+do { \
+    if (!(m_cond)) { \
+        result = vm_verify_fail(error, ip, (m_message)); \
+        goto end; \
+    } \
+} while (0)
+
+#define VM_IN_FRAME(m_offset, m_size) ((u64)(m_offset) + (m_size) <= sp)
+
+#define VM_ARRIVE(m_target, m_sp) \
+do { \
+    u32 target_ = (m_target); \
+    VM_VERIFY(target_ >= start && target_ < end && is_start[target_ - start], \
+              "jump to no instruction of the function"); \
+    if (depths[target_ - start] == CZ_NO_ID) { \
+        depths[target_ - start] = (m_sp); \
+        dck_stretchy_push(work, target_); \
+    } \
+    VM_VERIFY(depths[target_ - start] == (m_sp), "stack depth differs between paths"); \
+} while (0)
+
+    // Instruction boundaries first, jumps may go forward.
+    while (ip < end) {
+        vm_inst_t inst = code[ip];
+        VM_VERIFY(inst < VM_INST_COUNT, "unknown instruction");
+        VM_VERIFY(inst != vm_inst_LoadImm    || (ip + 2 <= end && code[ip + 1] <= sizeof(u64)),
+                  "bad immediate");
+        VM_VERIFY(inst != vm_inst_MoveImmReg || (ip + 3 <= end && code[ip + 2] <= sizeof(u64)),
+                  "bad immediate");
+
+        u32 size = vm_inst_size(program, ip);
+        VM_VERIFY(size <= end - ip, "instruction runs past the function");
+
+        is_start[ip - start] = true;
+        depths[ip - start] = CZ_NO_ID;
+        ip += size;
+    }
+
+    ip = start;
+    VM_ARRIVE(start, function->in_size);
+
+    while (work.count > 0) {
+        ip = work.data[--work.count];
+
+        vm_inst_t inst = code[ip];
+        const u32 *args = code + ip + 1;
+        u32 size = vm_inst_size(program, ip);
+        u32 sp   = depths[ip - start];
+
+        b32 falls_through = true;
+        b32 is_jump       = false;
+
+        switch (inst) {
+            case vm_inst_Halt: falls_through = false; break;
+
+            case vm_inst_IncSP: {
+                VM_VERIFY((u64)sp + args[0] < CZ_NO_ID, "stack overflow");
+                sp += args[0];
+            } break;
+
+            case vm_inst_MemMove:   /* fallthrough */
+            case vm_inst_LoadStore: {
+                VM_VERIFY(VM_IN_FRAME(args[0], args[2]) && VM_IN_FRAME(args[1], args[2]),
+                          "move out of the frame");
+            } break;
+
+            case vm_inst_AddInt: /* fallthrough */
+            case vm_inst_SubInt: {
+                VM_VERIFY(sp >= sizeof(i32) * 2, "stack underflow");
+                sp -= sizeof(i32);
+            } break;
+
+            case vm_inst_Load: {
+                VM_VERIFY(VM_IN_FRAME(args[0], args[1]), "load out of the frame");
+                VM_VERIFY((u64)sp + args[1] < CZ_NO_ID, "stack overflow");
+                sp += args[1];
+            } break;
+
+            case vm_inst_LoadImm: sp += args[0]; break;
+
+            case vm_inst_Store: {
+                VM_VERIFY(sp >= args[1], "stack underflow");
+                sp -= args[1];
+                VM_VERIFY(VM_IN_FRAME(args[0], args[1]), "store out of the frame");
+            } break;
+
+            case vm_inst_Call: {
+                VM_VERIFY(VM_IN_FRAME(args[0], args[1]), "call arguments out of the frame");
+                VM_VERIFY(args[2] >= args[0], "call results below the arguments");
+                VM_VERIFY(vm_verify_target(program, args[3]), "call to neither a function nor a stub");
+                sp = args[2];
+            } break;
+
+            case vm_inst_TailCall: {
+                VM_VERIFY(VM_IN_FRAME(args[0], args[1]), "call arguments out of the frame");
+                VM_VERIFY(vm_verify_target(program, args[2]), "call to neither a function nor a stub");
+                falls_through = false;
+            } break;
+
+            case vm_inst_Ret: {
+                VM_VERIFY(sp >= function->out_size, "results out of the frame");
+                falls_through = false;
+            } break;
+
+            // Only ever entered through calls.
+            case vm_inst_Stub: falls_through = false; break;
+
+            case vm_inst_JmpUc: falls_through = false; is_jump = true; break;
+
+            case vm_inst_JmpIntNz: /* fallthrough */
+            case vm_inst_JmpIntZe: {
+                VM_VERIFY(sp >= sizeof(i32), "stack underflow");
+                sp -= sizeof(i32);
+                is_jump = true;
+            } break;
+
+            case vm_inst_JmpIntEq: /* fallthrough */
+            case vm_inst_JmpIntNe: /* fallthrough */
+            case vm_inst_JmpIntLt: /* fallthrough */
+            case vm_inst_JmpIntGt: /* fallthrough */
+            case vm_inst_JmpIntLe: /* fallthrough */
+            case vm_inst_JmpIntGe: {
+                VM_VERIFY(sp >= sizeof(i32) * 2, "stack underflow");
+                sp -= sizeof(i32) * 2;
+                is_jump = true;
+            } break;
+
+            case vm_inst_AddIntReg: /* fallthrough */
+            case vm_inst_SubIntReg: {
+                VM_VERIFY(VM_IN_FRAME(args[0], sizeof(i32)) && VM_IN_FRAME(args[1], sizeof(i32))
+                       && VM_IN_FRAME(args[2], sizeof(i32)), "register out of the frame");
+            } break;
+
+            case vm_inst_MoveImmReg: {
+                VM_VERIFY(VM_IN_FRAME(args[0], args[1]), "register out of the frame");
+            } break;
+
+            case vm_inst_JmpIntNzReg: /* fallthrough */
+            case vm_inst_JmpIntZeReg: /* fallthrough */
+            case vm_inst_JmpIntEqLI:  /* fallthrough */
+            case vm_inst_JmpIntNeLI:  /* fallthrough */
+            case vm_inst_JmpIntLtLI:  /* fallthrough */
+            case vm_inst_JmpIntGtLI:  /* fallthrough */
+            case vm_inst_JmpIntLeLI:  /* fallthrough */
+            case vm_inst_JmpIntGeLI: {
+                VM_VERIFY(VM_IN_FRAME(args[0], sizeof(i32)), "register out of the frame");
+                is_jump = true;
+            } break;
+
+            case vm_inst_JmpIntEqReg: /* fallthrough */
+            case vm_inst_JmpIntNeReg: /* fallthrough */
+            case vm_inst_JmpIntLtReg: /* fallthrough */
+            case vm_inst_JmpIntGtReg: /* fallthrough */
+            case vm_inst_JmpIntLeReg: /* fallthrough */
+            case vm_inst_JmpIntGeReg: /* fallthrough */
+            case vm_inst_JmpIntEqLL:  /* fallthrough */
+            case vm_inst_JmpIntNeLL:  /* fallthrough */
+            case vm_inst_JmpIntLtLL:  /* fallthrough */
+            case vm_inst_JmpIntGtLL:  /* fallthrough */
+            case vm_inst_JmpIntLeLL:  /* fallthrough */
+            case vm_inst_JmpIntGeLL: {
+                VM_VERIFY(VM_IN_FRAME(args[0], sizeof(i32)) && VM_IN_FRAME(args[1], sizeof(i32)),
+                          "register out of the frame");
+                is_jump = true;
+            } break;
+
+            case vm_inst_AddIntLL: /* fallthrough */
+            case vm_inst_SubIntLL: {
+                VM_VERIFY(VM_IN_FRAME(args[0], sizeof(i32)) && VM_IN_FRAME(args[1], sizeof(i32)),
+                          "local out of the frame");
+                sp += sizeof(i32);
+            } break;
+
+            case vm_inst_AddIntLI: /* fallthrough */
+            case vm_inst_SubIntLI: {
+                VM_VERIFY(VM_IN_FRAME(args[0], sizeof(i32)), "local out of the frame");
+                sp += sizeof(i32);
+            } break;
+
+            case vm_inst_LoadA:  /* fallthrough */
+            case vm_inst_LoadB:  /* fallthrough */
+            case vm_inst_StoreA: /* fallthrough */
+            case vm_inst_StoreB: {
+                VM_VERIFY(VM_IN_FRAME(args[0], sizeof(i32)), "local out of the frame");
+            } break;
+
+            case vm_inst_LoadImmA: /* fallthrough */
+            case vm_inst_LoadImmB: /* fallthrough */
+            case vm_inst_AddIntAB: /* fallthrough */
+            case vm_inst_SubIntAB: break;
+
+            case vm_inst_SpillA: sp += sizeof(i32); break;
+
+            case vm_inst_FillA: {
+                VM_VERIFY(sp >= sizeof(i32), "stack underflow");
+                sp -= sizeof(i32);
+            } break;
+
+            case vm_inst_JmpIntNzA:  /* fallthrough */
+            case vm_inst_JmpIntZeA:  /* fallthrough */
+            case vm_inst_JmpIntEqAB: /* fallthrough */
+            case vm_inst_JmpIntNeAB: /* fallthrough */
+            case vm_inst_JmpIntLtAB: /* fallthrough */
+            case vm_inst_JmpIntGtAB: /* fallthrough */
+            case vm_inst_JmpIntLeAB: /* fallthrough */
+            case vm_inst_JmpIntGeAB: is_jump = true; break;
+
+            case VM_INST_COUNT: UNREACHABLE();
+        }
+
+        VM_VERIFY(sp <= function->frame_size, "push past the frame size");
+
+        // Offsets are always the last operand, relative to the next instruction.
+        if (is_jump) {
+            i32 offset = *(const i32 *)(args + size - 2);
+            VM_ARRIVE((u32)((i64)ip + size + offset), sp);
+        }
+
+        if (falls_through) {
+            VM_ARRIVE(ip + size, sp);
+        }
+    }
+
+#undef VM_ARRIVE
+#undef VM_IN_FRAME
+#undef VM_VERIFY
+
+end:
+    free(is_start);
+    free(depths);
+    free(work.data);
+
+    return result;
+}
+
+void
+vm_execute_batch(const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset,
+                 const void *inputs, u32 stride, u32 count, void *outputs)
+{
+    const vm_function_t *function = vm_find_function(program, code_offset);
+    ASSERT(function);
+
+    u32 in_size   = function->in_size;
+    u32 out_size  = function->out_size;
+    u32 op_offset = function->op_offset;
+
+    ASSERT(stride >= in_size);
+
+    const u8 *in  = inputs;
+    u8       *out = outputs;
+
+    thread->memory.count = 0;
+    dck_stretchy_reserve(thread->memory, function->frame_size);
+
+    for (u32 i = 0; i < count; ++i) {
+        thread->bp = 0;
+        thread->memory.count = 0;
+        thread->frames.count = 0;
+
+        memcpy(thread->memory.data, in, in_size);
+        thread->memory.count = in_size;
+
+        vm_run(program, thread, cz, op_offset);
+
+        memcpy(out, thread->memory.data, out_size);
+
+        in  += stride;
+        out += out_size;
+    }
+
+    thread->popped_pos = 0;
+}
+
+#if defined(COMPILER_GNUC) || defined(COMPILER_CLANG)
+    #define VM_LANE_ENGINE
+#endif
+
+#if defined(VM_LANE_ENGINE)
+
+#if defined(__AVX2__)
+    #define VM_LANES 8
+#else
+    #define VM_LANES 4
+#endif
+
+typedef i32 vm_lanes_t __attribute__((vector_size(VM_LANES * sizeof(i32))));
+
+/* Lane memory is the frame transposed, one vector per 4 byte word so that word `w` of
+ * every lane sits in `mem[w]`. Everything the compiler emits is `i32` for now, so all
+ * offsets and sizes are whole words.
+ */
+typedef struct
+{
+    vm_lanes_t *mem;
+    u32 capacity;
+
+    // Cached mode registers.
+    vm_lanes_t a, b;
+} vm_lane_state_t;
+
+static void
+vm_lanes_reserve(vm_lane_state_t *state, u32 words)
+{
+    if (words <= state->capacity)
+        return;
+
+    u32 capacity = state->capacity ? state->capacity : 64;
+    while (capacity < words) {
+        capacity *= 2;
+    }
+
+    vm_lanes_t *mem = aligned_alloc(sizeof(vm_lanes_t), capacity * sizeof(vm_lanes_t));
+    if (!mem) {
+        fprintf(stderr, "%s:%d: malloc failure! exiting...\n", __FILE__, __LINE__);
+        exit(666);
+    }
+
+    if (state->mem) {
+        memcpy(mem, state->mem, state->capacity * sizeof(vm_lanes_t));
+        free(state->mem);
+    }
+
+    state->mem      = mem;
+    state->capacity = capacity;
+}
+
+static u32
+vm_word(u32 offset)
+{
+    ASSERT(offset % sizeof(i32) == 0);
+    return offset / sizeof(i32);
+}
+
+/* Executes the op at `op_index` for the lanes in `mask`, inactive lanes keep their values.
+ * Returns the next op, jumps set `target` and the lanes that take it in `taken`,
+ * `target` is `CZ_NO_ID` for everything else.
+ */
+static inline u32
+vm_lanes_step(const vm_program_t *program, vm_lane_state_t *state, u32 op_index, vm_lanes_t mask, u32 *sp,
+              vm_lanes_t *taken, u32 *target)
+{
+    const vm_op_t *op = program->ops.data + op_index;
+    vm_inst_t inst = op->inst;
+
+    u32 next = op_index + 1;
+
+    *target = CZ_NO_ID;
+
+#define VM_LANE_SET(m_dst, m_value) \
+do { \
+    vm_lanes_t value_ = (m_value); \
+    (m_dst) = (value_ & mask) | ((m_dst) & ~mask); \
+} while (0)
+
+#define M(m_offset)    (state->mem[vm_word(m_offset)])
+#define S(m_word)      (state->mem[m_word])
+#define SPLAT(m_value) ((vm_lanes_t) {0} + (m_value))
+
+    switch (inst) {
+        case vm_inst_Halt: /* fallthrough */
+        case vm_inst_Ret:
+            return CZ_NO_ID;
+
+        case vm_inst_Call:     /* fallthrough */
+        case vm_inst_TailCall: /* fallthrough */
+        case vm_inst_Stub:
+            UNREACHABLE(); // `vm_execute_lanes` runs functions with calls one by one.
+
+        case vm_inst_IncSP:
+            *sp += vm_word(op->inc_sp.amount);
+            vm_lanes_reserve(state, *sp);
+            break;
+
+        case vm_inst_MemMove: /* fallthrough */
+        case vm_inst_LoadStore: {
+            u32 dst  = vm_word(op->mem_move.dst);
+            u32 src  = vm_word(op->mem_move.src);
+            u32 size = vm_word(op->mem_move.size);
+
+            vm_lanes_reserve(state, (dst > src ? dst : src) + size);
+
+            if (dst < src) {
+                for (u32 i = 0; i < size; ++i) VM_LANE_SET(S(dst + i), S(src + i));
+            }
+            else {
+                for (u32 i = size; i-- > 0;)   VM_LANE_SET(S(dst + i), S(src + i));
+            }
+        } break;
+
+        case vm_inst_AddInt: /* fallthrough */
+        case vm_inst_SubInt: {
+            *sp -= 1;
+            vm_lanes_t l = S(*sp - 1);
+            vm_lanes_t r = S(*sp);
+            VM_LANE_SET(S(*sp - 1), inst == vm_inst_AddInt ? l + r : l - r);
+        } break;
+
+        case vm_inst_Load: {
+            u32 src  = vm_word(op->mem.offset);
+            u32 size = vm_word(op->mem.size);
+
+            vm_lanes_reserve(state, *sp + size);
+            for (u32 i = 0; i < size; ++i) VM_LANE_SET(S(*sp + i), S(src + i));
+            *sp += size;
+        } break;
+
+        case vm_inst_LoadImm: {
+            ASSERT(op->imm.size == sizeof(i32)); // TODO: Wider immediates.
+
+            vm_lanes_reserve(state, *sp + 1);
+            VM_LANE_SET(S(*sp), SPLAT(*(i32 *)op->imm.data));
+            *sp += 1;
+        } break;
+
+        case vm_inst_Store: {
+            u32 dst  = vm_word(op->mem.offset);
+            u32 size = vm_word(op->mem.size);
+
+            *sp -= size;
+            for (u32 i = 0; i < size; ++i) VM_LANE_SET(S(dst + i), S(*sp + i));
+        } break;
+
+        case vm_inst_JmpUc:
+            *taken  = mask;
+            *target = op->jmp.target;
+            break;
+
+        case vm_inst_JmpIntNz: /* fallthrough */
+        case vm_inst_JmpIntZe: {
+            *sp -= 1;
+            vm_lanes_t a = S(*sp);
+            *taken  = (inst == vm_inst_JmpIntNz ? a != 0 : a == 0) & mask;
+            *target = op->jmp.target;
+        } break;
+
+        case vm_inst_JmpIntEq: /* fallthrough */
+        case vm_inst_JmpIntNe: /* fallthrough */
+        case vm_inst_JmpIntLt: /* fallthrough */
+        case vm_inst_JmpIntGt: /* fallthrough */
+        case vm_inst_JmpIntLe: /* fallthrough */
+        case vm_inst_JmpIntGe: {
+            *sp -= 2;
+            vm_lanes_t a = S(*sp);
+            vm_lanes_t b = S(*sp + 1);
+
+            vm_lanes_t c;
+            switch (inst) {
+                case vm_inst_JmpIntEq: c = a == b; break;
+                case vm_inst_JmpIntNe: c = a != b; break;
+                case vm_inst_JmpIntLt: c = a <  b; break;
+                case vm_inst_JmpIntGt: c = a >  b; break;
+                case vm_inst_JmpIntLe: c = a <= b; break;
+                case vm_inst_JmpIntGe: c = a >= b; break;
+                default: UNREACHABLE();
+            }
+
+            *taken  = c & mask;
+            *target = op->jmp.target;
+        } break;
+
+        case vm_inst_AddIntReg: /* fallthrough */
+        case vm_inst_SubIntReg: {
+            vm_lanes_t l = M(op->reg.l);
+            vm_lanes_t r = M(op->reg.r);
+            VM_LANE_SET(M(op->reg.dst), inst == vm_inst_AddIntReg ? l + r : l - r);
+        } break;
+
+        case vm_inst_MoveImmReg:
+            ASSERT(op->reg_imm.size == sizeof(i32)); // TODO: Wider immediates.
+            VM_LANE_SET(M(op->reg_imm.dst), SPLAT(*(i32 *)op->reg_imm.data));
+            break;
+
+        case vm_inst_JmpIntNzReg: /* fallthrough */
+        case vm_inst_JmpIntZeReg: {
+            vm_lanes_t a = M(op->reg_jmp.a);
+            *taken  = (inst == vm_inst_JmpIntNzReg ? a != 0 : a == 0) & mask;
+            *target = op->reg_jmp.target;
+        } break;
+
+        case vm_inst_JmpIntEqReg: /* fallthrough */
+        case vm_inst_JmpIntNeReg: /* fallthrough */
+        case vm_inst_JmpIntLtReg: /* fallthrough */
+        case vm_inst_JmpIntGtReg: /* fallthrough */
+        case vm_inst_JmpIntLeReg: /* fallthrough */
+        case vm_inst_JmpIntGeReg: /* fallthrough */
+        case vm_inst_JmpIntEqLL:  /* fallthrough */
+        case vm_inst_JmpIntNeLL:  /* fallthrough */
+        case vm_inst_JmpIntLtLL:  /* fallthrough */
+        case vm_inst_JmpIntGtLL:  /* fallthrough */
+        case vm_inst_JmpIntLeLL:  /* fallthrough */
+        case vm_inst_JmpIntGeLL:  /* fallthrough */
+        case vm_inst_JmpIntEqLI:  /* fallthrough */
+        case vm_inst_JmpIntNeLI:  /* fallthrough */
+        case vm_inst_JmpIntLtLI:  /* fallthrough */
+        case vm_inst_JmpIntGtLI:  /* fallthrough */
+        case vm_inst_JmpIntLeLI:  /* fallthrough */
+        case vm_inst_JmpIntGeLI: {
+            u32 kind;
+            vm_lanes_t a, b;
+
+            if (inst >= vm_inst_JmpIntEqLL) {
+                b32 is_imm = inst >= vm_inst_JmpIntEqLI;
+                kind = inst - (is_imm ? vm_inst_JmpIntEqLI : vm_inst_JmpIntEqLL);
+
+                a = M(op->fused.l);
+                b = is_imm ? SPLAT(op->fused.imm) : M(op->fused.r);
+                *target = op->fused.target;
+            }
+            else {
+                kind = inst - vm_inst_JmpIntEqReg;
+
+                a = M(op->reg_jmp.a);
+                b = M(op->reg_jmp.b);
+                *target = op->reg_jmp.target;
+            }
+
+            vm_lanes_t c;
+            switch (kind) {
+                case 0: c = a == b; break;
+                case 1: c = a != b; break;
+                case 2: c = a <  b; break;
+                case 3: c = a >  b; break;
+                case 4: c = a <= b; break;
+                case 5: c = a >= b; break;
+                default: UNREACHABLE();
+            }
+
+            *taken = c & mask;
+        } break;
+
+        case vm_inst_AddIntLL: /* fallthrough */
+        case vm_inst_SubIntLL: /* fallthrough */
+        case vm_inst_AddIntLI: /* fallthrough */
+        case vm_inst_SubIntLI: {
+            vm_lanes_t l = M(op->fused.l);
+            vm_lanes_t r = inst == vm_inst_AddIntLI || inst == vm_inst_SubIntLI ? SPLAT(op->fused.imm)
+                                                                                : M(op->fused.r);
+
+            vm_lanes_reserve(state, *sp + 1);
+            VM_LANE_SET(S(*sp), inst == vm_inst_AddIntLL || inst == vm_inst_AddIntLI ? l + r : l - r);
+            *sp += 1;
+        } break;
+
+        case vm_inst_LoadA:    VM_LANE_SET(state->a, M(op->cached.offset));   break;
+        case vm_inst_LoadB:    VM_LANE_SET(state->b, M(op->cached.offset));   break;
+        case vm_inst_LoadImmA: VM_LANE_SET(state->a, SPLAT(op->cached.imm));  break;
+        case vm_inst_LoadImmB: VM_LANE_SET(state->b, SPLAT(op->cached.imm));  break;
+        case vm_inst_StoreA:   VM_LANE_SET(M(op->cached.offset), state->a);   break;
+        case vm_inst_StoreB:   VM_LANE_SET(M(op->cached.offset), state->b);   break;
+        case vm_inst_AddIntAB: VM_LANE_SET(state->a, state->a + state->b);   break;
+        case vm_inst_SubIntAB: VM_LANE_SET(state->a, state->a - state->b);   break;
+
+        case vm_inst_SpillA:
+            vm_lanes_reserve(state, *sp + 1);
+            VM_LANE_SET(S(*sp), state->a);
+            VM_LANE_SET(state->a, state->b);
+            *sp += 1;
+            break;
+
+        case vm_inst_FillA:
+            *sp -= 1;
+            VM_LANE_SET(state->b, state->a);
+            VM_LANE_SET(state->a, S(*sp));
+            break;
+
+        case vm_inst_JmpIntNzA:  /* fallthrough */
+        case vm_inst_JmpIntZeA:  /* fallthrough */
+        case vm_inst_JmpIntEqAB: /* fallthrough */
+        case vm_inst_JmpIntNeAB: /* fallthrough */
+        case vm_inst_JmpIntLtAB: /* fallthrough */
+        case vm_inst_JmpIntGtAB: /* fallthrough */
+        case vm_inst_JmpIntLeAB: /* fallthrough */
+        case vm_inst_JmpIntGeAB: {
+            vm_lanes_t a = state->a;
+            vm_lanes_t b = state->b;
+
+            vm_lanes_t c;
+            switch (inst) {
+                case vm_inst_JmpIntNzA:  c = a != 0; break;
+                case vm_inst_JmpIntZeA:  c = a == 0; break;
+                case vm_inst_JmpIntEqAB: c = a == b; break;
+                case vm_inst_JmpIntNeAB: c = a != b; break;
+                case vm_inst_JmpIntLtAB: c = a <  b; break;
+                case vm_inst_JmpIntGtAB: c = a >  b; break;
+                case vm_inst_JmpIntLeAB: c = a <= b; break;
+                case vm_inst_JmpIntGeAB: c = a >= b; break;
+                default: UNREACHABLE();
+            }
+
+            *taken  = c & mask;
+            *target = op->jmp.target;
+        } break;
+
+        case VM_INST_COUNT: UNREACHABLE();
+    }
+
+#undef SPLAT
+#undef S
+#undef M
+#undef VM_LANE_SET
+
+    return next;
+}
+
+/* Runs `VM_LANES` invocations of the same code in lock step.
+ * Walks the decoded ops, `ip` here is an op index.
+ * While every live lane is at the same ip one shared ip and stack pointer drive them all.
+ * Once a branch splits them each lane gets its own ip and the smallest one runs next with
+ * the lanes that are there, so lanes reconverge at the first label they all reach.
+ */
+static void
+vm_run_lanes(const vm_program_t *program, vm_lane_state_t *state, u32 op_offset, u32 in_words)
+{
+    u32 ips[VM_LANES];
+    u32 sps[VM_LANES];
+
+    vm_lanes_t live = (vm_lanes_t) {0} - 1;
+
+    u32 ip = op_offset;
+    u32 sp = in_words;
+
+    for (;;) {
+        // Converged, all live lanes share `ip` and `sp`.
+        for (;;) {
+            vm_lanes_t taken;
+            u32 target;
+
+            u32 next = vm_lanes_step(program, state, ip, live, &sp, &taken, &target);
+            if (next == CZ_NO_ID)
+                return;
+
+            if (target == CZ_NO_ID) {
+                ip = next;
+                continue;
+            }
+
+            b32 any = false, all = true;
+            for (u32 i = 0; i < VM_LANES; ++i) {
+                if (!live[i]) continue;
+                any |= taken[i] != 0;
+                all &= taken[i] != 0;
+            }
+
+            if (all && any) {
+                ip = target;
+            }
+            else if (!any) {
+                ip = next;
+            }
+            else {
+                for (u32 i = 0; i < VM_LANES; ++i) {
+                    ips[i] = taken[i] ? target : next;
+                    sps[i] = sp;
+                }
+                break;
+            }
+        }
+
+        // Diverged, always advance the lanes that are furthest behind.
+        for (;;) {
+            u32 min_ip = CZ_NO_ID;
+            b32 is_converged = true;
+            for (u32 i = 0; i < VM_LANES; ++i) {
+                if (!live[i]) continue;
+                if (min_ip != CZ_NO_ID && ips[i] != min_ip) is_converged = false;
+                if (ips[i] < min_ip) min_ip = ips[i];
+            }
+
+            if (min_ip == CZ_NO_ID)
+                return;
+
+            vm_lanes_t mask;
+            u32 lane_sp = 0;
+            for (u32 i = 0; i < VM_LANES; ++i) {
+                mask[i] = live[i] && ips[i] == min_ip ? -1 : 0;
+                if (mask[i]) lane_sp = sps[i];
+            }
+
+            if (is_converged) {
+                ip = min_ip;
+                sp = lane_sp;
+                break;
+            }
+
+            vm_lanes_t taken;
+            u32 target;
+
+            u32 next = vm_lanes_step(program, state, min_ip, mask, &lane_sp, &taken, &target);
 
-                u32 i = 0;
-                for (; i < compiler->labels.count; ++i) {
-                    vm_patch_t patch = compiler->labels.data[i];
+            for (u32 i = 0; i < VM_LANES; ++i) {
+                if (!mask[i]) continue;
 
-                    if (patch.label_index == label_index) {
-                        i32 rel_offset = (i32)patch.absolute_offset - (i32)(vm->code.count + 1);
-                        dck_stretchy_push(vm->code, *((u32*)(&rel_offset)));
-                        break;
-                    }
+                if (next == CZ_NO_ID) {
+                    live[i] = 0;
+                    continue;
                 }
 
-                if (i == compiler->labels.count) {
-                    dck_stretchy_push(compiler->jump_patches, (vm_patch_t) {
-                        .label_index     = label_index,
-                        .absolute_offset = vm->code.count,
-                    });
-                    dck_stretchy_push(vm->code, 0xDEADC0DE);
-                }
-            } break;
+                // Lanes at the same ip are at the same compile time stack depth.
+                ips[i] = target != CZ_NO_ID && taken[i] ? target : next;
+                sps[i] = lane_sp;
+            }
         }
     }
+}
 
-    if (eval_offset != compiler->objects.count) {
-        // TODO: Copy the base pointer and return address to the top of the stack.
+#endif // VM_LANE_ENGINE
 
-        u32 result_object_count = compiler->objects.count - eval_offset;
-        vm_object_t object = compiler->objects.data[eval_offset];
+void
+vm_execute_lanes(const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset,
+                 const void *inputs, u32 stride, u32 count, void *outputs)
+{
+#if defined(VM_LANE_ENGINE)
+    const vm_function_t *function = vm_find_function(program, code_offset);
+    ASSERT(function);
+    ASSERT(stride >= function->in_size);
+
+    // Lanes would need a call stack each.
+    if (function->has_calls) {
+        vm_execute_batch(program, thread, cz, code_offset, inputs, stride, count, outputs);
+        return;
+    }
 
-        u32 move_dst  = 0;
-        u32 move_src  = object.base_offset;
-        u32 move_size = object.size;
+    u32 in_words  = vm_word(function->in_size);
+    u32 out_words = vm_word(function->out_size);
 
-        for (u32 i = 1; i < result_object_count; ++i) {
-            if (move_dst == move_src)
-                break;
+    vm_lane_state_t state = {0};
+    vm_lanes_reserve(&state, in_words + out_words + 1);
 
-            object = compiler->objects.data[eval_offset + i];
+    const u8 *in  = inputs;
+    u8       *out = outputs;
 
-            u32 pos = move_dst + move_size;
-            u32 pos_aligned = vm_align(pos, object.alignment);
-            u32 diff = pos_aligned - pos;
+    for (u32 base = 0; base < count; base += VM_LANES) {
+        u32 lane_count = count - base < VM_LANES ? count - base : VM_LANES;
 
-            if (diff == object.base_offset - object.prev_mem_off) {
-                move_size += diff + object.size;
-                continue;
+        // Missing lanes repeat the first one so they never cause a divergence.
+        for (u32 w = 0; w < in_words; ++w) {
+            for (u32 i = 0; i < VM_LANES; ++i) {
+                u32 lane = i < lane_count ? i : 0;
+                memcpy(&state.mem[w][i], in + (base + lane) * stride + w * sizeof(i32), sizeof(i32));
             }
-
-            dck_stretchy_push(vm->code, vm_inst_MemMove);
-            dck_stretchy_push(vm->code, move_dst);
-            dck_stretchy_push(vm->code, move_src);
-            dck_stretchy_push(vm->code, move_size);
-
-            move_dst  = pos_aligned;
-            move_src  = object.base_offset;
-            move_size = object.base_offset;
         }
 
-        if (move_dst != move_src) {
-            dck_stretchy_push(vm->code, vm_inst_MemMove);
-            dck_stretchy_push(vm->code, move_dst);
-            dck_stretchy_push(vm->code, move_src);
-            dck_stretchy_push(vm->code, move_size);
+        vm_run_lanes(program, &state, function->op_offset, in_words);
+
+        for (u32 i = 0; i < lane_count; ++i) {
+            for (u32 w = 0; w < out_words; ++w) {
+                memcpy(out + (base + i) * function->out_size + w * sizeof(i32), &state.mem[w][i], sizeof(i32));
+            }
         }
     }
-    else {
-        // TODO 
-    }
-
-    dck_stretchy_push(vm->code, vm_inst_Halt);
 
-    return code_offset;
+    free(state.mem);
+#else
+    vm_execute_batch(program, thread, cz, code_offset, inputs, stride, count, outputs);
+#endif
 }
 
 void
-vm_init(vm_t *vm, u32 code_offset)
+vm_push_data(vm_thread_t *thread, u32 alignment, u32 size, void *ptr)
 {
-    vm->ip = code_offset;
-    vm->bp = 0;
+    u8 *data = ptr;
+    u32 to_reserve = size;
+    u32 offset = 0;
 
-    vm->popped_pos = 0;
-}
+    u32 remainder = thread->memory.count % alignment;
+    if (remainder != 0) {
+        offset = alignment - remainder;
+        to_reserve += offset;
+    }
 
-void
-vm_clear(vm_t *vm)
-{
-    vm->memory.count = 0;
+    dck_stretchy_reserve(thread->memory, to_reserve);
+    memcpy(thread->memory.data + thread->memory.count + offset, data, size);
+    thread->memory.count += to_reserve;
 }
 
-void
-vm_step(vm_t *vm, cz_t *cz)
+void *
+vm_get_data(vm_thread_t *thread, u32 alignment, u32 size)
 {
-    (void)cz;
-
-    ASSERT(vm->ip < vm->code.count);
-
-    vm_inst_t inst = vm->code.data[vm->ip];
-
-    if (inst == vm_inst_Halt)
-        return;
+    u32 to_increment = size;
+    u32 offset = 0;
 
-    vm->ip++;
+    u32 remainder = thread->popped_pos % alignment;
+    if (remainder != 0) {
+        offset = alignment - remainder;
+        to_increment += offset;
+    }
 
-    switch (inst) {
-        case vm_inst_IncSP: {
-            ASSERT(vm->ip + 1 <= vm->code.count);
-            u32 amount = vm->code.data[vm->ip++];
+    ASSERT(thread->popped_pos + to_increment <= thread->memory.count);
 
-            dck_stretchy_reserve(vm->memory, amount);
-            vm->memory.count += amount;
-        } break;
+    void *ptr = thread->memory.data + thread->popped_pos + offset;
+    thread->popped_pos += to_increment;
+    return ptr;
+}
 
-        case vm_inst_MemMove: {
-            ASSERT(vm->ip + 3 <= vm->code.count);
-            u32 dst  = vm->code.data[vm->ip++];
-            u32 src  = vm->code.data[vm->ip++];
-            u32 size = vm->code.data[vm->ip++];
+static b32
+vm_is_branch(vm_inst_t inst)
+{
+    return (inst >= vm_inst_JmpIntNz    && inst <= vm_inst_JmpIntGe)    ||
+           (inst >= vm_inst_JmpIntNzReg && inst <= vm_inst_JmpIntGeReg) ||
+           (inst >= vm_inst_JmpIntEqLL  && inst <= vm_inst_JmpIntGeLI)  ||
+           (inst >= vm_inst_JmpIntNzA   && inst <= vm_inst_JmpIntGeAB);
+}
 
-            // 2 access checks
-            u32 max_off = dst;
-            if (max_off < src)
-                max_off = src;
-            if (max_off + size > vm->memory.count) {
-                dck_stretchy_reserve(vm->memory, max_off + size - vm->memory.count);
-            }
+static void
+vm_profile_grow(vm_profile_t *profile, u32 count)
+{
+    if (profile->counts.count >= count)
+        return;
 
-            memmove(vm->memory.data + vm->bp + dst, vm->memory.data + vm->bp + src, size);
-        } break;
+    u32 added = count - profile->counts.count;
 
-        case vm_inst_AddInt: /* fallthrough */
-        case vm_inst_SubInt: {
-            ASSERT(vm->memory.count >= sizeof(i32) * 2);
-            vm->memory.count -= sizeof(i32);
-            i32 a = *(i32 *)(vm->memory.data + vm->memory.count);
-            vm->memory.count -= sizeof(i32);
-            i32 b = *(i32 *)(vm->memory.data + vm->memory.count);
+    dck_stretchy_reserve(profile->counts, added);
+    memset(profile->counts.data + profile->counts.count, 0, added * sizeof(u64));
+    profile->counts.count = count;
 
-            i32 res;
-            if      (inst == vm_inst_AddInt) res = a + b;
-            else if (inst == vm_inst_SubInt) res = a - b;
-            else UNREACHABLE();
+    dck_stretchy_reserve(profile->taken, added);
+    memset(profile->taken.data + profile->taken.count, 0, added * sizeof(u64));
+    profile->taken.count = count;
+}
 
-            *(i32 *)(vm->memory.data + vm->memory.count) = res;
-            vm->memory.count += sizeof(i32);
-        } break;
+void
+vm_execute_profiled(const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset,
+                    vm_profile_t *profile)
+{
+    // The program may have grown since the last run.
+    vm_profile_grow(profile, program->code.count);
 
-        case vm_inst_Load: {
-            ASSERT(vm->ip + 2 <= vm->code.count);
-            u32 base_offset = vm->code.data[vm->ip++];
-            u32 size        = vm->code.data[vm->ip++];
+    vm_init(program, thread, code_offset);
 
-            dck_stretchy_reserve(vm->memory, size);
+    while (vm_is_running(program, thread)) {
+        u32 ip = thread->ip;
+        vm_inst_t inst = program->code.data[ip];
 
-            u32 abs_offset  = vm->bp + base_offset;
-            memcpy(vm->memory.data + vm->memory.count, vm->memory.data + abs_offset, size);
-            vm->memory.count += size;
-        } break;
+        profile->counts.data[ip]++;
 
-        case vm_inst_LoadImm: {
-            ASSERT(vm->ip + 1 <= vm->code.count);
-            u32 size = vm->code.data[vm->ip++];
+        vm_step(program, thread, cz);
 
-            dck_stretchy_reserve(vm->memory, size);
+        if (vm_is_branch(inst) && thread->ip != ip + vm_inst_size(program, ip)) {
+            profile->taken.data[ip]++;
+        }
+    }
 
-            u32 rounded_size = (size + sizeof(vm_inst_t) - 1) / sizeof(vm_inst_t);
-            ASSERT(vm->ip + rounded_size <= vm->code.count);
+    // The final `Ret` or `Halt`.
+    profile->counts.data[thread->ip]++;
+}
 
-            memcpy(vm->memory.data + vm->memory.count, vm->code.data + vm->ip, size);
-            vm->memory.count += size;
-            vm->ip += rounded_size;
-        } break;
+b32
+vm_profile_write(const vm_profile_t *profile, const vm_program_t *program, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
 
-        case vm_inst_JmpUc: {
-            ASSERT(vm->ip + 1 <= vm->code.count);
-            i32 offset = *(i32 *)(vm->code.data + vm->ip++);
+    fprintf(file, "# code_offset func_index inst_index count taken\n");
 
-            vm->ip = (u32)(*(i32 *)(&vm->ip) + offset);
-        } break;
+    for (u32 ip = 0; ip < profile->counts.count; ip += vm_inst_size(program, ip)) {
+        u64 count = profile->counts.data[ip];
+        if (count == 0)
+            continue;
 
-        case vm_inst_JmpIntGe: /* fallthrough */
-        case vm_inst_JmpIntLe: /* fallthrough */
-        case vm_inst_JmpIntGt: /* fallthrough */
-        case vm_inst_JmpIntLt: /* fallthrough */
-        case vm_inst_JmpIntNe: /* fallthrough */
-        case vm_inst_JmpIntEq: /* fallthrough */
-        case vm_inst_JmpIntZe: /* fallthrough */
-        case vm_inst_JmpIntNz: {
-            ASSERT(vm->ip + 1 <= vm->code.count);
-            i32 offset = *(i32 *)(vm->code.data + vm->ip++);
+        vm_abs_loc_t loc = vm_find_abs_loc(program, ip);
 
-            i32 a, b;
-            if (inst != vm_inst_JmpIntZe && inst != vm_inst_JmpIntNz) {
-                ASSERT(vm->memory.count >= sizeof(i32));
-                vm->memory.count -= sizeof(i32);
-                b = *(i32 *)(vm->memory.data + vm->memory.count);
-            }
+        fprintf(file, "%u %u %u %llu ", ip, loc.func_index, loc.inst_index, (unsigned long long)count);
 
-            ASSERT(vm->memory.count >= sizeof(i32));
-            vm->memory.count -= sizeof(i32);
-            a = *(i32 *)(vm->memory.data + vm->memory.count);
+        if (vm_is_branch(program->code.data[ip])) {
+            fprintf(file, "%llu\n", (unsigned long long)profile->taken.data[ip]);
+        }
+        else {
+            fprintf(file, "-\n");
+        }
+    }
 
-            b32 do_jump;
-            switch (inst) {
-                case vm_inst_JmpIntGe: do_jump = a >= b; break;
-                case vm_inst_JmpIntLe: do_jump = a <= b; break;
-                case vm_inst_JmpIntGt: do_jump = a > b;  break;
-                case vm_inst_JmpIntLt: do_jump = a < b;  break;
-                case vm_inst_JmpIntNe: do_jump = a != b; break;
-                case vm_inst_JmpIntEq: do_jump = a == b; break;
-                case vm_inst_JmpIntZe: do_jump = a == 0; break;
-                case vm_inst_JmpIntNz: do_jump = a != 0; break;
-                default: UNREACHABLE();
-            }
+    return fclose(file) == 0;
+}
 
-            if (do_jump) {
-                vm->ip = (u32)(*(i32 *)(&vm->ip) + offset);
-            }
-        } break;
+void
+vm_profile_free(vm_profile_t *profile)
+{
+    free(profile->counts.data);
+    free(profile->taken.data);
 
-        default:
-            printf("vm: executing unknown instruction: %d\n", inst);
-            exit(1);
-    }
+    *profile = (vm_profile_t) {0};
 }
 
-b32
-vm_is_running(vm_t *vm)
+static const char *vm_inst_names[VM_INST_COUNT] = {
+    [vm_inst_Halt]         = "Halt",
+    [vm_inst_IncSP]        = "IncSP",
+    [vm_inst_MemMove]      = "MemMove",
+    [vm_inst_AddInt]       = "AddInt",
+    [vm_inst_SubInt]       = "SubInt",
+    [vm_inst_Load]         = "Load",
+    [vm_inst_LoadImm]      = "LoadImm",
+    [vm_inst_Store]        = "Store",
+    [vm_inst_Call]         = "Call",
+    [vm_inst_TailCall]     = "TailCall",
+    [vm_inst_Ret]          = "Ret",
+    [vm_inst_Stub]         = "Stub",
+    [vm_inst_JmpUc]        = "JmpUc",
+    [vm_inst_JmpIntNz]     = "JmpIntNz",
+    [vm_inst_JmpIntZe]     = "JmpIntZe",
+    [vm_inst_JmpIntEq]     = "JmpIntEq",
+    [vm_inst_JmpIntNe]     = "JmpIntNe",
+    [vm_inst_JmpIntLt]     = "JmpIntLt",
+    [vm_inst_JmpIntGt]     = "JmpIntGt",
+    [vm_inst_JmpIntLe]     = "JmpIntLe",
+    [vm_inst_JmpIntGe]     = "JmpIntGe",
+    [vm_inst_AddIntReg]    = "AddIntReg",
+    [vm_inst_SubIntReg]    = "SubIntReg",
+    [vm_inst_MoveImmReg]   = "MoveImmReg",
+    [vm_inst_JmpIntNzReg]  = "JmpIntNzReg",
+    [vm_inst_JmpIntZeReg]  = "JmpIntZeReg",
+    [vm_inst_JmpIntEqReg]  = "JmpIntEqReg",
+    [vm_inst_JmpIntNeReg]  = "JmpIntNeReg",
+    [vm_inst_JmpIntLtReg]  = "JmpIntLtReg",
+    [vm_inst_JmpIntGtReg]  = "JmpIntGtReg",
+    [vm_inst_JmpIntLeReg]  = "JmpIntLeReg",
+    [vm_inst_JmpIntGeReg]  = "JmpIntGeReg",
+    [vm_inst_AddIntLL]     = "AddIntLL",
+    [vm_inst_SubIntLL]     = "SubIntLL",
+    [vm_inst_AddIntLI]     = "AddIntLI",
+    [vm_inst_SubIntLI]     = "SubIntLI",
+    [vm_inst_LoadStore]    = "LoadStore",
+    [vm_inst_JmpIntEqLL]   = "JmpIntEqLL",
+    [vm_inst_JmpIntNeLL]   = "JmpIntNeLL",
+    [vm_inst_JmpIntLtLL]   = "JmpIntLtLL",
+    [vm_inst_JmpIntGtLL]   = "JmpIntGtLL",
+    [vm_inst_JmpIntLeLL]   = "JmpIntLeLL",
+    [vm_inst_JmpIntGeLL]   = "JmpIntGeLL",
+    [vm_inst_JmpIntEqLI]   = "JmpIntEqLI",
+    [vm_inst_JmpIntNeLI]   = "JmpIntNeLI",
+    [vm_inst_JmpIntLtLI]   = "JmpIntLtLI",
+    [vm_inst_JmpIntGtLI]   = "JmpIntGtLI",
+    [vm_inst_JmpIntLeLI]   = "JmpIntLeLI",
+    [vm_inst_JmpIntGeLI]   = "JmpIntGeLI",
+    [vm_inst_LoadA]        = "LoadA",
+    [vm_inst_LoadB]        = "LoadB",
+    [vm_inst_LoadImmA]     = "LoadImmA",
+    [vm_inst_LoadImmB]     = "LoadImmB",
+    [vm_inst_StoreA]       = "StoreA",
+    [vm_inst_StoreB]       = "StoreB",
+    [vm_inst_SpillA]       = "SpillA",
+    [vm_inst_FillA]        = "FillA",
+    [vm_inst_AddIntAB]     = "AddIntAB",
+    [vm_inst_SubIntAB]     = "SubIntAB",
+    [vm_inst_JmpIntNzA]    = "JmpIntNzA",
+    [vm_inst_JmpIntZeA]    = "JmpIntZeA",
+    [vm_inst_JmpIntEqAB]   = "JmpIntEqAB",
+    [vm_inst_JmpIntNeAB]   = "JmpIntNeAB",
+    [vm_inst_JmpIntLtAB]   = "JmpIntLtAB",
+    [vm_inst_JmpIntGtAB]   = "JmpIntGtAB",
+    [vm_inst_JmpIntLeAB]   = "JmpIntLeAB",
+    [vm_inst_JmpIntGeAB]   = "JmpIntGeAB",
+};
+
+const char *
+vm_inst_name(vm_inst_t inst)
 {
-    ASSERT(vm->ip < vm->code.count);
-
-    return vm->code.data[vm->ip] != vm_inst_Halt;
+    ASSERT(inst < VM_INST_COUNT);
+    return vm_inst_names[inst];
 }
 
-void
-vm_execute(vm_t *vm, cz_t *cz, u32 code_offset)
+#if defined(VM_STATS)
+typedef struct
 {
-    vm_init(vm, code_offset);
+    u64 count;
+    u32 prev, next;
+} vm_stats_entry_t;
 
-    while (vm_is_running(vm)) {
-        vm_step(vm, cz);
-    }
+static int
+vm_stats_entry_compare(const void *a, const void *b)
+{
+    u64 count_a = ((const vm_stats_entry_t *)a)->count;
+    u64 count_b = ((const vm_stats_entry_t *)b)->count;
+
+    return (count_a < count_b) - (count_a > count_b);
 }
 
 void
-vm_push_data(vm_t *vm, u32 alignment, u32 size, void *ptr)
+vm_stats_dump(const vm_stats_t *stats, FILE *file, u32 max_pairs)
 {
-    u8 *data = ptr;
-    u32 to_reserve = size;
-    u32 offset = 0;
+    vm_stats_entry_t *entries = malloc(VM_INST_COUNT * VM_INST_COUNT * sizeof(vm_stats_entry_t));
+    if (entries == NULL) {
+        fprintf(stderr, "%s:%d: malloc failure! exiting...\n", __FILE__, __LINE__);
+        exit(666);
+    }
 
-    u32 remainder = vm->memory.count % alignment;
-    if (remainder != 0) {
-        offset = alignment - remainder;
-        to_reserve += offset;
+    u64 total = 0;
+    u32 entry_count = 0;
+
+    for (u32 inst = 0; inst < VM_INST_COUNT; ++inst) {
+        if (stats->counts[inst] == 0)
+            continue;
+
+        total += stats->counts[inst];
+        entries[entry_count++] = (vm_stats_entry_t) { .count = stats->counts[inst], .prev = inst };
     }
+    qsort(entries, entry_count, sizeof(*entries), vm_stats_entry_compare);
 
-    dck_stretchy_reserve(vm->memory, to_reserve);
-    memcpy(vm->memory.data + vm->memory.count + offset, data, size);
-    vm->memory.count += to_reserve;
-}
+    fprintf(file, "opcodes (%llu):\n", (unsigned long long)total);
+    for (u32 i = 0; i < entry_count; ++i) {
+        fprintf(file, "    %-12s %12llu %6.2f%%\n", vm_inst_names[entries[i].prev],
+                (unsigned long long)entries[i].count, 100.0 * entries[i].count / total);
+    }
 
-void *
-vm_get_data(vm_t *vm, u32 alignment, u32 size)
-{
-    u32 to_increment = size;
-    u32 offset = 0;
+    u64 pair_total = 0;
+    entry_count = 0;
 
-    u32 remainder = vm->popped_pos % alignment;
-    if (remainder != 0) {
-        offset = alignment - remainder;
-        to_increment += offset;
+    for (u32 prev = 0; prev < VM_INST_COUNT; ++prev) {
+        for (u32 next = 0; next < VM_INST_COUNT; ++next) {
+            u64 count = stats->pairs[prev][next];
+            if (count == 0)
+                continue;
+
+            pair_total += count;
+            entries[entry_count++] = (vm_stats_entry_t) { .count = count, .prev = prev, .next = next };
+        }
+    }
+    qsort(entries, entry_count, sizeof(*entries), vm_stats_entry_compare);
+
+    if (max_pairs != 0 && entry_count > max_pairs) {
+        entry_count = max_pairs;
     }
 
-    ASSERT(vm->popped_pos + to_increment < vm->memory.count);
+    fprintf(file, "pairs (%llu):\n", (unsigned long long)pair_total);
+    for (u32 i = 0; i < entry_count; ++i) {
+        fprintf(file, "    %-12s %-12s %12llu %6.2f%%\n",
+                vm_inst_names[entries[i].prev], vm_inst_names[entries[i].next],
+                (unsigned long long)entries[i].count, 100.0 * entries[i].count / pair_total);
+    }
 
-    void *ptr = vm->memory.data + vm->popped_pos + offset;
-    vm->popped_pos += to_increment;
-    return ptr;
+    free(entries);
 }
+#endif
+
+static const char *vm_jmp_suffixes[] = { "nz", "ze", "eq", "ne", "lt", "gt", "le", "ge" };
+
+// Indexed from `vm_inst_LoadA`.
+static const char *vm_cached_names[] = {
+    "load.a", "load.b", "load.imm.a", "load.imm.b", "store.a", "store.b",
+    "spill.a", "fill.a", "add.int.ab", "sub.int.ab",
+};
 
 b32
-vm_print_instruction(vm_t *vm, cz_t *cz)
+vm_print_instruction(const vm_program_t *program, cz_t *cz, u32 *ip)
 {
     (void)cz;
 
-    ASSERT(vm->ip < vm->code.count);
+    ASSERT(*ip < program->code.count);
 
-    vm_inst_t inst = vm->code.data[vm->ip];
+    vm_inst_t inst = program->code.data[*ip];
 
-    printf("%03d  ", vm->ip);
+    printf("%03d  ", *ip);
 
     if (inst == vm_inst_Halt) {
         printf("halt\n");
         return false;
     }
 
-    vm->ip++;
+    if (inst == vm_inst_Ret) {
+        printf("ret\n");
+        return false;
+    }
+
+    (*ip)++;
 
     switch (inst) {
         case vm_inst_IncSP: {
-            ASSERT(vm->ip + 1 <= vm->code.count);
-            u32 amount = vm->code.data[vm->ip++];
+            ASSERT(*ip + 1 <= program->code.count);
+            u32 amount = program->code.data[(*ip)++];
 
             printf("inc.sp %d\n", amount);
         } break;
 
         case vm_inst_MemMove: {
-            ASSERT(vm->ip + 3 <= vm->code.count);
-            u32 dst  = vm->code.data[vm->ip++];
-            u32 src  = vm->code.data[vm->ip++];
-            u32 size = vm->code.data[vm->ip++];
+            ASSERT(*ip + 3 <= program->code.count);
+            u32 dst  = program->code.data[(*ip)++];
+            u32 src  = program->code.data[(*ip)++];
+            u32 size = program->code.data[(*ip)++];
 
             printf("mem.move %d %d %d\n", dst, src, size);
         } break;
 
         case vm_inst_AddInt: {
-            ASSERT(vm->ip + 2 <= vm->code.count);
             printf("add.int\n");
         } break;
 
+        case vm_inst_SubInt: {
+            printf("sub.int\n");
+        } break;
+
         case vm_inst_Load: {
-            ASSERT(vm->ip + 2 <= vm->code.count);
+            ASSERT(*ip + 2 <= program->code.count);
 
-            u32 base_offset = vm->code.data[vm->ip++];
-            u32 size        = vm->code.data[vm->ip++];
+            u32 base_offset = program->code.data[(*ip)++];
+            u32 size        = program->code.data[(*ip)++];
 
             printf("load %d %d\n", base_offset, size);
         } break;
 
         case vm_inst_LoadImm: {
-            ASSERT(vm->ip + 1 <= vm->code.count);
+            ASSERT(*ip + 1 <= program->code.count);
 
-            u32 size = vm->code.data[vm->ip++];
+            u32 size = program->code.data[(*ip)++];
 
             printf("load.imm %d ...\n", size);
 
             u32 rounded_size = (size + sizeof(vm_inst_t) - 1) / sizeof(vm_inst_t);
-            vm->ip += rounded_size;
+            *ip += rounded_size;
+        } break;
+
+        case vm_inst_Store: {
+            ASSERT(*ip + 2 <= program->code.count);
+
+            u32 base_offset = program->code.data[(*ip)++];
+            u32 size        = program->code.data[(*ip)++];
+
+            printf("store %d %d\n", base_offset, size);
+        } break;
+
+        case vm_inst_Call: {
+            ASSERT(*ip + 4 <= program->code.count);
+
+            u32 args   = program->code.data[(*ip)++];
+            u32 size   = program->code.data[(*ip)++];
+            u32 sp     = program->code.data[(*ip)++];
+            u32 target = program->code.data[(*ip)++];
+
+            printf("call %d %d %d -> %03d\n", args, size, sp, target);
+        } break;
+
+        case vm_inst_TailCall: {
+            ASSERT(*ip + 3 <= program->code.count);
+
+            u32 args   = program->code.data[(*ip)++];
+            u32 size   = program->code.data[(*ip)++];
+            u32 target = program->code.data[(*ip)++];
+
+            printf("tail.call %d %d -> %03d\n", args, size, target);
+        } break;
+
+        case vm_inst_Stub: {
+            ASSERT(*ip + 1 <= program->code.count);
+
+            u32 func_index = program->code.data[(*ip)++];
+
+            printf("stub f%d\n", func_index);
         } break;
 
         case vm_inst_JmpUc: {
-            ASSERT(vm->ip + 1 <= vm->code.count);
-            i32 offset = *((i32 *)(vm->code.data + vm->ip++));
+            ASSERT(*ip + 1 <= program->code.count);
+            i32 offset = *((i32 *)(program->code.data + (*ip)++));
 
             printf("jmp.uc %d\n", offset);
         } break;
@@ -631,11 +4304,149 @@ vm_print_instruction(vm_t *vm, cz_t *cz)
         case vm_inst_JmpIntGt: /* fallthrough */
         case vm_inst_JmpIntLe: /* fallthrough */
         case vm_inst_JmpIntGe: {
-            ASSERT(vm->ip + 1 <= vm->code.count);
-            i32 offset = *((i32 *)(vm->code.data + vm->ip++));
+            ASSERT(*ip + 1 <= program->code.count);
+            i32 offset = *((i32 *)(program->code.data + (*ip)++));
+
+            printf("jmp.int.%s %d\n", vm_jmp_suffixes[inst - vm_inst_JmpIntNz], offset);
+        } break;
+
+        case vm_inst_AddIntReg: /* fallthrough */
+        case vm_inst_SubIntReg: {
+            ASSERT(*ip + 3 <= program->code.count);
+            u32 dst = program->code.data[(*ip)++];
+            u32 l   = program->code.data[(*ip)++];
+            u32 r   = program->code.data[(*ip)++];
+
+            printf("%s.int.reg %d %d %d\n", inst == vm_inst_AddIntReg ? "add" : "sub", dst, l, r);
+        } break;
+
+        case vm_inst_MoveImmReg: {
+            ASSERT(*ip + 2 <= program->code.count);
+            u32 dst  = program->code.data[(*ip)++];
+            u32 size = program->code.data[(*ip)++];
+
+            printf("move.imm.reg %d %d ...\n", dst, size);
+
+            u32 rounded_size = (size + sizeof(vm_inst_t) - 1) / sizeof(vm_inst_t);
+            *ip += rounded_size;
+        } break;
+
+        case vm_inst_JmpIntNzReg: /* fallthrough */
+        case vm_inst_JmpIntZeReg: {
+            ASSERT(*ip + 2 <= program->code.count);
+            u32 a = program->code.data[(*ip)++];
+            i32 offset = *((i32 *)(program->code.data + (*ip)++));
+
+            printf("jmp.int.%s.reg %d %d\n", vm_jmp_suffixes[inst - vm_inst_JmpIntNzReg], a, offset);
+        } break;
+
+        case vm_inst_JmpIntEqReg: /* fallthrough */
+        case vm_inst_JmpIntNeReg: /* fallthrough */
+        case vm_inst_JmpIntLtReg: /* fallthrough */
+        case vm_inst_JmpIntGtReg: /* fallthrough */
+        case vm_inst_JmpIntLeReg: /* fallthrough */
+        case vm_inst_JmpIntGeReg: {
+            ASSERT(*ip + 3 <= program->code.count);
+            u32 a = program->code.data[(*ip)++];
+            u32 b = program->code.data[(*ip)++];
+            i32 offset = *((i32 *)(program->code.data + (*ip)++));
+
+            printf("jmp.int.%s.reg %d %d %d\n", vm_jmp_suffixes[inst - vm_inst_JmpIntNzReg], a, b, offset);
+        } break;
+
+        case vm_inst_AddIntLL: /* fallthrough */
+        case vm_inst_SubIntLL: /* fallthrough */
+        case vm_inst_AddIntLI: /* fallthrough */
+        case vm_inst_SubIntLI: {
+            ASSERT(*ip + 2 <= program->code.count);
+            u32 l = program->code.data[(*ip)++];
+            u32 r = program->code.data[(*ip)++];
+
+            char *name = inst == vm_inst_AddIntLL || inst == vm_inst_AddIntLI ? "add" : "sub";
+
+            if (inst == vm_inst_AddIntLL || inst == vm_inst_SubIntLL) {
+                printf("%s.int.ll %d %d\n", name, l, r);
+            }
+            else {
+                printf("%s.int.li %d (%d)\n", name, l, (i32)r);
+            }
+        } break;
 
-            char *suffs[] = { "nz", "ze", "eq", "ne", "lt", "gt", "le", "ge" };
-            printf("jmp.int.%s %d\n", suffs[inst - vm_inst_JmpIntNz], offset);
+        case vm_inst_LoadStore: {
+            ASSERT(*ip + 3 <= program->code.count);
+            u32 dst  = program->code.data[(*ip)++];
+            u32 src  = program->code.data[(*ip)++];
+            u32 size = program->code.data[(*ip)++];
+
+            printf("load.store %d %d %d\n", dst, src, size);
+        } break;
+
+        case vm_inst_JmpIntEqLL: /* fallthrough */
+        case vm_inst_JmpIntNeLL: /* fallthrough */
+        case vm_inst_JmpIntLtLL: /* fallthrough */
+        case vm_inst_JmpIntGtLL: /* fallthrough */
+        case vm_inst_JmpIntLeLL: /* fallthrough */
+        case vm_inst_JmpIntGeLL: {
+            ASSERT(*ip + 3 <= program->code.count);
+            u32 l = program->code.data[(*ip)++];
+            u32 r = program->code.data[(*ip)++];
+            i32 offset = *((i32 *)(program->code.data + (*ip)++));
+
+            printf("jmp.int.%s.ll %d %d %d\n", vm_jmp_suffixes[2 + inst - vm_inst_JmpIntEqLL], l, r, offset);
+        } break;
+
+        case vm_inst_JmpIntEqLI: /* fallthrough */
+        case vm_inst_JmpIntNeLI: /* fallthrough */
+        case vm_inst_JmpIntLtLI: /* fallthrough */
+        case vm_inst_JmpIntGtLI: /* fallthrough */
+        case vm_inst_JmpIntLeLI: /* fallthrough */
+        case vm_inst_JmpIntGeLI: {
+            ASSERT(*ip + 3 <= program->code.count);
+            u32 l = program->code.data[(*ip)++];
+            i32 r = (i32)program->code.data[(*ip)++];
+            i32 offset = *((i32 *)(program->code.data + (*ip)++));
+
+            printf("jmp.int.%s.li %d (%d) %d\n", vm_jmp_suffixes[2 + inst - vm_inst_JmpIntEqLI], l, r, offset);
+        } break;
+
+        case vm_inst_LoadA:  /* fallthrough */
+        case vm_inst_LoadB:  /* fallthrough */
+        case vm_inst_StoreA: /* fallthrough */
+        case vm_inst_StoreB: {
+            ASSERT(*ip + 1 <= program->code.count);
+            u32 base_offset = program->code.data[(*ip)++];
+
+            printf("%s %d\n", vm_cached_names[inst - vm_inst_LoadA], base_offset);
+        } break;
+
+        case vm_inst_LoadImmA: /* fallthrough */
+        case vm_inst_LoadImmB: {
+            ASSERT(*ip + 1 <= program->code.count);
+            i32 imm = (i32)program->code.data[(*ip)++];
+
+            printf("%s (%d)\n", vm_cached_names[inst - vm_inst_LoadA], imm);
+        } break;
+
+        case vm_inst_SpillA:   /* fallthrough */
+        case vm_inst_FillA:    /* fallthrough */
+        case vm_inst_AddIntAB: /* fallthrough */
+        case vm_inst_SubIntAB: {
+            printf("%s\n", vm_cached_names[inst - vm_inst_LoadA]);
+        } break;
+
+        case vm_inst_JmpIntNzA:  /* fallthrough */
+        case vm_inst_JmpIntZeA:  /* fallthrough */
+        case vm_inst_JmpIntEqAB: /* fallthrough */
+        case vm_inst_JmpIntNeAB: /* fallthrough */
+        case vm_inst_JmpIntLtAB: /* fallthrough */
+        case vm_inst_JmpIntGtAB: /* fallthrough */
+        case vm_inst_JmpIntLeAB: /* fallthrough */
+        case vm_inst_JmpIntGeAB: {
+            ASSERT(*ip + 1 <= program->code.count);
+            i32 offset = *((i32 *)(program->code.data + (*ip)++));
+
+            printf("jmp.int.%s.%s %d\n", vm_jmp_suffixes[inst - vm_inst_JmpIntNzA],
+                   inst < vm_inst_JmpIntEqAB ? "a" : "ab", offset);
         } break;
 
         default:
@@ -646,10 +4457,217 @@ vm_print_instruction(vm_t *vm, cz_t *cz)
 }
 
 void
-vm_disassemble(vm_t *vm, cz_t *cz, u32 code_offset)
+vm_disassemble(const vm_program_t *program, cz_t *cz, u32 code_offset)
+{
+    u32 end = vm_function_end(program, code_offset);
+
+    // Cold blocks may follow the return.
+    for (u32 ip = code_offset; ip < end;) {
+        if (!vm_print_instruction(program, cz, &ip)) {
+            ip += vm_inst_size(program, ip);
+        }
+    }
+}
+
+void
+vm_print_op(const vm_program_t *program, u32 op_index)
+{
+    ASSERT(op_index < program->ops.count);
+
+    vm_op_t *op = program->ops.data + op_index;
+
+    printf("%03d  (%03d)  ", op_index, op->code_offset);
+
+    switch (op->inst) {
+        case vm_inst_Halt:
+            printf("halt\n");
+            break;
+
+        case vm_inst_IncSP:
+            printf("inc.sp %d\n", op->inc_sp.amount);
+            break;
+
+        case vm_inst_MemMove:
+            printf("mem.move %d %d %d\n", op->mem_move.dst, op->mem_move.src, op->mem_move.size);
+            break;
+
+        case vm_inst_AddInt:
+            printf("add.int\n");
+            break;
+
+        case vm_inst_SubInt:
+            printf("sub.int\n");
+            break;
+
+        case vm_inst_Load:
+            printf("load %d %d\n", op->mem.offset, op->mem.size);
+            break;
+
+        case vm_inst_LoadImm:
+            if (op->imm.size == sizeof(i32)) {
+                printf("load.imm %d (%d)\n", op->imm.size, *(i32 *)op->imm.data);
+            }
+            else {
+                printf("load.imm %d ...\n", op->imm.size);
+            }
+            break;
+
+        case vm_inst_Store:
+            printf("store %d %d\n", op->mem.offset, op->mem.size);
+            break;
+
+        case vm_inst_Call:
+            printf("call %d %d %d -> %03d\n", op->call.args, op->call.size, op->call.sp, op->call.target);
+            break;
+
+        case vm_inst_TailCall:
+            printf("tail.call %d %d -> %03d\n", op->call.args, op->call.size, op->call.target);
+            break;
+
+        case vm_inst_Stub:
+            printf("stub f%d\n", op->stub.func_index);
+            break;
+
+        case vm_inst_Ret:
+            printf("ret\n");
+            break;
+
+        case vm_inst_JmpUc:
+            printf("jmp.uc -> %03d\n", op->jmp.target);
+            break;
+
+        case vm_inst_JmpIntNz: /* fallthrough */
+        case vm_inst_JmpIntZe: /* fallthrough */
+        case vm_inst_JmpIntEq: /* fallthrough */
+        case vm_inst_JmpIntNe: /* fallthrough */
+        case vm_inst_JmpIntLt: /* fallthrough */
+        case vm_inst_JmpIntGt: /* fallthrough */
+        case vm_inst_JmpIntLe: /* fallthrough */
+        case vm_inst_JmpIntGe:
+            printf("jmp.int.%s -> %03d\n", vm_jmp_suffixes[op->inst - vm_inst_JmpIntNz], op->jmp.target);
+            break;
+
+        case vm_inst_AddIntReg:
+            printf("add.int.reg %d %d %d\n", op->reg.dst, op->reg.l, op->reg.r);
+            break;
+
+        case vm_inst_SubIntReg:
+            printf("sub.int.reg %d %d %d\n", op->reg.dst, op->reg.l, op->reg.r);
+            break;
+
+        case vm_inst_MoveImmReg:
+            if (op->reg_imm.size == sizeof(i32)) {
+                printf("move.imm.reg %d %d (%d)\n", op->reg_imm.dst, op->reg_imm.size, *(i32 *)op->reg_imm.data);
+            }
+            else {
+                printf("move.imm.reg %d %d ...\n", op->reg_imm.dst, op->reg_imm.size);
+            }
+            break;
+
+        case vm_inst_JmpIntNzReg: /* fallthrough */
+        case vm_inst_JmpIntZeReg:
+            printf("jmp.int.%s.reg %d -> %03d\n", vm_jmp_suffixes[op->inst - vm_inst_JmpIntNzReg],
+                   op->reg_jmp.a, op->reg_jmp.target);
+            break;
+
+        case vm_inst_JmpIntEqReg: /* fallthrough */
+        case vm_inst_JmpIntNeReg: /* fallthrough */
+        case vm_inst_JmpIntLtReg: /* fallthrough */
+        case vm_inst_JmpIntGtReg: /* fallthrough */
+        case vm_inst_JmpIntLeReg: /* fallthrough */
+        case vm_inst_JmpIntGeReg:
+            printf("jmp.int.%s.reg %d %d -> %03d\n", vm_jmp_suffixes[op->inst - vm_inst_JmpIntNzReg],
+                   op->reg_jmp.a, op->reg_jmp.b, op->reg_jmp.target);
+            break;
+
+        case vm_inst_AddIntLL:
+            printf("add.int.ll %d %d\n", op->fused.l, op->fused.r);
+            break;
+
+        case vm_inst_SubIntLL:
+            printf("sub.int.ll %d %d\n", op->fused.l, op->fused.r);
+            break;
+
+        case vm_inst_AddIntLI:
+            printf("add.int.li %d (%d)\n", op->fused.l, op->fused.imm);
+            break;
+
+        case vm_inst_SubIntLI:
+            printf("sub.int.li %d (%d)\n", op->fused.l, op->fused.imm);
+            break;
+
+        case vm_inst_LoadStore:
+            printf("load.store %d %d %d\n", op->mem_move.dst, op->mem_move.src, op->mem_move.size);
+            break;
+
+        case vm_inst_JmpIntEqLL: /* fallthrough */
+        case vm_inst_JmpIntNeLL: /* fallthrough */
+        case vm_inst_JmpIntLtLL: /* fallthrough */
+        case vm_inst_JmpIntGtLL: /* fallthrough */
+        case vm_inst_JmpIntLeLL: /* fallthrough */
+        case vm_inst_JmpIntGeLL:
+            printf("jmp.int.%s.ll %d %d -> %03d\n", vm_jmp_suffixes[2 + op->inst - vm_inst_JmpIntEqLL],
+                   op->fused.l, op->fused.r, op->fused.target);
+            break;
+
+        case vm_inst_JmpIntEqLI: /* fallthrough */
+        case vm_inst_JmpIntNeLI: /* fallthrough */
+        case vm_inst_JmpIntLtLI: /* fallthrough */
+        case vm_inst_JmpIntGtLI: /* fallthrough */
+        case vm_inst_JmpIntLeLI: /* fallthrough */
+        case vm_inst_JmpIntGeLI:
+            printf("jmp.int.%s.li %d (%d) -> %03d\n", vm_jmp_suffixes[2 + op->inst - vm_inst_JmpIntEqLI],
+                   op->fused.l, op->fused.imm, op->fused.target);
+            break;
+
+        case vm_inst_LoadA:  /* fallthrough */
+        case vm_inst_LoadB:  /* fallthrough */
+        case vm_inst_StoreA: /* fallthrough */
+        case vm_inst_StoreB:
+            printf("%s %d\n", vm_cached_names[op->inst - vm_inst_LoadA], op->cached.offset);
+            break;
+
+        case vm_inst_LoadImmA: /* fallthrough */
+        case vm_inst_LoadImmB:
+            printf("%s (%d)\n", vm_cached_names[op->inst - vm_inst_LoadA], op->cached.imm);
+            break;
+
+        case vm_inst_SpillA:   /* fallthrough */
+        case vm_inst_FillA:    /* fallthrough */
+        case vm_inst_AddIntAB: /* fallthrough */
+        case vm_inst_SubIntAB:
+            printf("%s\n", vm_cached_names[op->inst - vm_inst_LoadA]);
+            break;
+
+        case vm_inst_JmpIntNzA:  /* fallthrough */
+        case vm_inst_JmpIntZeA:  /* fallthrough */
+        case vm_inst_JmpIntEqAB: /* fallthrough */
+        case vm_inst_JmpIntNeAB: /* fallthrough */
+        case vm_inst_JmpIntLtAB: /* fallthrough */
+        case vm_inst_JmpIntGtAB: /* fallthrough */
+        case vm_inst_JmpIntLeAB: /* fallthrough */
+        case vm_inst_JmpIntGeAB:
+            printf("jmp.int.%s.%s -> %03d\n", vm_jmp_suffixes[op->inst - vm_inst_JmpIntNzA],
+                   op->inst < vm_inst_JmpIntEqAB ? "a" : "ab", op->jmp.target);
+            break;
+
+        default:
+            printf("unknown instruction: %d\n", op->inst);
+    }
+}
+
+void
+vm_disassemble_ops(const vm_program_t *program, cz_t *cz, u32 code_offset)
 {
-    vm_init(vm, code_offset);
+    (void)cz;
+
+    ASSERT(code_offset < program->code_ops.count);
+    u32 op_index = program->code_ops.data[code_offset];
+    ASSERT(op_index != CZ_NO_ID);
 
-    while (vm_print_instruction(vm, cz))
-        ;;
+    u32 end = vm_function_end(program, code_offset);
+
+    for (; op_index < program->ops.count && program->ops.data[op_index].code_offset < end; ++op_index) {
+        vm_print_op(program, op_index);
+    }
 }
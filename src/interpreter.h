@@ -26,8 +26,10 @@ typedef enum
     // vm_inst_StoreImm,
     // vm_inst_StoreAbs,
 
-    // vm_inst_Call,
-    // vm_inst_Ret,
+    vm_inst_Call,        // args size sp target
+    vm_inst_TailCall,    // args size target, reuses the frame
+    vm_inst_Ret,
+    vm_inst_Stub,        // func_index
 
     vm_inst_JmpUc,
     /* don't add here */
@@ -40,6 +42,67 @@ typedef enum
     vm_inst_JmpIntLe,
     vm_inst_JmpIntGe,
 
+    // Register forms, operands are offsets into the frame.
+    vm_inst_AddIntReg,   // dst l r
+    vm_inst_SubIntReg,   // dst l r
+    vm_inst_MoveImmReg,  // dst size imm...
+
+    vm_inst_JmpIntNzReg, // a offset
+    /* don't add here */
+    vm_inst_JmpIntZeReg, // a offset
+    vm_inst_JmpIntEqReg, // a b offset
+    vm_inst_JmpIntNeReg,
+    vm_inst_JmpIntLtReg,
+    vm_inst_JmpIntGtReg,
+    vm_inst_JmpIntLeReg,
+    vm_inst_JmpIntGeReg,
+
+    // Fused forms of common stack sequences, L is a frame offset and I an immediate.
+    vm_inst_AddIntLL,    // l r
+    vm_inst_SubIntLL,    // l r
+    vm_inst_AddIntLI,    // l imm
+    vm_inst_SubIntLI,    // l imm
+    vm_inst_LoadStore,   // dst src size
+
+    vm_inst_JmpIntEqLL,  // l r offset
+    /* don't add here */
+    vm_inst_JmpIntNeLL,
+    vm_inst_JmpIntLtLL,
+    vm_inst_JmpIntGtLL,
+    vm_inst_JmpIntLeLL,
+    vm_inst_JmpIntGeLL,
+
+    vm_inst_JmpIntEqLI,  // l imm offset
+    /* don't add here */
+    vm_inst_JmpIntNeLI,
+    vm_inst_JmpIntLtLI,
+    vm_inst_JmpIntGtLI,
+    vm_inst_JmpIntLeLI,
+    vm_inst_JmpIntGeLI,
+
+    // Top of stack caching, A and B are `vm_registers_t.int_a` and `int_b`.
+    // With both in use A holds the second value and B the top.
+    vm_inst_LoadA,       // offset
+    vm_inst_LoadB,       // offset
+    vm_inst_LoadImmA,    // imm
+    vm_inst_LoadImmB,    // imm
+    vm_inst_StoreA,      // offset
+    vm_inst_StoreB,      // offset
+    vm_inst_SpillA,      // push A, A = B
+    vm_inst_FillA,       // B = A, A = pop
+    vm_inst_AddIntAB,    // A = A + B
+    vm_inst_SubIntAB,    // A = A - B
+
+    vm_inst_JmpIntNzA,   // offset
+    /* don't add here */
+    vm_inst_JmpIntZeA,
+    vm_inst_JmpIntEqAB,  // offset
+    vm_inst_JmpIntNeAB,
+    vm_inst_JmpIntLtAB,
+    vm_inst_JmpIntGtAB,
+    vm_inst_JmpIntLeAB,
+    vm_inst_JmpIntGeAB,
+
     VM_INST_COUNT
 } vm_inst_t;
 
@@ -50,57 +113,299 @@ typedef union
     i32 i;
 } vm_code_t;
 
+const char *
+vm_inst_name(vm_inst_t inst);
+
+#if defined(VM_STATS)
+// Dynamic opcode counts, recorded by `vm_step` and `vm_execute` when built with `-DVM_STATS`.
+typedef struct
+{
+    u64 counts[VM_INST_COUNT];
+    // Indexed [previous][next].
+    u64 pairs[VM_INST_COUNT][VM_INST_COUNT];
+    // One past the last recorded instruction, 0 at the start of a run.
+    u32 last;
+} vm_stats_t;
+#endif
+
+/* Decoded form of an instruction.
+ * Operands are unpacked, immediates are stored inline and jump targets are absolute
+ * indices into `vm_program_t.ops`, so the interpreter doesn't decode anything at run time.
+ */
+typedef struct
+{
+    const void *handler;
+
+    vm_inst_t inst;
+    u32 code_offset;
+
+    union {
+        struct { u32 amount; }          inc_sp;
+        struct { u32 dst, src, size; }  mem_move;
+        struct { u32 offset, size; }    mem;
+        struct { u32 size; u8 data[8]; } imm;
+        struct { u32 target; }          jmp;
+
+        struct { u32 dst, l, r; }             reg;
+        struct { u32 dst, size; u8 data[8]; } reg_imm;
+        struct { u32 a, b, target; }          reg_jmp;
+
+        struct {
+            u32 l;
+            union { u32 r; i32 imm; };
+            u32 target;
+        } fused;
+
+        struct { u32 offset; i32 imm; } cached;
+
+        // `frame` is the callee's `vm_function_t.frame_size`, 0 while the target is a stub.
+        struct { u32 args, size, sp, target, frame; } call;
+        struct { u32 func_index; }             stub;
+    };
+} vm_op_t;
+
 typedef struct
 {
     i32 int_a, int_b;
 } vm_registers_t;
 
+// Frame layout of a compiled function, inputs and outputs both start at offset 0.
+typedef struct
+{
+    func_ref_t func_ref;
+    u32 code_offset;
+    u32 op_offset;
+
+    u32 in_size;
+    u32 out_size;
+    // Inputs, variables and the deepest the evaluation stack gets, reserved once on entry.
+    u32 frame_size;
+
+    b32 has_calls;
+} vm_function_t;
+
+// Call of a function that wasn't compiled yet, resolved once it is.
+typedef struct
+{
+    func_ref_t func_ref;
+    // Code offset of the `vm_inst_Call` or `vm_inst_TailCall`.
+    u32 call_offset;
+} vm_call_patch_t;
+
+// Abs instruction the code from `code_offset` up to the next entry was compiled from.
+typedef struct
+{
+    u32 code_offset;
+    u32 func_index;
+    u32 inst_index;
+} vm_abs_loc_t;
+
+// Compiled code, read only once compiled so any number of threads can run it at once.
 typedef struct
 {
     dck_stretchy_t (u32, u32) code;
-    dck_stretchy_t (u8,  u32) memory;
+
+    dck_stretchy_t (vm_function_t, u32) functions;
+
+    dck_stretchy_t (vm_op_t, u32) ops;
+    // Index into `ops` for every word of `code`, `CZ_NO_ID` for operand words.
+    dck_stretchy_t (u32,     u32) code_ops;
+
+    dck_stretchy_t (vm_call_patch_t, u32) call_patches;
+
+    // Sorted by code offset, see `vm_find_abs_loc`.
+    dck_stretchy_t (vm_abs_loc_t, u32) abs_locs;
+} vm_program_t;
+
+typedef struct
+{
+    // Code offset for `vm_step`, op index for the decoded interpreter.
+    u32 ret;
+    u32 bp;
+    // Where the caller's stack ends once the outputs are in place.
+    u32 sp;
+} vm_frame_t;
+
+typedef struct vm_thread_t vm_thread_t;
+typedef struct vm_compiler_t vm_compiler_t;
+
+/* Called by `vm_execute` on every taken backward jump, with the thread state written back.
+ * Returns the op index to continue at, `target` to carry on as if nothing happened. See `tracer.h`.
+ */
+typedef u32 (*vm_back_edge_t)(void *context, const vm_program_t *program, vm_thread_t *thread, cz_t *cz,
+                              u32 target);
+
+/* Called by `vm_execute` on every `vm_inst_Call`, with `bp` at the callee's frame holding the arguments.
+ * True when it ran the callee itself and left the outputs at `bp`, false to call it as usual. See `tier.h`.
+ */
+typedef b32 (*vm_call_t)(void *context, const vm_program_t *program, vm_thread_t *thread, u32 target);
+
+// Execution state, one per thread running a `vm_program_t`.
+struct vm_thread_t
+{
+    // Reallocated as it grows, unless it lives in a region from `stack_map`.
+    dck_stretchy_t (u8, u32) memory;
+    // Only `stack_unmap` gives the memory back then.
+    b32 is_mapped;
 
     vm_registers_t registers;
 
     u32 bp, ip;
 
     u32 popped_pos;
-} vm_t;
+
+    dck_stretchy_t (vm_frame_t, u32) frames;
+
+    // Op index + 1 of the block `vm_execute` is in, 0 outside of it. Read by the sampler.
+    volatile u32 sample_pos;
+
+    // Loops run without a hook while NULL.
+    vm_back_edge_t back_edge;
+    void *back_edge_context;
+
+    // Calls go straight to the callee while NULL.
+    vm_call_t call;
+    void *call_context;
+
+    // Where stubs compile their functions to, `lazy_program` is the program being run. Stubs are fatal while NULL.
+    vm_program_t *lazy_program;
+    vm_compiler_t *lazy_compiler;
+
+#if defined(VM_STATS)
+    // Nothing is recorded while NULL.
+    vm_stats_t *stats;
+#endif
+};
+
+// Reserves the frame of the function at `code_offset`, its inputs already pushed.
+void
+vm_init(const vm_program_t *program, vm_thread_t *thread, u32 code_offset);
 
 void
-vm_init(vm_t *vm, u32 code_offset);
+vm_clear(vm_thread_t *thread);
 
+// Releases the memory and the frame stack, memory from `stack_map` stays until `stack_unmap`.
 void
-vm_clear(vm_t *vm);
+vm_thread_free(vm_thread_t *thread);
 
 void
-vm_step(vm_t *vm, cz_t *cz);
+vm_step(const vm_program_t *program, vm_thread_t *thread, cz_t *cz);
 
 b32
-vm_is_running(vm_t *vm);
+vm_is_running(const vm_program_t *program, vm_thread_t *thread);
+
+void
+vm_execute(const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset);
+
+/* Runs the function once per input tuple.
+ * Every tuple is `in_size` bytes laid out the way `VM_PUSH` would, `stride` bytes apart.
+ * The results are packed into `outputs`, `out_size` bytes each.
+ */
+void
+vm_execute_batch(const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset,
+                 const void *inputs, u32 stride, u32 count, void *outputs);
 
+// Same as `vm_execute_batch`, runs several tuples at once in SIMD lanes where the compiler supports it.
 void
-vm_execute(vm_t *vm, cz_t *cz, u32 code_offset);
+vm_execute_lanes(const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset,
+                 const void *inputs, u32 stride, u32 count, void *outputs);
+
+const vm_function_t *
+vm_find_function(const vm_program_t *program, u32 code_offset);
+
+// Abs instruction the instruction at `code_offset` belongs to.
+vm_abs_loc_t
+vm_find_abs_loc(const vm_program_t *program, u32 code_offset);
+
+typedef struct
+{
+    // Of the offending instruction.
+    u32 code_offset;
+    const char *message;
+} vm_verify_error_t;
+
+/* Checks the code of the function starting at `code_offset` once, so the interpreters don't have to.
+ * Every instruction has to be whole, jumps land on instruction starts inside the function,
+ * calls on functions or stubs, the stack depth is the same on every path into an instruction
+ * and every frame access stays below it. `vm_compile` verifies everything it emits.
+ */
+b32
+vm_verify(const vm_program_t *program, u32 code_offset, vm_verify_error_t *error);
 
 void
-vm_push_data(vm_t *vm, u32 alignment, u32 size, void *ptr);
-#define VM_PUSH(vm_m, type_m, ...) \
-    vm_push_data((vm_m), _Alignof(type_m), sizeof(type_m), (__VA_ARGS__))
+vm_push_data(vm_thread_t *thread, u32 alignment, u32 size, void *ptr);
+#define VM_PUSH(thread_m, type_m, ...) \
+    vm_push_data((thread_m), _Alignof(type_m), sizeof(type_m), (__VA_ARGS__))
 
 void *
-vm_get_data(vm_t *vm, u32 alignment, u32 size);
-#define VM_GET(vm_m, type_m) \
-    ((type_m *)vm_get_data(vm_m, _Alignof(type_m), sizeof(type_m)))
+vm_get_data(vm_thread_t *thread, u32 alignment, u32 size);
+#define VM_GET(thread_m, type_m) \
+    ((type_m *)vm_get_data(thread_m, _Alignof(type_m), sizeof(type_m)))
+
+// Prints the instruction at `*ip` and moves past it, false on halt.
+b32
+vm_print_instruction(const vm_program_t *program, cz_t *cz, u32 *ip);
+
+#if defined(VM_STATS)
+// Opcodes and then opcode pairs by count, `max_pairs == 0` prints every pair that occurred.
+void
+vm_stats_dump(const vm_stats_t *stats, FILE *file, u32 max_pairs);
+#endif
+
+void
+vm_disassemble(const vm_program_t *program, cz_t *cz, u32 code_offset);
+
+void
+vm_print_op(const vm_program_t *program, u32 op_index);
+
+void
+vm_disassemble_ops(const vm_program_t *program, cz_t *cz, u32 code_offset);
+
+/*
+ * Profiling
+ */
+typedef struct
+{
+    // Both indexed by code offset, like `vm_program_t.code`.
+    dck_stretchy_t (u64, u32) counts;
+    // Times a conditional jump went to its target, the rest of its count fell through.
+    dck_stretchy_t (u64, u32) taken;
+} vm_profile_t;
 
+// Same as `vm_execute` but through `vm_step`, counting every instruction that runs.
+void
+vm_execute_profiled(const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset,
+                    vm_profile_t *profile);
+
+/* One line per instruction that ran:
+ *     <code offset> <func index> <abs inst index> <count> <taken or ->
+ */
 b32
-vm_print_instruction(vm_t *vm, cz_t *cz);
+vm_profile_write(const vm_profile_t *profile, const vm_program_t *program, const char *path);
 
 void
-vm_disassemble(vm_t *vm, cz_t *cz, u32 code_offset);
+vm_profile_free(vm_profile_t *profile);
 
 /*
  * Compiler
  */
+typedef enum
+{
+    // Operand stack code, every value goes through `vm_thread_t.memory`.
+    vm_compile_mode_Stack = 0,
+    // Three address code over frame slots, the abstract stack is resolved at compile time.
+    vm_compile_mode_Register,
+    // Operand stack code keeping up to two top values in `vm_registers_t`.
+    vm_compile_mode_Cached,
+} vm_compile_mode_t;
+
+typedef enum
+{
+    vm_location_Slot,  // In the object's own stack slot.
+    vm_location_Local, // Still in the input or variable it was loaded from.
+    vm_location_Imm,   // Not written anywhere yet, `location_index` is the immediate.
+} vm_location_t;
+
 typedef struct
 {
     u32 alignment;
@@ -116,23 +421,105 @@ typedef struct
 
     type_ref_t type_ref;
     b32 is_reference;
+
+    vm_location_t location;
+    u32 location_index;
 } vm_object_t;
 
 typedef struct
 {
     u32 label_index;
     u32 absolute_offset;
+    // Depth of the compile time stack when jumping to / arriving at the label.
+    u32 object_count;
+    // Jumps only, where the evaluation objects they left start in `vm_compiler_t.patch_objects`.
+    u32 object_offset;
 } vm_patch_t;
 
+// Result of register code on its way into its output slot.
+typedef struct
+{
+    vm_object_t object;
+    u32 dst;
+    // `CZ_NO_ID` for immediates.
+    u32 src;
+} vm_result_move_t;
+
+// Instructions between labels and jumps, the unit of profile guided layout.
 typedef struct
 {
+    u32 start;
+    // Start of the final instruction.
+    u32 last;
+    u32 end;
+    // Its own label, or one past the function's labels when it starts without one.
+    u32 label_index;
+
+    // Highest count of any instruction in it.
+    u64 heat;
+    // Of the conditional jump ending it.
+    u64 taken;
+    u64 not_taken;
+
+    b32 is_placed;
+    // Jumped to in the new layout, needs its label.
+    b32 is_target;
+} vm_block_t;
+
+struct vm_compiler_t
+{
+    vm_compile_mode_t mode;
+    // Stack and cached modes, emit every abstract instruction on its own.
+    b32 disable_fusion;
+    // Calls in tail position get a frame of their own too.
+    b32 disable_tail_calls;
+    /* Calls to functions that weren't compiled yet go to a `vm_inst_Stub`, which compiles the callee
+     * through `vm_thread_t.lazy_compiler` once it is first called and retargets every call site to it.
+     * The program changes while it runs, only one thread can run it.
+     */
+    b32 lazy_calls;
+
+    /* Counts from an earlier run of the same functions in `layout_program`, see `vm_execute_profiled`.
+     * With both set the hot path falls through and cold blocks move after the return.
+     */
+    const vm_profile_t *layout_profile;
+    const vm_program_t *layout_program;
+
     u32 allocated_memory;
+    u32 max_memory;
+    u32 locals_size;
+    u32 input_offset;
+    u32 variable_offset;
+    u32 eval_offset;
+
+    // Code offset of the destination operand of the last register instruction.
+    u32 last_dst;
+    b32 unreachable;
+
+    // Number of top stack values currently held in registers in cached mode.
+    u32 cached_count;
+
+    b32 has_calls;
+
     dck_stretchy_t (vm_object_t, u32) objects;
     dck_stretchy_t (vm_patch_t,  u32) jump_patches;
+    dck_stretchy_t (vm_object_t, u32) patch_objects;
     dck_stretchy_t (vm_patch_t,  u32) labels;
-} vm_compiler_t;
+    // Register mode `sp` operands of calls, the frame size isn't known until the end.
+    dck_stretchy_t (u32,         u32) sp_patches;
+    dck_stretchy_t (vm_result_move_t, u32) result_moves;
+    // Output slot of every abstract instruction computing a result straight into it, `CZ_NO_ID` elsewhere.
+    dck_stretchy_t (u32,         u32) result_dsts;
+    dck_stretchy_t (u32,         u32) run_insts;
+    dck_stretchy_t (u8,          u32) local_uses;
+
+    dck_stretchy_t (vm_block_t,  u32) blocks;
+    dck_stretchy_t (u32,         u32) layout_order;
+    // Recorded instruction index for every word of the laid out code.
+    dck_stretchy_t (u32,         u32) layout_map;
+};
 
 u32
-vm_compile(vm_t *vm, vm_compiler_t *compiler, cz_t *cz, func_ref_t func);
+vm_compile(vm_program_t *program, vm_compiler_t *compiler, cz_t *cz, func_ref_t func);
 
 #endif // INTERPRETER_H_
@@ -0,0 +1,870 @@
+#include "jit.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(JIT_SUPPORTED)
+    #include <sys/mman.h>
+#endif
+
+/* Straight translation of the abstract code, no interpreter in between.
+ * Every abstract stack position gets a fixed home: the first few live in caller saved
+ * registers, the rest in the frame after the variables. Since the stack depth is known
+ * for every instruction the homes agree across jumps and nothing has to be shuffled.
+ * `rdi` holds the frame for the whole function, `r11` is scratch.
+ */
+
+enum
+{
+    jit_reg_Ax  = 0,
+    jit_reg_Cx  = 1,
+    jit_reg_Dx  = 2,
+    jit_reg_Si  = 6,
+    jit_reg_Di  = 7,
+    jit_reg_R8  = 8,
+    jit_reg_R9  = 9,
+    jit_reg_R10 = 10,
+    jit_reg_R11 = 11,
+};
+
+static const u32 jit_slot_regs[] = {
+    jit_reg_Ax, jit_reg_Cx, jit_reg_Dx, jit_reg_Si, jit_reg_R8, jit_reg_R9, jit_reg_R10,
+};
+
+#define JIT_FRAME   jit_reg_Di
+#define JIT_SCRATCH jit_reg_R11
+
+// Traces only, `rsi` points to the `vm_registers_t` that A and B are loaded from and written back to.
+#define JIT_REGISTERS jit_reg_Si
+#define JIT_CACHED_A  jit_reg_Cx
+#define JIT_CACHED_B  jit_reg_Dx
+#define JIT_ITERATIONS jit_reg_R10
+
+// Condition codes for `jcc`, indexed by `jmp_type_t` without `jmp_Uc`.
+static const u8 jit_conditions[] = {
+    0x5, // nz -> jne
+    0x4, // ze -> je
+    0x4, // eq -> je
+    0x5, // ne -> jne
+    0xC, // lt -> jl
+    0xF, // gt -> jg
+    0xE, // le -> jle
+    0xD, // ge -> jge
+};
+
+typedef struct
+{
+    b32 is_reg;
+    // The base register for memory operands.
+    u32 reg;
+    i32 disp;
+} jit_operand_t;
+
+static jit_operand_t
+jit_reg(u32 reg)
+{
+    return (jit_operand_t) { .is_reg = true, .reg = reg };
+}
+
+static jit_operand_t
+jit_mem(u32 offset)
+{
+    return (jit_operand_t) { .is_reg = false, .reg = JIT_FRAME, .disp = (i32)offset };
+}
+
+static jit_operand_t
+jit_mem_at(u32 base, u32 offset)
+{
+    return (jit_operand_t) { .is_reg = false, .reg = base, .disp = (i32)offset };
+}
+
+static void
+jit_emit_u32(jit_t *jit, u32 value)
+{
+    dck_stretchy_reserve(jit->code, sizeof(u32));
+    memcpy(jit->code.data + jit->code.count, &value, sizeof(u32));
+    jit->code.count += sizeof(u32);
+}
+
+// `opcode reg, r/m` with 32 bit operands, memory is `[base + disp32]` for any base but `rsp` and `r12`.
+static void
+jit_emit_rm(jit_t *jit, u8 opcode, u32 reg, jit_operand_t rm)
+{
+    u8 rex = 0;
+    if (reg >= 8)                rex |= 0x4; // REX.R
+    if (rm.reg >= 8)             rex |= 0x1; // REX.B
+
+    if (rex) {
+        dck_stretchy_push(jit->code, (u8)(0x40 | rex));
+    }
+
+    dck_stretchy_push(jit->code, opcode);
+
+    if (rm.is_reg) {
+        dck_stretchy_push(jit->code, (u8)(0xC0 | (reg & 7) << 3 | (rm.reg & 7)));
+    }
+    else {
+        dck_stretchy_push(jit->code, (u8)(0x80 | (reg & 7) << 3 | (rm.reg & 7)));
+        jit_emit_u32(jit, (u32)rm.disp);
+    }
+}
+
+static jit_operand_t
+jit_slot(jit_t *jit, u32 index)
+{
+    if (jit->max_depth < index + 1) {
+        jit->max_depth = index + 1;
+    }
+
+    if (index < LENGTH_OF(jit_slot_regs))
+        return jit_reg(jit_slot_regs[index]);
+
+    // Spaced so that writing the outputs from the bottom up never overwrites a pending slot.
+    return jit_mem(jit->eval_base + index * sizeof(i32));
+}
+
+static void
+jit_emit_move(jit_t *jit, jit_operand_t dst, jit_operand_t src)
+{
+    if (dst.is_reg) {
+        jit_emit_rm(jit, 0x8B, dst.reg, src);            // mov dst, src
+    }
+    else if (src.is_reg) {
+        jit_emit_rm(jit, 0x89, src.reg, dst);            // mov [dst], src
+    }
+    else {
+        jit_emit_rm(jit, 0x8B, JIT_SCRATCH, src);
+        jit_emit_rm(jit, 0x89, JIT_SCRATCH, dst);
+    }
+}
+
+static void
+jit_emit_move_imm(jit_t *jit, jit_operand_t dst, i32 imm)
+{
+    if (dst.is_reg) {
+        if (dst.reg >= 8) {
+            dck_stretchy_push(jit->code, (u8)0x41);
+        }
+        dck_stretchy_push(jit->code, (u8)(0xB8 + (dst.reg & 7))); // mov reg, imm32
+    }
+    else {
+        jit_emit_rm(jit, 0xC7, 0, dst);                  // mov dword [dst], imm32
+    }
+
+    jit_emit_u32(jit, (u32)imm);
+}
+
+// `l = l op r` for add (0x03) and sub (0x2B), cmp (0x3B) only sets the flags.
+static void
+jit_emit_binary(jit_t *jit, u8 opcode, jit_operand_t l, jit_operand_t r)
+{
+    if (l.is_reg) {
+        jit_emit_rm(jit, opcode, l.reg, r);
+        return;
+    }
+
+    jit_emit_rm(jit, 0x8B, JIT_SCRATCH, l);
+    jit_emit_rm(jit, opcode, JIT_SCRATCH, r);
+    if (opcode != 0x3B) {
+        jit_emit_rm(jit, 0x89, JIT_SCRATCH, l);
+    }
+}
+
+static void
+jit_emit_jump_target(jit_t *jit, u32 label_index)
+{
+    for (u32 i = 0; i < jit->labels.count; ++i) {
+        jit_patch_t label = jit->labels.data[i];
+
+        if (label.label_index == label_index) {
+            ASSERT(label.depth == jit->depth);
+
+            i32 rel_offset = (i32)label.code_offset - (i32)(jit->code.count + sizeof(i32));
+            jit_emit_u32(jit, (u32)rel_offset);
+            return;
+        }
+    }
+
+    jit_patch_t patch = {
+        .label_index = label_index,
+        .code_offset = jit->code.count,
+        .depth       = jit->depth,
+    };
+    dck_stretchy_push(jit->jump_patches, patch);
+
+    jit_emit_u32(jit, 0);
+}
+
+static void
+jit_emit_return(jit_t *jit)
+{
+    // The evaluation stack becomes the outputs, bottom at offset 0.
+    for (u32 i = 0; i < jit->depth; ++i) {
+        jit_emit_move(jit, jit_mem(i * sizeof(i32)), jit_slot(jit, i));
+    }
+
+    dck_stretchy_push(jit->code, (u8)0xC3); // ret
+}
+
+static b32
+jit_is_int(type_ref_t type_ref)
+{
+    return type_ref.tag == data_type_Basic && type_ref.index_for_tag == data_basic_Int;
+}
+
+b32
+jit_is_supported(cz_t *cz, func_ref_t func_ref)
+{
+#if defined(JIT_SUPPORTED)
+    abs_func_t *func = cz->abs_funcs.data + func_ref.func_index;
+
+    for (u32 i = 0; i < func->in_count; ++i) {
+        if (!jit_is_int(cz->abs_func_ins.data[func->in_offset + i]))
+            return false;
+    }
+    for (u32 i = 0; i < func->out_count; ++i) {
+        if (!jit_is_int(cz->abs_func_outs.data[func->out_offset + i]))
+            return false;
+    }
+    for (u32 i = 0; i < func->var_count; ++i) {
+        if (!jit_is_int(cz->abs_func_vars.data[func->var_offset + i]))
+            return false;
+    }
+
+    abs_code_t *code = cz->abs_code.data + func->code_offset;
+
+    for (u32 inst_index = 0; inst_index < func->code_count; inst_index += abs_inst_size(code[inst_index].inst)) {
+        switch (code[inst_index].inst) {
+            case abs_inst_LoadImm: {
+                immediate_t immediate = cz->immediates.data[code[inst_index + 1].index];
+
+                if (!jit_is_int(immediate.type) || immediate.data_size != sizeof(i32))
+                    return false;
+            } break;
+
+            case abs_inst_Add:      /* fallthrough */
+            case abs_inst_Sub:      /* fallthrough */
+            case abs_inst_LoadIn:   /* fallthrough */
+            case abs_inst_LoadVar:  /* fallthrough */
+            case abs_inst_StoreIn:  /* fallthrough */
+            case abs_inst_StoreVar: /* fallthrough */
+            case abs_inst_Label:    /* fallthrough */
+            case abs_inst_Ret:      /* fallthrough */
+            case abs_inst_JmpUc:    /* fallthrough */
+            case abs_inst_JmpNz:    /* fallthrough */
+            case abs_inst_JmpZe:    /* fallthrough */
+            case abs_inst_JmpEq:    /* fallthrough */
+            case abs_inst_JmpNe:    /* fallthrough */
+            case abs_inst_JmpLt:    /* fallthrough */
+            case abs_inst_JmpGt:    /* fallthrough */
+            case abs_inst_JmpLe:    /* fallthrough */
+            case abs_inst_JmpGe:
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+    return true;
+#else
+    (void)cz;
+    (void)func_ref;
+    return false;
+#endif
+}
+
+// Executable copy of `jit->code`, NULL where the backend isn't supported.
+static void *
+jit_finalize(jit_t *jit)
+{
+#if defined(JIT_SUPPORTED)
+    u64 size = jit->code.count;
+
+    void *page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+        fprintf(stderr, "%s:%d: mmap failure! exiting...\n", __FILE__, __LINE__);
+        exit(666);
+    }
+
+    memcpy(page, jit->code.data, size);
+
+    if (mprotect(page, size, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(stderr, "%s:%d: mprotect failure! exiting...\n", __FILE__, __LINE__);
+        exit(666);
+    }
+
+    dck_stretchy_push(jit->pages, page);
+    dck_stretchy_push(jit->page_sizes, size);
+
+    return page;
+#else
+    (void)jit;
+    return NULL;
+#endif
+}
+
+jit_func_t
+jit_compile(jit_t *jit, cz_t *cz, func_ref_t func_ref)
+{
+    if (!jit_is_supported(cz, func_ref))
+        return (jit_func_t) {0};
+
+    abs_func_t *func = cz->abs_funcs.data + func_ref.func_index;
+
+    // Same frame layout as `vm_compile`, variables right after the inputs.
+    u32 var_base = func->in_count * sizeof(i32);
+
+    jit->code.count         = 0;
+    jit->jump_patches.count = 0;
+    jit->labels.count       = 0;
+
+    jit->depth       = 0;
+    jit->max_depth   = 0;
+    jit->eval_base   = var_base + func->var_count * sizeof(i32);
+    jit->unreachable = false;
+
+    for (u32 inst_index = 0; inst_index < func->code_count; ++inst_index) {
+        abs_code_t code = cz->abs_code.data[func->code_offset + inst_index];
+
+        switch (code.inst) {
+            case abs_inst_Add: /* fallthrough */
+            case abs_inst_Sub: {
+                ASSERT(jit->depth >= 2);
+                jit_operand_t r = jit_slot(jit, --(jit->depth));
+                jit_operand_t l = jit_slot(jit, jit->depth - 1);
+
+                jit_emit_binary(jit, code.inst == abs_inst_Add ? 0x03 : 0x2B, l, r);
+            } break;
+
+            case abs_inst_LoadIn:  /* fallthrough */
+            case abs_inst_LoadVar: /* fallthrough */
+            case abs_inst_StoreIn: /* fallthrough */
+            case abs_inst_StoreVar: {
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 local_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+
+                u32 offset;
+                if (code.inst == abs_inst_LoadIn || code.inst == abs_inst_StoreIn) {
+                    offset = (local_index - func->in_base) * sizeof(i32);
+                }
+                else {
+                    offset = var_base + (local_index - func->var_base) * sizeof(i32);
+                }
+
+                if (code.inst == abs_inst_LoadIn || code.inst == abs_inst_LoadVar) {
+                    jit_emit_move(jit, jit_slot(jit, jit->depth++), jit_mem(offset));
+                }
+                else {
+                    ASSERT(jit->depth >= 1);
+                    jit_emit_move(jit, jit_mem(offset), jit_slot(jit, --(jit->depth)));
+                }
+            } break;
+
+            case abs_inst_LoadImm: {
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 imm_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+                immediate_t immediate = cz->immediates.data[imm_index];
+
+                i32 imm;
+                memcpy(&imm, cz->imm_data.data + immediate.data_offset, sizeof(i32));
+
+                jit_emit_move_imm(jit, jit_slot(jit, jit->depth++), imm);
+            } break;
+
+            case abs_inst_Label: {
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 label_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+
+                b32 is_known = !jit->unreachable;
+
+                for (u32 i = 0; i < jit->jump_patches.count;) {
+                    jit_patch_t patch = jit->jump_patches.data[i];
+
+                    if (patch.label_index == label_index) {
+                        i32 rel_offset = (i32)jit->code.count - (i32)(patch.code_offset + sizeof(i32));
+                        memcpy(jit->code.data + patch.code_offset, &rel_offset, sizeof(i32));
+
+                        ASSERT(!is_known || patch.depth == jit->depth);
+                        jit->depth = patch.depth;
+                        is_known   = true;
+
+                        jit->jump_patches.data[i] = jit->jump_patches.data[--(jit->jump_patches.count)];
+                    }
+                    else {
+                        ++i;
+                    }
+                }
+
+                jit_patch_t label = {
+                    .label_index = label_index,
+                    .code_offset = jit->code.count,
+                    .depth       = jit->depth,
+                };
+                dck_stretchy_push(jit->labels, label);
+
+                jit->unreachable = false;
+            } break;
+
+            case abs_inst_JmpUc: /* fallthrough */
+            case abs_inst_JmpNz: /* fallthrough */
+            case abs_inst_JmpZe: /* fallthrough */
+            case abs_inst_JmpEq: /* fallthrough */
+            case abs_inst_JmpNe: /* fallthrough */
+            case abs_inst_JmpLt: /* fallthrough */
+            case abs_inst_JmpGt: /* fallthrough */
+            case abs_inst_JmpLe: /* fallthrough */
+            case abs_inst_JmpGe: {
+                ASSERT(inst_index + 1 < func->code_count);
+                u32 label_index = cz->abs_code.data[func->code_offset + ++inst_index].index;
+
+                if (code.inst == abs_inst_JmpUc) {
+                    dck_stretchy_push(jit->code, (u8)0xE9); // jmp rel32
+                    jit_emit_jump_target(jit, label_index);
+
+                    jit->unreachable = true;
+                    break;
+                }
+
+                if (code.inst == abs_inst_JmpNz || code.inst == abs_inst_JmpZe) {
+                    ASSERT(jit->depth >= 1);
+                    jit_operand_t a = jit_slot(jit, --(jit->depth));
+
+                    if (a.is_reg) {
+                        jit_emit_rm(jit, 0x85, a.reg, a);   // test a, a
+                    }
+                    else {
+                        jit_emit_rm(jit, 0x83, 7, a);       // cmp dword [a], imm8
+                        dck_stretchy_push(jit->code, (u8)0);
+                    }
+                }
+                else {
+                    ASSERT(jit->depth >= 2);
+                    jit_operand_t b = jit_slot(jit, --(jit->depth));
+                    jit_operand_t a = jit_slot(jit, --(jit->depth));
+
+                    jit_emit_binary(jit, 0x3B, a, b);
+                }
+
+                dck_stretchy_push(jit->code, (u8)0x0F);    // jcc rel32
+                dck_stretchy_push(jit->code, (u8)(0x80 | jit_conditions[code.inst - abs_inst_JmpNz]));
+                jit_emit_jump_target(jit, label_index);
+            } break;
+
+            case abs_inst_Ret: {
+                if (!jit->unreachable) {
+                    jit_emit_return(jit);
+                }
+                jit->unreachable = true;
+            } break;
+
+            default:
+                fprintf(stderr, "jit: unsupported instruction: %d\n", code.inst);
+                exit(1);
+        }
+    }
+
+    if (!jit->unreachable) {
+        jit_emit_return(jit);
+    }
+
+    ASSERT(jit->jump_patches.count == 0);
+
+    // ISO C has no conversion from object to function pointers, POSIX guarantees this one.
+    void *page = jit_finalize(jit);
+
+    jit_func_t result = {
+        .frame_size = jit->eval_base + jit->max_depth * sizeof(i32),
+        .out_size   = func->out_count * sizeof(i32),
+    };
+    memcpy(&result.entry, &page, sizeof(result.entry));
+
+    if (result.frame_size < result.out_size) {
+        result.frame_size = result.out_size;
+    }
+
+    return result;
+}
+
+// Dword by dword, in the order `memmove` needs for overlapping ranges.
+static b32
+jit_emit_copy(jit_t *jit, u32 dst, u32 src, u32 size)
+{
+    if (size % sizeof(i32) != 0)
+        return false;
+
+    u32 count = size / sizeof(i32);
+
+    for (u32 i = 0; i < count; ++i) {
+        u32 word = dst < src ? i : count - 1 - i;
+        jit_emit_move(jit, jit_mem(dst + word * sizeof(i32)), jit_mem(src + word * sizeof(i32)));
+    }
+
+    return true;
+}
+
+// `dst = l op r` over frame slots, add (0x03) or sub (0x2B).
+static void
+jit_emit_three(jit_t *jit, u8 opcode, u32 dst, u32 l, jit_operand_t r)
+{
+    jit_emit_move(jit, jit_reg(JIT_SCRATCH), jit_mem(l));
+    jit_emit_rm(jit, opcode, JIT_SCRATCH, r);
+    jit_emit_move(jit, jit_mem(dst), jit_reg(JIT_SCRATCH));
+}
+
+// `op r/m, imm32` through the 0x81 group, `ext` picks add (0), sub (5) or cmp (7).
+static void
+jit_emit_imm_op(jit_t *jit, u32 ext, jit_operand_t rm, i32 imm)
+{
+    jit_emit_rm(jit, 0x81, ext, rm);
+    jit_emit_u32(jit, (u32)imm);
+}
+
+// Leaves the trace on the side of the jump the recording didn't take, flags are already set.
+static void
+jit_emit_guard(jit_t *jit, jit_trace_t *trace, jit_trace_step_t step, u32 jmp_index, u32 target, u32 sp)
+{
+    u8 condition = jit_conditions[jmp_index];
+
+    jit_trace_exit_t trace_exit = { .op_index = target, .sp = sp };
+    if (step.taken) {
+        trace_exit.op_index = step.op_index + 1;
+        condition ^= 1; // x86 condition codes come in pairs, the low bit negates
+    }
+
+    dck_stretchy_push(jit->code, (u8)0x0F);    // jcc rel32
+    dck_stretchy_push(jit->code, (u8)(0x80 | condition));
+
+    jit_patch_t patch = {
+        .label_index = jit->trace_exits.count - trace->exit_offset,
+        .code_offset = jit->code.count,
+    };
+    dck_stretchy_push(jit->jump_patches, patch);
+    dck_stretchy_push(jit->trace_exits, trace_exit);
+
+    jit_emit_u32(jit, 0);
+}
+
+/* Same frame addressing as `vm_run`: every operand is an offset from `bp`, which `rdi` points to.
+ * The interpreter's stack pointer is known at every step of a trace, so pushes and pops become
+ * fixed frame offsets too and only the guards have to tell the interpreter where it ended.
+ * The cached A and B stay in registers for the whole trace.
+ */
+b32
+jit_compile_trace(jit_t *jit, const vm_program_t *program, const jit_trace_step_t *steps, u32 step_count,
+                  u32 sp, jit_trace_t *trace)
+{
+    jit->code.count         = 0;
+    jit->jump_patches.count = 0;
+
+    *trace = (jit_trace_t) {
+        .exit_offset = jit->trace_exits.count,
+        .max_sp      = sp,
+    };
+
+    u32 header_sp = sp;
+
+    jit_operand_t a = jit_reg(JIT_CACHED_A);
+    jit_operand_t b = jit_reg(JIT_CACHED_B);
+
+    jit_emit_move(jit, a, jit_mem_at(JIT_REGISTERS, offsetof(vm_registers_t, int_a)));
+    jit_emit_move(jit, b, jit_mem_at(JIT_REGISTERS, offsetof(vm_registers_t, int_b)));
+    jit_emit_move_imm(jit, jit_reg(JIT_ITERATIONS), 0);
+
+    u32 loop_offset = jit->code.count;
+
+    for (u32 i = 0; i < step_count; ++i) {
+        jit_trace_step_t step = steps[i];
+        const vm_op_t *op = program->ops.data + step.op_index;
+
+        switch (op->inst) {
+            case vm_inst_IncSP: {
+                sp += op->inc_sp.amount;
+            } break;
+
+            case vm_inst_MemMove: {
+                u32 dst  = op->mem_move.dst;
+                u32 src  = op->mem_move.src;
+                u32 size = op->mem_move.size;
+
+                if (!jit_emit_copy(jit, dst, src, size))
+                    goto fail;
+
+                u32 end = (dst < src ? src : dst) + size;
+                if (trace->max_sp < end) {
+                    trace->max_sp = end;
+                }
+            } break;
+
+            case vm_inst_AddInt: /* fallthrough */
+            case vm_inst_SubInt: {
+                sp -= sizeof(i32);
+                jit_emit_binary(jit, op->inst == vm_inst_AddInt ? 0x03 : 0x2B,
+                                jit_mem(sp - sizeof(i32)), jit_mem(sp));
+            } break;
+
+            case vm_inst_Load: {
+                if (!jit_emit_copy(jit, sp, op->mem.offset, op->mem.size))
+                    goto fail;
+                sp += op->mem.size;
+            } break;
+
+            case vm_inst_LoadImm: {
+                if (op->imm.size != sizeof(i32))
+                    goto fail;
+
+                i32 imm;
+                memcpy(&imm, op->imm.data, sizeof(i32));
+
+                jit_emit_move_imm(jit, jit_mem(sp), imm);
+                sp += sizeof(i32);
+            } break;
+
+            case vm_inst_Store: {
+                sp -= op->mem.size;
+                if (!jit_emit_copy(jit, op->mem.offset, sp, op->mem.size))
+                    goto fail;
+            } break;
+
+            case vm_inst_JmpUc:
+                break;
+
+            case vm_inst_JmpIntNz: /* fallthrough */
+            case vm_inst_JmpIntZe: {
+                sp -= sizeof(i32);
+                jit_emit_rm(jit, 0x83, 7, jit_mem(sp));   // cmp dword [a], imm8
+                dck_stretchy_push(jit->code, (u8)0);
+
+                jit_emit_guard(jit, trace, step, op->inst - vm_inst_JmpIntNz, op->jmp.target, sp);
+            } break;
+
+            case vm_inst_JmpIntEq: /* fallthrough */
+            case vm_inst_JmpIntNe: /* fallthrough */
+            case vm_inst_JmpIntLt: /* fallthrough */
+            case vm_inst_JmpIntGt: /* fallthrough */
+            case vm_inst_JmpIntLe: /* fallthrough */
+            case vm_inst_JmpIntGe: {
+                sp -= 2 * sizeof(i32);
+                jit_emit_binary(jit, 0x3B, jit_mem(sp), jit_mem(sp + sizeof(i32)));
+
+                jit_emit_guard(jit, trace, step, op->inst - vm_inst_JmpIntNz, op->jmp.target, sp);
+            } break;
+
+            case vm_inst_AddIntReg: /* fallthrough */
+            case vm_inst_SubIntReg: {
+                jit_emit_three(jit, op->inst == vm_inst_AddIntReg ? 0x03 : 0x2B,
+                               op->reg.dst, op->reg.l, jit_mem(op->reg.r));
+            } break;
+
+            case vm_inst_MoveImmReg: {
+                if (op->reg_imm.size != sizeof(i32))
+                    goto fail;
+
+                i32 imm;
+                memcpy(&imm, op->reg_imm.data, sizeof(i32));
+
+                jit_emit_move_imm(jit, jit_mem(op->reg_imm.dst), imm);
+            } break;
+
+            case vm_inst_JmpIntNzReg: /* fallthrough */
+            case vm_inst_JmpIntZeReg: {
+                jit_emit_rm(jit, 0x83, 7, jit_mem(op->reg_jmp.a));
+                dck_stretchy_push(jit->code, (u8)0);
+
+                jit_emit_guard(jit, trace, step, op->inst - vm_inst_JmpIntNzReg, op->reg_jmp.target, sp);
+            } break;
+
+            case vm_inst_JmpIntEqReg: /* fallthrough */
+            case vm_inst_JmpIntNeReg: /* fallthrough */
+            case vm_inst_JmpIntLtReg: /* fallthrough */
+            case vm_inst_JmpIntGtReg: /* fallthrough */
+            case vm_inst_JmpIntLeReg: /* fallthrough */
+            case vm_inst_JmpIntGeReg: {
+                jit_emit_binary(jit, 0x3B, jit_mem(op->reg_jmp.a), jit_mem(op->reg_jmp.b));
+
+                jit_emit_guard(jit, trace, step, op->inst - vm_inst_JmpIntNzReg, op->reg_jmp.target, sp);
+            } break;
+
+            case vm_inst_AddIntLL: /* fallthrough */
+            case vm_inst_SubIntLL: {
+                jit_emit_three(jit, op->inst == vm_inst_AddIntLL ? 0x03 : 0x2B,
+                               sp, op->fused.l, jit_mem(op->fused.r));
+                sp += sizeof(i32);
+            } break;
+
+            case vm_inst_AddIntLI: /* fallthrough */
+            case vm_inst_SubIntLI: {
+                jit_emit_move(jit, jit_reg(JIT_SCRATCH), jit_mem(op->fused.l));
+                jit_emit_imm_op(jit, op->inst == vm_inst_AddIntLI ? 0 : 5, jit_reg(JIT_SCRATCH), op->fused.imm);
+                jit_emit_move(jit, jit_mem(sp), jit_reg(JIT_SCRATCH));
+                sp += sizeof(i32);
+            } break;
+
+            case vm_inst_LoadStore: {
+                if (!jit_emit_copy(jit, op->mem_move.dst, op->mem_move.src, op->mem_move.size))
+                    goto fail;
+            } break;
+
+            case vm_inst_JmpIntEqLL: /* fallthrough */
+            case vm_inst_JmpIntNeLL: /* fallthrough */
+            case vm_inst_JmpIntLtLL: /* fallthrough */
+            case vm_inst_JmpIntGtLL: /* fallthrough */
+            case vm_inst_JmpIntLeLL: /* fallthrough */
+            case vm_inst_JmpIntGeLL: {
+                jit_emit_binary(jit, 0x3B, jit_mem(op->fused.l), jit_mem(op->fused.r));
+
+                // No nz / ze forms, eq is the third condition.
+                jit_emit_guard(jit, trace, step, op->inst - vm_inst_JmpIntEqLL + 2, op->fused.target, sp);
+            } break;
+
+            case vm_inst_JmpIntEqLI: /* fallthrough */
+            case vm_inst_JmpIntNeLI: /* fallthrough */
+            case vm_inst_JmpIntLtLI: /* fallthrough */
+            case vm_inst_JmpIntGtLI: /* fallthrough */
+            case vm_inst_JmpIntLeLI: /* fallthrough */
+            case vm_inst_JmpIntGeLI: {
+                jit_emit_imm_op(jit, 7, jit_mem(op->fused.l), op->fused.imm);
+
+                jit_emit_guard(jit, trace, step, op->inst - vm_inst_JmpIntEqLI + 2, op->fused.target, sp);
+            } break;
+
+            case vm_inst_LoadA: /* fallthrough */
+            case vm_inst_LoadB: {
+                jit_emit_move(jit, op->inst == vm_inst_LoadA ? a : b, jit_mem(op->cached.offset));
+            } break;
+
+            case vm_inst_LoadImmA: /* fallthrough */
+            case vm_inst_LoadImmB: {
+                jit_emit_move_imm(jit, op->inst == vm_inst_LoadImmA ? a : b, op->cached.imm);
+            } break;
+
+            case vm_inst_StoreA: /* fallthrough */
+            case vm_inst_StoreB: {
+                jit_emit_move(jit, jit_mem(op->cached.offset), op->inst == vm_inst_StoreA ? a : b);
+            } break;
+
+            case vm_inst_SpillA: {
+                jit_emit_move(jit, jit_mem(sp), a);
+                sp += sizeof(i32);
+                jit_emit_move(jit, a, b);
+            } break;
+
+            case vm_inst_FillA: {
+                jit_emit_move(jit, b, a);
+                sp -= sizeof(i32);
+                jit_emit_move(jit, a, jit_mem(sp));
+            } break;
+
+            case vm_inst_AddIntAB: /* fallthrough */
+            case vm_inst_SubIntAB: {
+                jit_emit_binary(jit, op->inst == vm_inst_AddIntAB ? 0x03 : 0x2B, a, b);
+            } break;
+
+            case vm_inst_JmpIntNzA: /* fallthrough */
+            case vm_inst_JmpIntZeA: {
+                jit_emit_rm(jit, 0x85, a.reg, a);     // test a, a
+
+                jit_emit_guard(jit, trace, step, op->inst - vm_inst_JmpIntNzA, op->jmp.target, sp);
+            } break;
+
+            case vm_inst_JmpIntEqAB: /* fallthrough */
+            case vm_inst_JmpIntNeAB: /* fallthrough */
+            case vm_inst_JmpIntLtAB: /* fallthrough */
+            case vm_inst_JmpIntGtAB: /* fallthrough */
+            case vm_inst_JmpIntLeAB: /* fallthrough */
+            case vm_inst_JmpIntGeAB: {
+                jit_emit_binary(jit, 0x3B, a, b);
+
+                jit_emit_guard(jit, trace, step, op->inst - vm_inst_JmpIntNzA, op->jmp.target, sp);
+            } break;
+
+            // Calls and returns end recording anyway.
+            default:
+                goto fail;
+        }
+
+        if (trace->max_sp < sp) {
+            trace->max_sp = sp;
+        }
+    }
+
+    // Another iteration has to find the stack where the first one did.
+    if (sp != header_sp)
+        goto fail;
+
+    jit_emit_imm_op(jit, 0, jit_reg(JIT_ITERATIONS), 1);
+
+    i32 rel_offset = (i32)loop_offset - (i32)(jit->code.count + 1 + sizeof(i32));
+    dck_stretchy_push(jit->code, (u8)0xE9);        // jmp rel32, back to the header
+    jit_emit_u32(jit, (u32)rel_offset);
+
+    for (u32 i = 0; i < jit->jump_patches.count; ++i) {
+        jit_patch_t patch = jit->jump_patches.data[i];
+
+        rel_offset = (i32)jit->code.count - (i32)(patch.code_offset + sizeof(i32));
+        memcpy(jit->code.data + patch.code_offset, &rel_offset, sizeof(i32));
+
+        jit_emit_move(jit, jit_mem_at(JIT_REGISTERS, offsetof(vm_registers_t, int_a)), a);
+        jit_emit_move(jit, jit_mem_at(JIT_REGISTERS, offsetof(vm_registers_t, int_b)), b);
+
+        // `jit_trace_result_t` comes back in rax, the exit index in the low half.
+        jit_emit_rm(jit, 0x89, JIT_ITERATIONS, jit_reg(jit_reg_Ax));
+        dck_stretchy_push(jit->code, (u8)0x48);    // shl rax, 32
+        dck_stretchy_push(jit->code, (u8)0xC1);
+        dck_stretchy_push(jit->code, (u8)0xE0);
+        dck_stretchy_push(jit->code, (u8)0x20);
+        dck_stretchy_push(jit->code, (u8)0x48);    // or rax, exit index
+        dck_stretchy_push(jit->code, (u8)0x0D);
+        jit_emit_u32(jit, patch.label_index);
+        dck_stretchy_push(jit->code, (u8)0xC3);    // ret
+    }
+    jit->jump_patches.count = 0;
+
+    trace->exit_count = jit->trace_exits.count - trace->exit_offset;
+
+    void *page = jit_finalize(jit);
+    memcpy(&trace->entry, &page, sizeof(trace->entry));
+
+    if (page)
+        return true;
+
+fail:
+    jit->trace_exits.count  = trace->exit_offset;
+    jit->jump_patches.count = 0;
+    return false;
+}
+
+void
+jit_execute(jit_func_t *func, vm_thread_t *thread)
+{
+    ASSERT(func->entry);
+
+    thread->bp = 0;
+    thread->popped_pos = 0;
+
+    if (thread->memory.count < func->frame_size) {
+        dck_stretchy_reserve(thread->memory, func->frame_size - thread->memory.count);
+        thread->memory.count = func->frame_size;
+    }
+
+    func->entry(thread->memory.data + thread->bp);
+}
+
+void
+jit_free(jit_t *jit)
+{
+#if defined(JIT_SUPPORTED)
+    for (u32 i = 0; i < jit->pages.count; ++i) {
+        munmap(jit->pages.data[i], jit->page_sizes.data[i]);
+    }
+#endif
+
+    free(jit->code.data);
+    free(jit->jump_patches.data);
+    free(jit->labels.data);
+    free(jit->pages.data);
+    free(jit->page_sizes.data);
+    free(jit->trace_exits.data);
+
+    *jit = (jit_t) {0};
+}
@@ -0,0 +1,114 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include "metacz.h"
+#include "interpreter.h"
+
+/*
+ * x86-64 backend
+ */
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__unix__))
+    #define JIT_SUPPORTED
+#endif
+
+// Takes the frame with the inputs at offset 0, leaves the outputs there.
+typedef void (*jit_entry_t)(u8 *frame);
+
+typedef struct
+{
+    jit_entry_t entry;
+
+    // Bytes the frame needs, inputs + variables + evaluation slots that didn't get a register.
+    u32 frame_size;
+    u32 out_size;
+} jit_func_t;
+
+typedef struct
+{
+    u32 label_index;
+    u32 code_offset;
+    // Depth of the evaluation stack when jumping to / arriving at the label.
+    u32 depth;
+} jit_patch_t;
+
+// One recorded op of a loop trace.
+typedef struct
+{
+    u32 op_index;
+    // Conditional jumps only, whether it went to its target while recording.
+    b32 taken;
+} jit_trace_step_t;
+
+// Where the interpreter picks up after a guard failed.
+typedef struct
+{
+    u32 op_index;
+    // Relative to `bp`.
+    u32 sp;
+} jit_trace_exit_t;
+
+typedef struct
+{
+    u32 exit_index;
+    // Iterations that made it back to the header before the exit.
+    u32 iterations;
+} jit_trace_result_t;
+
+// Takes the frame at `bp` and the cached A and B, returns which exit it left through and when.
+typedef jit_trace_result_t (*jit_trace_entry_t)(u8 *frame, vm_registers_t *registers);
+
+typedef struct
+{
+    jit_trace_entry_t entry;
+    // Into `jit_t.trace_exits`.
+    u32 exit_offset;
+    u32 exit_count;
+    // Highest stack offset from `bp` the trace touches, must be reserved before entering.
+    u32 max_sp;
+} jit_trace_t;
+
+typedef struct
+{
+    dck_stretchy_t (u8, u32) code;
+
+    dck_stretchy_t (jit_patch_t, u32) jump_patches;
+    dck_stretchy_t (jit_patch_t, u32) labels;
+
+    u32 depth;
+    u32 max_depth;
+    // Frame offset of the evaluation slots that live in memory.
+    u32 eval_base;
+    b32 unreachable;
+
+    // Executable mappings, one per compiled function or trace.
+    dck_stretchy_t (void *, u32) pages;
+    dck_stretchy_t (u64,    u32) page_sizes;
+
+    dck_stretchy_t (jit_trace_exit_t, u32) trace_exits;
+} jit_t;
+
+// Whether `jit_compile` handles the function: only ints, no calls, and a backend for this machine.
+b32
+jit_is_supported(cz_t *cz, func_ref_t func_ref);
+
+// `entry` is NULL for functions `jit_is_supported` doesn't take.
+jit_func_t
+jit_compile(jit_t *jit, cz_t *cz, func_ref_t func_ref);
+
+/* Compiles one iteration of a loop recorded by stepping `program`, from the loop header back to it.
+ * `sp` is the stack offset from `bp` at the header. Conditional jumps become guards that leave
+ * the trace where the interpreter would have gone the other way, everything else loops in native code.
+ * False for traces with ops it doesn't handle, values that aren't whole dwords among them.
+ */
+b32
+jit_compile_trace(jit_t *jit, const vm_program_t *program, const jit_trace_step_t *steps, u32 step_count,
+                  u32 sp, jit_trace_t *trace);
+
+// Runs on `thread->memory` so that `VM_PUSH` / `VM_GET` work the same as with `vm_execute`.
+void
+jit_execute(jit_func_t *func, vm_thread_t *thread);
+
+void
+jit_free(jit_t *jit);
+
+#endif // JIT_H_
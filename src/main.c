@@ -1,6 +1,10 @@
 #include "metacz.h"
 #include "interpreter.h"
 
+#if defined(MODEL_AOT)
+    #include "aot.h"
+#endif
+
 func_ref_t
 f_add_nums(cz_t *cz)
 {
@@ -46,28 +50,71 @@ main(void)
 
     cz_debug_dump(&cz);
 
-    vm_t vm = {0};
+    vm_program_t program = {0};
+    vm_thread_t  thread  = {0};
     vm_compiler_t compiler = {0};
 
+#if defined(VM_STATS)
+    static vm_stats_t stats;
+    thread.stats = &stats;
+#endif
+
     printf("\nproc 1:\n");
-    u32 code_offset = vm_compile(&vm, &compiler, &cz, proc_index);
-    vm_disassemble(&vm, &cz, code_offset);
-
-    vm_clear(&vm);
-    VM_PUSH(&vm, i32, &(i32) { 5 });
-    VM_PUSH(&vm, i32, &(i32) { 3 });
-    vm_execute(&vm, &cz, code_offset);
-    int res = *VM_GET(&vm, i32);
+    u32 code_offset = vm_compile(&program, &compiler, &cz, proc_index);
+    vm_disassemble(&program, &cz, code_offset);
+    printf("decoded:\n");
+    vm_disassemble_ops(&program, &cz, code_offset);
+
+    vm_clear(&thread);
+    VM_PUSH(&thread, i32, &(i32) { 5 });
+    VM_PUSH(&thread, i32, &(i32) { 3 });
+    vm_execute(&program, &thread, &cz, code_offset);
+    int res = *VM_GET(&thread, i32);
     printf("res = %d\n", res);
 
     printf("\nproc 2:\n");
-    u32 code_offset_2 = vm_compile(&vm, &compiler, &cz, proc_index_2);
-    vm_disassemble(&vm, &cz, code_offset_2);
+    u32 code_offset_2 = vm_compile(&program, &compiler, &cz, proc_index_2);
+    vm_disassemble(&program, &cz, code_offset_2);
+    printf("decoded:\n");
+    vm_disassemble_ops(&program, &cz, code_offset_2);
+
+    vm_clear(&thread);
+    VM_PUSH(&thread, i32, &res);
+    vm_execute(&program, &thread, &cz, code_offset_2);
+    printf("res = %d\n", *VM_GET(&thread, i32));
+
+#if defined(VM_STATS)
+    printf("\nstats:\n");
+    vm_stats_dump(&stats, stdout, 16);
+#endif
+
+#if defined(MODEL_AOT)
+    printf("\naot:\n");
+
+    aot_t aot = {0};
+
+    if (!aot_add(&aot, &cz, proc_index)
+     || !aot_add(&aot, &cz, proc_index_2)
+     || !aot_emit(&aot, &cz, "model_aot.c")
+     || !aot_build("model_aot.c", "./model_aot.so")
+     || !aot_load(&aot, &cz, "./model_aot.so")) {
+        return 1;
+    }
+
+    vm_clear(&thread);
+    VM_PUSH(&thread, i32, &(i32) { 5 });
+    VM_PUSH(&thread, i32, &(i32) { 3 });
+    aot_execute(aot_lookup(&aot, proc_index), &thread);
+    res = *VM_GET(&thread, i32);
+    printf("res = %d\n", res);
+
+    vm_clear(&thread);
+    VM_PUSH(&thread, i32, &res);
+    aot_execute(aot_lookup(&aot, proc_index_2), &thread);
+    printf("res = %d\n", *VM_GET(&thread, i32));
 
-    vm_clear(&vm);
-    VM_PUSH(&vm, i32, &res);
-    vm_execute(&vm, &cz, code_offset_2);
-    printf("res = %d\n", *VM_GET(&vm, i32));
+    aot_free(&aot);
+#endif
 
     printf("\\_/\n V\n");
     return 0;
@@ -351,6 +351,8 @@ cz_code_store(cz_t *cz, ref_t ref)
         return;
     }
 
+    cz->type_stack_size--;
+
     abs_code_t code;
 
     switch (ref.tag) {
@@ -365,6 +367,38 @@ cz_code_store(cz_t *cz, ref_t ref)
     dck_stretchy_push(cz->rec_code, (abs_code_t) { .value = ref.index_for_tag });
 }
 
+void
+cz_code_call(cz_t *cz, func_ref_t func_ref)
+{
+    if (func_ref.func_index >= cz->abs_funcs.count) {
+        cz->error = "Call of an unknown function";
+        return;
+    }
+
+    u32 in_count  = cz->abs_funcs.data[func_ref.func_index].in_count;
+    u32 out_count = cz->abs_funcs.data[func_ref.func_index].out_count;
+
+    // Still being recorded, the signature is declared before the code so it's complete already.
+    for (u32 i = 0; i < cz->rec_funcs.count; ++i) {
+        rec_func_t *rec_func = cz->rec_funcs.data + i;
+
+        if (rec_func->abs_func_index == func_ref.func_index) {
+            in_count  = rec_func->in_count;
+            out_count = rec_func->out_count;
+        }
+    }
+
+    if (cz->type_stack_size < in_count) {
+        cz->error = "Call with less elements on the stack than function input";
+        return;
+    }
+
+    cz->type_stack_size -= in_count;
+    cz->type_stack_size += out_count;
+
+    dck_stretchy_push(cz->rec_code, (abs_code_t) { .inst  = abs_inst_Call });
+    dck_stretchy_push(cz->rec_code, (abs_code_t) { .index = func_ref.func_index });
+}
 
 func_ref_t
 cz_func_end(cz_t *cz)
@@ -401,6 +435,8 @@ cz_func_end(cz_t *cz)
         .in_base  = rec_func->in_offset,
         .var_base = rec_func->var_offset,
 
+        .label_count = rec_func->next_label_index,
+
         .parent_func_index = rec_func->parent_func_index,
     };
 
@@ -620,3 +656,198 @@ cz_jmp_end(cz_t *cz, jmp_type_t type, scope_ref_t scope_ref)
     dck_stretchy_push(cz->rec_code, (abs_code_t) { .value = frame->label_index });
 }
 
+
+// Callee that ends in its only Ret, so dropping that Ret leaves the outputs on the stack.
+static b32
+cz_is_inlinable(cz_t *cz, u32 caller_index, u32 callee_index)
+{
+    if (callee_index == caller_index)
+        return false;
+
+    abs_func_t *callee = cz->abs_funcs.data + callee_index;
+    abs_code_t *code   = cz->abs_code.data + callee->code_offset;
+
+    u32 inst_index = 0;
+    while (inst_index < callee->code_count) {
+        if (code[inst_index].inst == abs_inst_Ret)
+            return inst_index + 1 == callee->code_count;
+
+        inst_index += abs_inst_size(code[inst_index].inst);
+    }
+
+    return false;
+}
+
+static b32
+cz_should_inline(cz_t *cz, cz_inline_options_t options, u32 *site_counts, u32 caller_index, u32 callee_index)
+{
+    u32 callee_size = cz->abs_funcs.data[callee_index].code_count;
+
+    b32 is_small = callee_size <= options.max_size ||
+                   (site_counts[callee_index] == 1 && callee_size <= options.max_single_site_size);
+
+    return is_small && cz_is_inlinable(cz, caller_index, callee_index);
+}
+
+static void
+cz_push_inst(cz_t *cz, abs_inst_t inst, u32 index)
+{
+    dck_stretchy_push(cz->abs_code, (abs_code_t) { .inst  = inst });
+    dck_stretchy_push(cz->abs_code, (abs_code_t) { .index = index });
+}
+
+u32
+cz_inline(cz_t *cz, cz_inline_options_t options)
+{
+    ASSERT(cz->rec_funcs.count == 0);
+
+    u32 *site_counts = calloc(cz->abs_funcs.count, sizeof(u32));
+    if (site_counts == NULL) {
+        fprintf(stderr, "%s:%d: calloc failure! exiting...\n", __FILE__, __LINE__);
+        exit(666);
+    }
+
+    for (u32 func_index = 0; func_index < cz->abs_funcs.count; ++func_index) {
+        abs_func_t *func = cz->abs_funcs.data + func_index;
+        abs_code_t *code = cz->abs_code.data + func->code_offset;
+
+        for (u32 inst_index = 0; inst_index < func->code_count; inst_index += abs_inst_size(code[inst_index].inst)) {
+            if (code[inst_index].inst == abs_inst_Call) {
+                site_counts[code[inst_index + 1].index]++;
+            }
+        }
+    }
+
+    u32 inlined = 0;
+
+    for (u32 func_index = 0; func_index < cz->abs_funcs.count; ++func_index) {
+        abs_func_t func = cz->abs_funcs.data[func_index];
+
+        b32 has_sites = false;
+        for (u32 inst_index = 0; inst_index < func.code_count; inst_index += abs_inst_size(cz->abs_code.data[func.code_offset + inst_index].inst)) {
+            abs_code_t *code = cz->abs_code.data + func.code_offset + inst_index;
+
+            if (code[0].inst == abs_inst_Call && cz_should_inline(cz, options, site_counts, func_index, code[1].index)) {
+                has_sites = true;
+                break;
+            }
+        }
+        if (!has_sites)
+            continue;
+
+        /* The function is rewritten at the end of abs_code / abs_func_vars, the old copy stays
+         * unreferenced. Everything is addressed by index, pushing may move the arrays.
+         */
+        u32 code_offset = cz->abs_code.count;
+        u32 var_offset  = cz->abs_func_vars.count;
+        u32 var_count   = func.var_count;
+        u32 label_count = func.label_count;
+
+        for (u32 i = 0; i < func.var_count; ++i) {
+            dck_stretchy_push(cz->abs_func_vars, cz->abs_func_vars.data[func.var_offset + i]);
+        }
+
+        u32 inst_index = 0;
+        while (inst_index < func.code_count) {
+            abs_code_t code = cz->abs_code.data[func.code_offset + inst_index];
+            u32 size = abs_inst_size(code.inst);
+
+            b32 is_site = code.inst == abs_inst_Call &&
+                          cz_should_inline(cz, options, site_counts, func_index,
+                                           cz->abs_code.data[func.code_offset + inst_index + 1].index);
+
+            if (!is_site) {
+                for (u32 i = 0; i < size; ++i) {
+                    dck_stretchy_push(cz->abs_code, cz->abs_code.data[func.code_offset + inst_index + i]);
+                }
+                inst_index += size;
+                continue;
+            }
+
+            u32 callee_index  = cz->abs_code.data[func.code_offset + inst_index + 1].index;
+            abs_func_t callee = cz->abs_funcs.data[callee_index];
+
+            // Callee inputs followed by callee variables, all become caller variables.
+            u32 in_var = func.var_base + var_count;
+            u32 callee_var = in_var + callee.in_count;
+
+            for (u32 i = 0; i < callee.in_count; ++i) {
+                dck_stretchy_push(cz->abs_func_vars, cz->abs_func_ins.data[callee.in_offset + i]);
+            }
+            for (u32 i = 0; i < callee.var_count; ++i) {
+                dck_stretchy_push(cz->abs_func_vars, cz->abs_func_vars.data[callee.var_offset + i]);
+            }
+            var_count += callee.in_count + callee.var_count;
+
+            // The last argument is on top of the stack.
+            for (u32 i = callee.in_count; i-- > 0;) {
+                cz_push_inst(cz, abs_inst_StoreVar, in_var + i);
+            }
+
+            // Everything up to the trailing Ret.
+            u32 callee_inst = 0;
+            while (callee_inst + 1 < callee.code_count) {
+                abs_code_t callee_code = cz->abs_code.data[callee.code_offset + callee_inst];
+                u32 callee_inst_size = abs_inst_size(callee_code.inst);
+                u32 operand = cz->abs_code.data[callee.code_offset + callee_inst + callee_inst_size - 1].index;
+
+                switch (callee_code.inst) {
+                    case abs_inst_LoadIn:     cz_push_inst(cz, abs_inst_LoadVar,     in_var + operand - callee.in_base);      break;
+                    case abs_inst_StoreIn:    cz_push_inst(cz, abs_inst_StoreVar,    in_var + operand - callee.in_base);      break;
+                    case abs_inst_LoadRefIn:  cz_push_inst(cz, abs_inst_LoadRefVar,  in_var + operand - callee.in_base);      break;
+                    case abs_inst_StoreRefIn: cz_push_inst(cz, abs_inst_StoreRefVar, in_var + operand - callee.in_base);      break;
+
+                    case abs_inst_LoadVar:     /* fallthrough */
+                    case abs_inst_StoreVar:    /* fallthrough */
+                    case abs_inst_LoadRefVar:  /* fallthrough */
+                    case abs_inst_StoreRefVar:
+                        cz_push_inst(cz, callee_code.inst, callee_var + operand - callee.var_base);
+                        break;
+
+                    case abs_inst_Label: /* fallthrough */
+                    case abs_inst_JmpUc: /* fallthrough */
+                    case abs_inst_JmpNz: /* fallthrough */
+                    case abs_inst_JmpZe: /* fallthrough */
+                    case abs_inst_JmpEq: /* fallthrough */
+                    case abs_inst_JmpNe: /* fallthrough */
+                    case abs_inst_JmpLt: /* fallthrough */
+                    case abs_inst_JmpGt: /* fallthrough */
+                    case abs_inst_JmpLe: /* fallthrough */
+                    case abs_inst_JmpGe:
+                        cz_push_inst(cz, callee_code.inst, label_count + operand);
+                        break;
+
+                    case abs_inst_Call:
+                        // One more site for what the callee calls, single site callees may not be any longer.
+                        site_counts[operand]++;
+                        cz_push_inst(cz, callee_code.inst, operand);
+                        break;
+
+                    default:
+                        for (u32 i = 0; i < callee_inst_size; ++i) {
+                            dck_stretchy_push(cz->abs_code, cz->abs_code.data[callee.code_offset + callee_inst + i]);
+                        }
+                        break;
+                }
+
+                callee_inst += callee_inst_size;
+            }
+            label_count += callee.label_count;
+
+            site_counts[callee_index]--;
+            inlined += 1;
+            inst_index += size;
+        }
+
+        abs_func_t *dst = cz->abs_funcs.data + func_index;
+        dst->var_offset  = var_offset;
+        dst->var_count   = var_count;
+        dst->code_offset = code_offset;
+        dst->code_count  = cz->abs_code.count - code_offset;
+        dst->label_count = label_count;
+    }
+
+    free(site_counts);
+
+    return inlined;
+}
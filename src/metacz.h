@@ -92,8 +92,8 @@ typedef enum //              stack:
 
     abs_inst_Deref,          // (&a) -> (a)
 
-    abs_inst_Call,
-    abs_inst_Ret,
+    abs_inst_Call,           // (ins...) -> (outs...)
+    abs_inst_Ret,            // ()
 
     abs_inst_Label,          // ()
 
@@ -110,6 +110,25 @@ typedef enum //              stack:
     ABS_INST_COUNT
 } abs_inst_t;
 
+// Instruction plus operand words.
+static inline u32
+abs_inst_size(abs_inst_t inst)
+{
+    switch (inst) {
+        case abs_inst_Add:       /* fallthrough */
+        case abs_inst_Sub:       /* fallthrough */
+        case abs_inst_ArrRead:   /* fallthrough */
+        case abs_inst_ArrWrite:  /* fallthrough */
+        case abs_inst_ArrLength: /* fallthrough */
+        case abs_inst_Deref:     /* fallthrough */
+        case abs_inst_Ret:
+            return 1;
+
+        default:
+            return 2;
+    }
+}
+
 typedef enum
 {
     abs_ref_Var,
@@ -169,9 +188,20 @@ typedef struct
     u32 in_base;
     u32 var_base;
 
+    // Labels are numbered from 0 up to this.
+    u32 label_count;
+
     u32 parent_func_index;
 } abs_func_t;
 
+typedef struct
+{
+    // Callees up to this many code words are inlined at every call site.
+    u32 max_size;
+    // Callees called from a single site are inlined up to this size. Sites are counted as the code gets rewritten.
+    u32 max_single_site_size;
+} cz_inline_options_t;
+
 typedef struct
 {
     u32 frame_offset;
@@ -335,6 +365,14 @@ do { \
 void
 cz_code_store(cz_t *cz, ref_t ref);
 
+#define CZ_CALL(m_func_ref) \
+do { \
+    cz_code_call(cz, m_func_ref); \
+    CZ_ERROR_CHECK(cz); \
+} while(0)
+void
+cz_code_call(cz_t *cz, func_ref_t func_ref);
+
 
 func_ref_t
 cz_func_begin(cz_t *cz);
@@ -392,6 +430,14 @@ void
 cz_jmp_end(cz_t *cz, jmp_type_t type, scope_ref_t scope);
 
 
+/* Copies the bodies of small callees into their callers, the callers keep their func_ref_t.
+ * The callees themselves stay as they are, they can still be compiled and called on their own.
+ * Only call once every function is recorded. Returns the number of call sites inlined.
+ */
+u32
+cz_inline(cz_t *cz, cz_inline_options_t options);
+
+
 void
 cz_debug_dump(cz_t *cz);
 
@@ -0,0 +1,156 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static void
+pool_work(pool_t *pool, vm_thread_t *thread)
+{
+    pool_job_t *job = &pool->job;
+
+    for (;;) {
+        u32 start = atomic_fetch_add_explicit(&pool->next, POOL_CHUNK_SIZE, memory_order_relaxed);
+        if (start >= job->count)
+            break;
+
+        u32 count = job->count - start;
+        if (count > POOL_CHUNK_SIZE) {
+            count = POOL_CHUNK_SIZE;
+        }
+
+        // Chunks never overlap so neither do the output slices.
+        vm_execute_batch(job->program, thread, job->cz, job->code_offset,
+                         job->inputs + (u64)start * job->stride, job->stride, count,
+                         job->outputs + (u64)start * job->out_size);
+    }
+}
+
+static void *
+pool_worker_main(void *arg)
+{
+    pool_worker_t *worker = arg;
+    pool_t *pool = worker->pool;
+
+    u32 generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == generation && !pool->quit) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_work(pool, &worker->thread);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--(pool->pending) == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void
+pool_init(pool_t *pool, u32 thread_count)
+{
+    *pool = (pool_t) {0};
+
+    if (thread_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cores > 0 ? (u32)cores : 1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    atomic_init(&pool->next, 0);
+
+    pool->worker_count = thread_count - 1;
+    if (pool->worker_count == 0)
+        return;
+
+    pool->workers = calloc(pool->worker_count, sizeof(pool_worker_t));
+    if (pool->workers == NULL) {
+        fprintf(stderr, "%s:%d: calloc failure! exiting...\n", __FILE__, __LINE__);
+        exit(666);
+    }
+
+    for (u32 i = 0; i < pool->worker_count; ++i) {
+        pool_worker_t *worker = pool->workers + i;
+        worker->pool = pool;
+
+        if (pthread_create(&worker->handle, NULL, pool_worker_main, worker) != 0) {
+            fprintf(stderr, "%s:%d: pthread_create failure! exiting...\n", __FILE__, __LINE__);
+            exit(666);
+        }
+    }
+}
+
+void
+pool_execute_batch(pool_t *pool, const vm_program_t *program, cz_t *cz, u32 code_offset,
+                   const void *inputs, u32 stride, u32 count, void *outputs)
+{
+    // Not worth waking anybody up.
+    if (pool->worker_count == 0 || count <= POOL_CHUNK_SIZE) {
+        vm_execute_batch(program, &pool->caller, cz, code_offset, inputs, stride, count, outputs);
+        return;
+    }
+
+    const vm_function_t *function = vm_find_function(program, code_offset);
+    ASSERT(function);
+
+    pthread_mutex_lock(&pool->lock);
+
+    pool->job = (pool_job_t) {
+        .program     = program,
+        .cz          = cz,
+        .code_offset = code_offset,
+        .inputs      = inputs,
+        .stride      = stride,
+        .count       = count,
+        .outputs     = outputs,
+        .out_size    = function->out_size,
+    };
+    atomic_store_explicit(&pool->next, 0, memory_order_relaxed);
+
+    pool->pending = pool->worker_count;
+    pool->generation += 1;
+    pthread_cond_broadcast(&pool->wake);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool, &pool->caller);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending != 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+pool_free(pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (u32 i = 0; i < pool->worker_count; ++i) {
+        pthread_join(pool->workers[i].handle, NULL);
+        vm_thread_free(&pool->workers[i].thread);
+    }
+    free(pool->workers);
+    vm_thread_free(&pool->caller);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+
+    *pool = (pool_t) {0};
+}
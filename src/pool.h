@@ -0,0 +1,76 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include "metacz.h"
+#include "interpreter.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Worker pool, splits one batch of `vm_execute_batch` across all cores.
+ */
+
+// Tuples a worker takes at once, small enough to even out functions that loop a varying amount.
+#define POOL_CHUNK_SIZE 256
+
+typedef struct
+{
+    const vm_program_t *program;
+    cz_t *cz;
+    u32 code_offset;
+
+    const u8 *inputs;
+    u32 stride;
+    u32 count;
+
+    u8 *outputs;
+    u32 out_size;
+} pool_job_t;
+
+typedef struct
+{
+    pthread_t handle;
+    // Every worker runs on its own stack, the program is shared.
+    vm_thread_t thread;
+
+    void *pool;
+} pool_worker_t;
+
+// Must not move after `pool_init`, the workers point back to it.
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    pthread_cond_t  done;
+
+    pool_worker_t *workers;
+    u32 worker_count;
+
+    // The calling thread works on the batch too.
+    vm_thread_t caller;
+
+    pool_job_t job;
+    // Next tuple nobody has taken yet.
+    atomic_uint next;
+
+    // Bumped for every batch, workers sleep until it changes.
+    u32 generation;
+    // Workers that haven't finished the current batch.
+    u32 pending;
+    b32 quit;
+} pool_t;
+
+// `thread_count` includes the caller, 0 uses every online core.
+void
+pool_init(pool_t *pool, u32 thread_count);
+
+// Same contract as `vm_execute_batch`, returns once every tuple is done.
+void
+pool_execute_batch(pool_t *pool, const vm_program_t *program, cz_t *cz, u32 code_offset,
+                   const void *inputs, u32 stride, u32 count, void *outputs);
+
+void
+pool_free(pool_t *pool);
+
+#endif // POOL_H_
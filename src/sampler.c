@@ -0,0 +1,224 @@
+#include "sampler.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static sampler_t *volatile sampler_active;
+static struct sigaction sampler_old_action;
+
+static void
+sampler_handler(int sig)
+{
+    (void)sig;
+
+    sampler_t *sampler = sampler_active;
+    if (sampler == NULL)
+        return;
+
+    int saved_errno = errno;
+
+    const vm_thread_t *thread = sampler->thread;
+    u32 pos = thread->sample_pos;
+
+    if (pos == 0) {
+        atomic_fetch_add_explicit(&sampler->idle, 1, memory_order_relaxed);
+        errno = saved_errno;
+        return;
+    }
+
+    sampler_ring_t *ring = &sampler->ring;
+
+    u32 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    u32 tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail == SAMPLER_RING_SIZE) {
+        atomic_fetch_add_explicit(&sampler->dropped, 1, memory_order_relaxed);
+        errno = saved_errno;
+        return;
+    }
+
+    // The thread is interrupted, its frames can't change under us.
+    sampler_sample_t *sample = ring->samples + (head & (SAMPLER_RING_SIZE - 1));
+    sample->ops[0] = pos - 1;
+    sample->depth  = 1;
+
+    for (u32 i = thread->frames.count; i-- > 0 && sample->depth < SAMPLER_MAX_DEPTH;) {
+        sample->ops[sample->depth++] = thread->frames.data[i].ret;
+    }
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    errno = saved_errno;
+}
+
+b32
+sampler_start(sampler_t *sampler, const vm_thread_t *thread, u32 hz)
+{
+    ASSERT(hz > 0 && hz <= 1000000);
+
+    if (sampler_active != NULL)
+        return false;
+
+    sampler->thread = thread;
+    atomic_init(&sampler->ring.head, 0);
+    atomic_init(&sampler->ring.tail, 0);
+    atomic_init(&sampler->idle, 0);
+    atomic_init(&sampler->dropped, 0);
+
+    struct sigaction action = {0};
+    action.sa_handler = sampler_handler;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGPROF, &action, &sampler_old_action) != 0)
+        return false;
+
+    sampler_active = sampler;
+
+    struct itimerval timer = {0};
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        sampler_active = NULL;
+        sigaction(SIGPROF, &sampler_old_action, NULL);
+        return false;
+    }
+
+    return true;
+}
+
+void
+sampler_stop(sampler_t *sampler)
+{
+    ASSERT(sampler_active == sampler);
+
+    struct itimerval timer = {0};
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    sigaction(SIGPROF, &sampler_old_action, NULL);
+    sampler_active = NULL;
+
+    sampler_drain(sampler);
+}
+
+void
+sampler_drain(sampler_t *sampler)
+{
+    sampler_ring_t *ring = &sampler->ring;
+
+    u32 tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    u32 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    for (; tail != head; ++tail) {
+        dck_stretchy_push(sampler->samples, ring->samples[tail & (SAMPLER_RING_SIZE - 1)]);
+    }
+
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+// Last label at or before the instruction, CZ_NO_ID before the first one.
+static u32
+sampler_label(cz_t *cz, vm_abs_loc_t loc)
+{
+    abs_func_t *func = cz->abs_funcs.data + loc.func_index;
+    abs_code_t *code = cz->abs_code.data + func->code_offset;
+
+    u32 label_index = CZ_NO_ID;
+
+    for (u32 inst_index = 0; inst_index <= loc.inst_index && inst_index < func->code_count;
+         inst_index += abs_inst_size(code[inst_index].inst)) {
+        if (code[inst_index].inst == abs_inst_Label) {
+            label_index = code[inst_index + 1].index;
+        }
+    }
+
+    return label_index;
+}
+
+static int
+sampler_line_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+b32
+sampler_write_folded(sampler_t *sampler, const vm_program_t *program, cz_t *cz, const char *path)
+{
+    u32 line_count = sampler->samples.count;
+
+    char **lines = calloc(line_count + 1, sizeof(char *));
+    if (lines == NULL) {
+        fprintf(stderr, "%s:%d: calloc failure! exiting...\n", __FILE__, __LINE__);
+        exit(666);
+    }
+
+    for (u32 i = 0; i < line_count; ++i) {
+        sampler_sample_t *sample = sampler->samples.data + i;
+
+        char line[SAMPLER_MAX_DEPTH * 16 + 32];
+        u32 length = 0;
+
+        for (u32 depth = sample->depth; depth-- > 0;) {
+            const vm_op_t *op = program->ops.data + sample->ops[depth];
+            vm_abs_loc_t loc = vm_find_abs_loc(program, op->code_offset);
+
+            length += snprintf(line + length, sizeof(line) - length, "f%u;", loc.func_index);
+
+            if (depth == 0) {
+                u32 label_index = sampler_label(cz, loc);
+
+                if (label_index == CZ_NO_ID) {
+                    length += snprintf(line + length, sizeof(line) - length, "f%u:entry", loc.func_index);
+                }
+                else {
+                    length += snprintf(line + length, sizeof(line) - length, "f%u:L%u", loc.func_index, label_index);
+                }
+            }
+        }
+
+        lines[i] = strdup(line);
+        if (lines[i] == NULL) {
+            fprintf(stderr, "%s:%d: strdup failure! exiting...\n", __FILE__, __LINE__);
+            exit(666);
+        }
+    }
+
+    // Identical stacks end up next to each other.
+    qsort(lines, line_count, sizeof(char *), sampler_line_compare);
+
+    FILE *file = fopen(path, "w");
+
+    if (file != NULL) {
+        for (u32 i = 0; i < line_count;) {
+            u32 run = 1;
+            while (i + run < line_count && strcmp(lines[i], lines[i + run]) == 0) {
+                ++run;
+            }
+
+            fprintf(file, "%s %u\n", lines[i], run);
+            i += run;
+        }
+    }
+
+    for (u32 i = 0; i < line_count; ++i) {
+        free(lines[i]);
+    }
+    free(lines);
+
+    return file != NULL && fclose(file) == 0;
+}
+
+void
+sampler_free(sampler_t *sampler)
+{
+    ASSERT(sampler_active != sampler);
+
+    free(sampler->samples.data);
+    sampler->samples.data     = NULL;
+    sampler->samples.count    = 0;
+    sampler->samples.capacity = 0;
+}
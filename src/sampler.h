@@ -0,0 +1,78 @@
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include "metacz.h"
+#include "interpreter.h"
+
+#include <stdatomic.h>
+
+/*
+ * Sampling profiler, a `SIGPROF` timer records where `vm_execute` is and the frames above it.
+ * Samples are resolved to abs functions and labels offline and written as folded stacks.
+ *
+ * The position is where execution last entered a function or went through a jump, conditional
+ * ones included whichever way they went. Code that falls through into a label without a jump
+ * is charged to the label the position was set under, up to the next jump, call or return.
+ */
+
+// Frames recorded per sample, deeper stacks are cut at the outermost end.
+#define SAMPLER_MAX_DEPTH 32
+// Power of two, ~4 seconds at 1 kHz between drains.
+#define SAMPLER_RING_SIZE 4096
+
+typedef struct
+{
+    u32 depth;
+    // Op indices, the sampled position first and then the return ops of the callers.
+    u32 ops[SAMPLER_MAX_DEPTH];
+} sampler_sample_t;
+
+// Only the signal handler writes `head` and only `sampler_drain` writes `tail`.
+typedef struct
+{
+    sampler_sample_t samples[SAMPLER_RING_SIZE];
+    atomic_uint head;
+    atomic_uint tail;
+} sampler_ring_t;
+
+// Must not move while running, the signal handler points to it.
+typedef struct
+{
+    const vm_thread_t *thread;
+
+    sampler_ring_t ring;
+
+    // Drained samples, waiting to be resolved.
+    dck_stretchy_t (sampler_sample_t, u32) samples;
+
+    // Ticks that landed outside of `vm_execute` or in the middle of a call.
+    atomic_uint idle;
+    // Ticks lost to a full ring.
+    atomic_uint dropped;
+} sampler_t;
+
+/* Samples `thread` `hz` times per second of CPU time, only one sampler runs at a time.
+ * The timer is process wide, other threads should block `SIGPROF`.
+ */
+b32
+sampler_start(sampler_t *sampler, const vm_thread_t *thread, u32 hz);
+
+// Stops the timer and drains what is left.
+void
+sampler_stop(sampler_t *sampler);
+
+// Moves the ring into `samples`, safe while running.
+void
+sampler_drain(sampler_t *sampler);
+
+/* One line per distinct stack, outermost first, `f<func_index>` per frame and the label
+ * the sampled position is under last:
+ *     f2;f5;f5:L3 17
+ */
+b32
+sampler_write_folded(sampler_t *sampler, const vm_program_t *program, cz_t *cz, const char *path);
+
+void
+sampler_free(sampler_t *sampler);
+
+#endif // SAMPLER_H_
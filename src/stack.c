@@ -0,0 +1,131 @@
+#include "stack.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// A free slot has no base, a slot being claimed has `UINTPTR_MAX` until its size is in place.
+typedef struct
+{
+    atomic_uintptr_t base;
+    u32 size;
+} stack_region_t;
+
+static stack_region_t stack_regions[STACK_MAX_MAPPED];
+
+static pthread_once_t stack_handler_once = PTHREAD_ONCE_INIT;
+static struct sigaction stack_old_action;
+
+static void
+stack_handler(int sig, siginfo_t *info, void *context)
+{
+    uintptr_t address = (uintptr_t)info->si_addr;
+
+    for (u32 i = 0; i < STACK_MAX_MAPPED; ++i) {
+        uintptr_t base = atomic_load_explicit(&stack_regions[i].base, memory_order_acquire);
+
+        if (base == 0 || base == UINTPTR_MAX)
+            continue;
+
+        if (address >= base + stack_regions[i].size && address < base + STACK_REGION_SIZE) {
+            static const char message[] = "vm: stack overflow! exiting...\n";
+            write(STDERR_FILENO, message, sizeof(message) - 1);
+            _exit(1);
+        }
+    }
+
+    // Not ours, whoever was there before gets it.
+    if (stack_old_action.sa_flags & SA_SIGINFO) {
+        stack_old_action.sa_sigaction(sig, info, context);
+    }
+    else if (stack_old_action.sa_handler != SIG_DFL && stack_old_action.sa_handler != SIG_IGN) {
+        stack_old_action.sa_handler(sig);
+    }
+    else {
+        // Faults again on return, the default action ends the process.
+        signal(sig, SIG_DFL);
+    }
+}
+
+static void
+stack_install_handler(void)
+{
+    struct sigaction action = {0};
+    action.sa_sigaction = stack_handler;
+    action.sa_flags     = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+
+    sigaction(SIGSEGV, &action, &stack_old_action);
+}
+
+b32
+stack_map(vm_thread_t *thread, u32 size, b32 huge_pages)
+{
+    ASSERT(thread->memory.data == NULL);
+
+    u32 page_size = (u32)sysconf(_SC_PAGESIZE);
+    ASSERT(size > 0 && size <= UINT32_MAX - page_size);
+    size = (size + page_size - 1) / page_size * page_size;
+
+    u8 *base = mmap(NULL, STACK_REGION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return false;
+
+    if (mprotect(base, size, PROT_READ | PROT_WRITE) != 0) {
+        munmap(base, STACK_REGION_SIZE);
+        return false;
+    }
+
+#if defined(MADV_HUGEPAGE)
+    // Only a hint, stacks work the same without it.
+    if (huge_pages) {
+        madvise(base, size, MADV_HUGEPAGE);
+    }
+#else
+    (void)huge_pages;
+#endif
+
+    pthread_once(&stack_handler_once, stack_install_handler);
+
+    for (u32 i = 0; i < STACK_MAX_MAPPED; ++i) {
+        uintptr_t expected = 0;
+        if (!atomic_compare_exchange_strong(&stack_regions[i].base, &expected, UINTPTR_MAX))
+            continue;
+
+        stack_regions[i].size = size;
+        atomic_store_explicit(&stack_regions[i].base, (uintptr_t)base, memory_order_release);
+
+        thread->memory.data     = base;
+        thread->memory.count    = 0;
+        thread->memory.capacity = UINT32_MAX;
+        thread->is_mapped       = true;
+        return true;
+    }
+
+    munmap(base, STACK_REGION_SIZE);
+    return false;
+}
+
+void
+stack_unmap(vm_thread_t *thread)
+{
+    uintptr_t base = (uintptr_t)thread->memory.data;
+    b32 is_found = false;
+
+    for (u32 i = 0; i < STACK_MAX_MAPPED && !is_found; ++i) {
+        if (atomic_load_explicit(&stack_regions[i].base, memory_order_relaxed) == base) {
+            atomic_store_explicit(&stack_regions[i].base, 0, memory_order_release);
+            munmap(thread->memory.data, STACK_REGION_SIZE);
+            is_found = true;
+        }
+    }
+
+    ASSERT(is_found); // Not from `stack_map`.
+
+    memset(&thread->memory, 0, sizeof(thread->memory));
+    thread->is_mapped = false;
+}
@@ -0,0 +1,32 @@
+#ifndef STACK_H_
+#define STACK_H_
+
+#include "metacz.h"
+#include "interpreter.h"
+
+/*
+ * VM stacks in a reserved virtual region instead of a `realloc`ed stretchy.
+ * The usable part is mapped up front and the kernel backs it page by page as it gets touched,
+ * so growing costs nothing and `memory.data` never moves, host code can keep pointers into it.
+ * The rest of the region stays `PROT_NONE`, overflowing into it is caught by a `SIGSEGV` handler.
+ */
+
+// Everything a `u32` offset from the base reaches, the part past the usable size is guard.
+#define STACK_REGION_SIZE ((u64)1 << 32)
+// Stacks mapped at once.
+#define STACK_MAX_MAPPED 64
+
+/* Moves `thread`, which must have no memory yet, onto a fresh region with `size` usable bytes.
+ * `memory.capacity` covers the whole region, the stretchy macros never reallocate it.
+ * `huge_pages` asks for transparent huge pages, fewer TLB misses on deep stacks.
+ * False if the region couldn't be reserved, the thread keeps growing as before then.
+ * Call after `debog_init`, faults outside of the guards go on to whatever handled them before.
+ */
+b32
+stack_map(vm_thread_t *thread, u32 size, b32 huge_pages);
+
+// `vm_thread_free` leaves mapped memory alone, this can come before or after it.
+void
+stack_unmap(vm_thread_t *thread);
+
+#endif // STACK_H_
@@ -1,5 +1,16 @@
 #include "metacz.h"
 #include "interpreter.h"
+#include "jit.h"
+#include "aot.h"
+#include "pool.h"
+#include "sampler.h"
+#include "tracer.h"
+#include "tier.h"
+#include "stack.h"
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 func_ref_t
 f_add_example(cz_t *cz)
@@ -36,6 +47,281 @@ f_jmp_example(cz_t *cz)
     return cz_func_end(cz);
 }
 
+func_ref_t
+f_sub_example(cz_t *cz)
+{
+    cz_func_begin(cz);
+        ref_t a = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+        ref_t b = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        CZ_LOAD(a); CZ_LOAD(b); CZ_SUB();
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_loop_example(cz_t *cz)
+{
+    cz_func_begin(cz);
+        ref_t n = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        ref_t acc = cz_func_var(cz, CZ_BASIC_TYPE(Int));
+        ref_t i   = cz_func_var(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        CZ_LOAD_IMM(0); CZ_STORE(acc);
+        CZ_LOAD_IMM(0); CZ_STORE(i);
+        {
+            scope_ref_t _loop = cz_scope_begin(cz);
+            frame_ref_t __top = cz_scope_frame(cz);
+        /**/
+            CZ_LINK(__top);
+                CZ_LOAD(i); CZ_LOAD(n); CZ_JMP_END(Ge, _loop);
+                CZ_LOAD(acc); CZ_LOAD(i); CZ_ADD(); CZ_STORE(acc);
+                CZ_LOAD(i); CZ_LOAD_IMM(1); CZ_ADD(); CZ_STORE(i);
+                CZ_JMP(Uc, __top);
+            CZ_END();
+        }
+        CZ_LOAD(acc);
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_deep_example(cz_t *cz)
+{
+    cz_func_begin(cz);
+        ref_t a = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        // Deep enough to run out of registers in the jit.
+        CZ_LOAD(a); CZ_LOAD(a); CZ_LOAD(a); CZ_LOAD(a); CZ_LOAD(a);
+        CZ_LOAD(a); CZ_LOAD(a); CZ_LOAD(a); CZ_LOAD_IMM(1);
+        CZ_ADD(); CZ_ADD(); CZ_ADD(); CZ_ADD();
+        CZ_SUB(); CZ_ADD(); CZ_ADD(); CZ_ADD();
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_add3_example(cz_t *cz, func_ref_t add_func)
+{
+    cz_func_begin(cz);
+        ref_t a = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+        ref_t b = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+        ref_t c = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        CZ_LOAD(c); CZ_LOAD(a); CZ_LOAD(b); CZ_CALL(add_func);
+        CZ_CALL(add_func);
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_sum_example(cz_t *cz)
+{
+    func_ref_t self = cz_func_begin(cz);
+        ref_t n = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        {
+            scope_ref_t _scope = cz_scope_begin(cz);
+            frame_ref_t __is_zero = cz_scope_frame(cz);
+        /**/
+            CZ_LOAD(n); CZ_JMP(Ze, __is_zero);
+                CZ_LOAD(n); CZ_LOAD(n); CZ_LOAD_IMM(1); CZ_SUB(); CZ_CALL(self);
+                CZ_ADD();
+                CZ_JMP_END(Uc, _scope);
+            CZ_LINK(__is_zero);
+                CZ_LOAD_IMM(0);
+            CZ_END();
+        }
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_sum_acc_example(cz_t *cz)
+{
+    func_ref_t self = cz_func_begin(cz);
+        ref_t n   = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+        ref_t acc = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        {
+            scope_ref_t _scope = cz_scope_begin(cz);
+            frame_ref_t __is_zero = cz_scope_frame(cz);
+        /**/
+            CZ_LOAD(n); CZ_JMP(Ze, __is_zero);
+                CZ_LOAD(n); CZ_LOAD_IMM(1); CZ_SUB();
+                CZ_LOAD(acc); CZ_LOAD(n); CZ_ADD();
+                CZ_CALL(self);
+                CZ_JMP_END(Uc, _scope);
+            CZ_LINK(__is_zero);
+                CZ_LOAD(acc);
+            CZ_END();
+        }
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_twice_example(cz_t *cz, func_ref_t func)
+{
+    cz_func_begin(cz);
+        ref_t a = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        CZ_LOAD(a); CZ_CALL(func);
+        CZ_LOAD(a); CZ_LOAD_IMM(1); CZ_ADD(); CZ_CALL(func);
+        CZ_ADD();
+    return cz_func_end(cz);
+}
+
+// Adds `i` for the first `half` iterations and subtracts 1 after.
+func_ref_t
+f_phase_example(cz_t *cz)
+{
+    cz_func_begin(cz);
+        ref_t n    = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+        ref_t half = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        ref_t acc = cz_func_var(cz, CZ_BASIC_TYPE(Int));
+        ref_t i   = cz_func_var(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        CZ_LOAD_IMM(0); CZ_STORE(acc);
+        CZ_LOAD_IMM(0); CZ_STORE(i);
+        {
+            scope_ref_t _loop = cz_scope_begin(cz);
+            frame_ref_t __top = cz_scope_frame(cz);
+        /**/
+            CZ_LINK(__top);
+                CZ_LOAD(i); CZ_LOAD(n); CZ_JMP_END(Ge, _loop);
+                {
+                    scope_ref_t _if = cz_scope_begin(cz);
+                    frame_ref_t __late = cz_scope_frame(cz);
+                /**/
+                    CZ_LOAD(i); CZ_LOAD(half); CZ_JMP(Ge, __late);
+                        CZ_LOAD(acc); CZ_LOAD(i); CZ_ADD(); CZ_STORE(acc);
+                        CZ_JMP_END(Uc, _if);
+                    CZ_LINK(__late);
+                        CZ_LOAD(acc); CZ_LOAD_IMM(1); CZ_SUB(); CZ_STORE(acc);
+                    CZ_END();
+                }
+                CZ_LOAD(i); CZ_LOAD_IMM(1); CZ_ADD(); CZ_STORE(i);
+                CZ_JMP(Uc, __top);
+            CZ_END();
+        }
+        CZ_LOAD(acc);
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_nested_example(cz_t *cz)
+{
+    cz_func_begin(cz);
+        ref_t n = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        ref_t acc = cz_func_var(cz, CZ_BASIC_TYPE(Int));
+        ref_t i   = cz_func_var(cz, CZ_BASIC_TYPE(Int));
+        ref_t j   = cz_func_var(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        CZ_LOAD_IMM(0); CZ_STORE(acc);
+        CZ_LOAD_IMM(0); CZ_STORE(i);
+        {
+            scope_ref_t _outer = cz_scope_begin(cz);
+            frame_ref_t __outer_top = cz_scope_frame(cz);
+        /**/
+            CZ_LINK(__outer_top);
+                CZ_LOAD(i); CZ_LOAD(n); CZ_JMP_END(Ge, _outer);
+                CZ_LOAD_IMM(0); CZ_STORE(j);
+                {
+                    scope_ref_t _inner = cz_scope_begin(cz);
+                    frame_ref_t __inner_top = cz_scope_frame(cz);
+                /**/
+                    CZ_LINK(__inner_top);
+                        CZ_LOAD(j); CZ_LOAD(n); CZ_JMP_END(Ge, _inner);
+                        CZ_LOAD(acc); CZ_LOAD(j); CZ_ADD(); CZ_STORE(acc);
+                        CZ_LOAD(j); CZ_LOAD_IMM(1); CZ_ADD(); CZ_STORE(j);
+                        CZ_JMP(Uc, __inner_top);
+                    CZ_END();
+                }
+                CZ_LOAD(i); CZ_LOAD_IMM(1); CZ_ADD(); CZ_STORE(i);
+                CZ_JMP(Uc, __outer_top);
+            CZ_END();
+        }
+        CZ_LOAD(acc);
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_swap_example(cz_t *cz)
+{
+    cz_func_begin(cz);
+        ref_t a = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+        ref_t b = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        CZ_LOAD(b); CZ_LOAD(a);
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_swap_sub_example(cz_t *cz, func_ref_t swap_func)
+{
+    cz_func_begin(cz);
+        ref_t a = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+        ref_t b = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        CZ_LOAD(a); CZ_LOAD(b); CZ_CALL(swap_func); CZ_SUB();
+        CZ_LOAD(a);
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_keep_sum_example(cz_t *cz)
+{
+    cz_func_begin(cz);
+        ref_t a = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+        ref_t b = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        CZ_LOAD(a); CZ_LOAD(a); CZ_LOAD(b); CZ_ADD();
+    return cz_func_end(cz);
+}
+
+func_ref_t
+f_shuffle_example(cz_t *cz)
+{
+    cz_func_begin(cz);
+        ref_t a = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+        ref_t b = cz_func_in(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+        cz_func_out(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        ref_t t = cz_func_var(cz, CZ_BASIC_TYPE(Int));
+    /**/
+        CZ_LOAD(a); CZ_LOAD(b); CZ_ADD(); CZ_STORE(t);
+        CZ_LOAD(b); CZ_LOAD(t); CZ_LOAD(a); CZ_LOAD(t); CZ_SUB();
+    return cz_func_end(cz);
+}
+
 #define ANSI_RED     "\x1b[31m"
 #define ANSI_GREEN   "\x1b[32m"
 #define ANSI_RESET   "\x1b[0m"
@@ -52,26 +338,1038 @@ f_jmp_example(cz_t *cz)
         } \
     } while (0)
 
+static u32 last_step_count;
+static u32 last_max_memory;
+
+// Files the tests write, out of the tree. Each is removed again once checked.
+static char test_dir[] = "/tmp/metacz_tests_XXXXXX";
+
+static const char *
+test_path(char *buffer, u32 size, const char *name)
+{
+    snprintf(buffer, size, "%s/%s", test_dir, name);
+    return buffer;
+}
+
+static i32
+run_int_2(vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset, i32 a, i32 b, b32 step)
+{
+    vm_clear(thread);
+    VM_PUSH(thread, i32, &a);
+    VM_PUSH(thread, i32, &b);
+
+    if (step) {
+        vm_init(program, thread, code_offset);
+        last_max_memory = thread->memory.count;
+        for (last_step_count = 0; vm_is_running(program, thread); ++last_step_count) {
+            vm_step(program, thread, cz);
+            if (last_max_memory < thread->memory.count)
+                last_max_memory = thread->memory.count;
+        }
+    }
+    else {
+        vm_execute(program, thread, cz, code_offset);
+    }
+
+    return *VM_GET(thread, i32);
+}
+
+static i32
+run_int_1(vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset, i32 a, b32 step)
+{
+    vm_clear(thread);
+    VM_PUSH(thread, i32, &a);
+
+    if (step) {
+        vm_init(program, thread, code_offset);
+        last_max_memory = thread->memory.count;
+        for (last_step_count = 0; vm_is_running(program, thread); ++last_step_count) {
+            vm_step(program, thread, cz);
+            if (last_max_memory < thread->memory.count)
+                last_max_memory = thread->memory.count;
+        }
+    }
+    else {
+        vm_execute(program, thread, cz, code_offset);
+    }
+
+    return *VM_GET(thread, i32);
+}
+
+static i32
+run_profiled_int_1(vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 code_offset, i32 a, vm_profile_t *profile)
+{
+    vm_clear(thread);
+    VM_PUSH(thread, i32, &a);
+
+    vm_execute_profiled(program, thread, cz, code_offset, profile);
+
+    return *VM_GET(thread, i32);
+}
+
+// Jumps that went somewhere else than the next instruction.
+static u64
+profile_jumps(vm_profile_t *profile, vm_program_t *program)
+{
+    u64 jumps = 0;
+
+    for (u32 ip = 0; ip < profile->counts.count; ++ip) {
+        jumps += profile->taken.data[ip];
+
+        // Counts are only ever set at instruction starts.
+        if (profile->counts.data[ip] != 0 && program->code.data[ip] == vm_inst_JmpUc) {
+            jumps += profile->counts.data[ip];
+        }
+    }
+
+    return jumps;
+}
+
+static i32
+run_jit_int_2(vm_thread_t *thread, jit_func_t *func, i32 a, i32 b)
+{
+    vm_clear(thread);
+    VM_PUSH(thread, i32, &a);
+    VM_PUSH(thread, i32, &b);
+
+    jit_execute(func, thread);
+
+    return *VM_GET(thread, i32);
+}
+
+static i32
+run_jit_int_1(vm_thread_t *thread, jit_func_t *func, i32 a)
+{
+    vm_clear(thread);
+    VM_PUSH(thread, i32, &a);
+
+    jit_execute(func, thread);
+
+    return *VM_GET(thread, i32);
+}
+
 i32
 main(void)
 {
     cz_t cz = {0};
 
+    TEST(mkdtemp(test_dir) != NULL);
+
     func_ref_t add_func = f_add_example(&cz);
     func_ref_t jmp_func = f_jmp_example(&cz);
 
-    vm_t vm = {0};
+    vm_program_t program = {0};
+    vm_thread_t  thread  = {0};
     vm_compiler_t compiler = {0};
 
-    u32 add_code_offset = vm_compile(&vm, &compiler, &cz, add_func);
+    u32 add_code_offset = vm_compile(&program, &compiler, &cz, add_func);
 
-    vm_clear(&vm);
-    VM_PUSH(&vm, i32, &(i32) { 5 });
-    VM_PUSH(&vm, i32, &(i32) { 3 });
-    vm_execute(&vm, &cz, add_code_offset);
-    int res = *VM_GET(&vm, i32);
+    vm_clear(&thread);
+    VM_PUSH(&thread, i32, &(i32) { 5 });
+    VM_PUSH(&thread, i32, &(i32) { 3 });
+    vm_execute(&program, &thread, &cz, add_code_offset);
+    int res = *VM_GET(&thread, i32);
     TEST(res == 8);
 
+    func_ref_t sub_func  = f_sub_example(&cz);
+    func_ref_t loop_func = f_loop_example(&cz);
+
+    u32 jmp_code_offset  = vm_compile(&program, &compiler, &cz, jmp_func);
+    u32 sub_code_offset  = vm_compile(&program, &compiler, &cz, sub_func);
+    u32 loop_code_offset = vm_compile(&program, &compiler, &cz, loop_func);
+
+    TEST(run_int_2(&program, &thread, &cz, sub_code_offset, 5, 3, false) == 2);
+    TEST(run_int_2(&program, &thread, &cz, sub_code_offset, 5, 3, true)  == 2);
+
+    TEST(run_int_1(&program, &thread, &cz, jmp_code_offset, 3, false) == 0);
+    TEST(run_int_1(&program, &thread, &cz, jmp_code_offset, 8, false) == 1);
+    TEST(run_int_1(&program, &thread, &cz, jmp_code_offset, 3, true)  == 0);
+
+    TEST(run_int_1(&program, &thread, &cz, loop_code_offset, 10, false) == 45);
+    TEST(run_int_1(&program, &thread, &cz, loop_code_offset, 10, true)  == 45);
+    TEST(run_int_1(&program, &thread, &cz, loop_code_offset, 0,  false) == 0);
+
+    {
+        // Two threads stepping through the same program don't see each other.
+        vm_thread_t other = {0};
+
+        vm_clear(&thread);
+        VM_PUSH(&thread, i32, &(i32) { 10 });
+        vm_init(&program, &thread, loop_code_offset);
+
+        vm_clear(&other);
+        VM_PUSH(&other, i32, &(i32) { 5 });
+        vm_init(&program, &other, loop_code_offset);
+        // The whole frame is there from the start, stepping never grows it.
+        u32 other_capacity = other.memory.capacity;
+
+        while (vm_is_running(&program, &thread) || vm_is_running(&program, &other)) {
+            if (vm_is_running(&program, &thread)) vm_step(&program, &thread, &cz);
+            if (vm_is_running(&program, &other))  vm_step(&program, &other,  &cz);
+        }
+
+        TEST(*VM_GET(&thread, i32) == 45);
+        TEST(*VM_GET(&other,  i32) == 10);
+        TEST(other.memory.capacity == other_capacity);
+
+        vm_thread_free(&other);
+    }
+
+    vm_compiler_t reg_compiler = { .mode = vm_compile_mode_Register };
+
+    u32 reg_add_code_offset  = vm_compile(&program, &reg_compiler, &cz, add_func);
+    u32 reg_sub_code_offset  = vm_compile(&program, &reg_compiler, &cz, sub_func);
+    u32 reg_jmp_code_offset  = vm_compile(&program, &reg_compiler, &cz, jmp_func);
+    u32 reg_loop_code_offset = vm_compile(&program, &reg_compiler, &cz, loop_func);
+
+    TEST(run_int_2(&program, &thread, &cz, reg_add_code_offset, 5, 3, false) == 8);
+    TEST(run_int_2(&program, &thread, &cz, reg_sub_code_offset, 5, 3, false) == 2);
+    TEST(run_int_2(&program, &thread, &cz, reg_sub_code_offset, 5, 3, true)  == 2);
+
+    TEST(run_int_1(&program, &thread, &cz, reg_jmp_code_offset, 3, false) == 0);
+    TEST(run_int_1(&program, &thread, &cz, reg_jmp_code_offset, 8, false) == 1);
+    TEST(run_int_1(&program, &thread, &cz, reg_jmp_code_offset, 8, true)  == 1);
+
+    TEST(run_int_1(&program, &thread, &cz, reg_loop_code_offset, 10, false) == 45);
+    TEST(run_int_1(&program, &thread, &cz, reg_loop_code_offset, 10, true)  == 45);
+
+    vm_compiler_t plain_compiler = { .disable_fusion = true };
+
+    u32 plain_jmp_code_offset  = vm_compile(&program, &plain_compiler, &cz, jmp_func);
+    u32 plain_loop_code_offset = vm_compile(&program, &plain_compiler, &cz, loop_func);
+
+    TEST(run_int_1(&program, &thread, &cz, plain_jmp_code_offset, 3, false) == 0);
+    TEST(run_int_1(&program, &thread, &cz, plain_loop_code_offset, 10, false) == 45);
+
+    run_int_1(&program, &thread, &cz, plain_loop_code_offset, 100, true);
+    u32 plain_step_count = last_step_count;
+
+    // Register code runs the loop in at most half the instructions.
+    run_int_1(&program, &thread, &cz, reg_loop_code_offset, 100, true);
+    TEST(last_step_count * 2 <= plain_step_count);
+
+    // Superinstructions cut at least a third of the dispatches.
+    run_int_1(&program, &thread, &cz, loop_code_offset, 100, true);
+    TEST(last_step_count * 3 <= plain_step_count * 2);
+
+    vm_compiler_t cached_compiler = { .mode = vm_compile_mode_Cached };
+
+    u32 cached_add_code_offset  = vm_compile(&program, &cached_compiler, &cz, add_func);
+    u32 cached_sub_code_offset  = vm_compile(&program, &cached_compiler, &cz, sub_func);
+    u32 cached_jmp_code_offset  = vm_compile(&program, &cached_compiler, &cz, jmp_func);
+    u32 cached_loop_code_offset = vm_compile(&program, &cached_compiler, &cz, loop_func);
+
+    TEST(run_int_2(&program, &thread, &cz, cached_add_code_offset, 5, 3, false) == 8);
+    TEST(run_int_2(&program, &thread, &cz, cached_sub_code_offset, 5, 3, false) == 2);
+    TEST(run_int_2(&program, &thread, &cz, cached_sub_code_offset, 5, 3, true)  == 2);
+
+    TEST(run_int_1(&program, &thread, &cz, cached_jmp_code_offset, 3, false) == 0);
+    TEST(run_int_1(&program, &thread, &cz, cached_jmp_code_offset, 8, false) == 1);
+    TEST(run_int_1(&program, &thread, &cz, cached_jmp_code_offset, 8, true)  == 1);
+
+    TEST(run_int_1(&program, &thread, &cz, cached_loop_code_offset, 10, false) == 45);
+    TEST(run_int_1(&program, &thread, &cz, cached_loop_code_offset, 10, true)  == 45);
+
+    // Cached code keeps the loop temporaries out of the memory stack.
+    run_int_1(&program, &thread, &cz, plain_loop_code_offset, 100, true);
+    u32 plain_max_memory = last_max_memory;
+
+    run_int_1(&program, &thread, &cz, cached_loop_code_offset, 100, true);
+    TEST(last_max_memory < plain_max_memory);
+
+    // The decoded stream stops on the same return as the raw one.
+    TEST(program.code.data[thread.ip] == vm_inst_Ret);
+    TEST(program.ops.data[program.code_ops.data[thread.ip]].inst == vm_inst_Ret);
+
+    {
+        // Everything compiled so far verifies, broken jumps don't.
+        b32 is_verified = true;
+        for (u32 i = 0; i < program.functions.count; ++i) {
+            is_verified &= vm_verify(&program, program.functions.data[i].code_offset, NULL);
+        }
+        TEST(is_verified);
+
+        u32 jump = plain_loop_code_offset;
+        while (program.code.data[jump] < vm_inst_JmpIntEq || program.code.data[jump] > vm_inst_JmpIntGe
+            || program.code_ops.data[jump] == CZ_NO_ID) {
+            jump++;
+        }
+
+        vm_verify_error_t error = {0};
+        vm_inst_t inst  = program.code.data[jump];
+        u32 offset      = program.code.data[jump + 1];
+
+        // Onto its own offset.
+        program.code.data[jump + 1] = (u32)-1;
+        TEST(!vm_verify(&program, plain_loop_code_offset, &error) && error.code_offset == jump);
+        program.code.data[jump + 1] = offset;
+
+        // Popping one operand instead of two leaves the stack deeper around the loop.
+        program.code.data[jump] = vm_inst_JmpIntNz;
+        TEST(!vm_verify(&program, plain_loop_code_offset, &error));
+        program.code.data[jump] = inst;
+
+        TEST(vm_verify(&program, plain_loop_code_offset, &error));
+
+        // Every push has to fit in the frame reserved on entry.
+        vm_function_t *function = (vm_function_t *)vm_find_function(&program, plain_loop_code_offset);
+        TEST(function->frame_size >= function->in_size + 2 * sizeof(i32));
+
+        function->frame_size -= sizeof(i32);
+        TEST(!vm_verify(&program, plain_loop_code_offset, &error));
+        function->frame_size += sizeof(i32);
+    }
+
+    {
+        // Runs the same on a mapped stack, which stays put and ends the process once it overflows.
+        vm_thread_t mapped = {0};
+        TEST(stack_map(&mapped, 1 << 16, true));
+
+        u8 *data = mapped.memory.data;
+        TEST(run_int_1(&program, &mapped, &cz, loop_code_offset, 10, false) == 45);
+        TEST(run_int_1(&program, &mapped, &cz, plain_loop_code_offset, 10, true) == 45);
+        TEST(run_int_2(&program, &mapped, &cz, cached_sub_code_offset, 5, 3, false) == 2);
+        TEST(mapped.memory.data == data);
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            for (;;) {
+                VM_PUSH(&mapped, i32, &(i32) { 0 });
+            }
+        }
+
+        int status = 0;
+        TEST(pid > 0 && waitpid(pid, &status, 0) == pid);
+        TEST(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+
+        // Freeing the thread leaves the region to `stack_unmap`.
+        vm_thread_free(&mapped);
+        TEST(mapped.memory.data == data);
+
+        stack_unmap(&mapped);
+        TEST(mapped.memory.data == NULL);
+    }
+
+    {
+        // Same results as one call at a time, from a single layout of the inputs.
+        enum { batch_count = 16 };
+
+        struct { i32 a, b; } sub_inputs[batch_count];
+        i32 loop_inputs[batch_count];
+        i32 sub_outputs[batch_count];
+        i32 loop_outputs[batch_count];
+
+        for (i32 i = 0; i < batch_count; ++i) {
+            sub_inputs[i].a = i * 7;
+            sub_inputs[i].b = 50 - i;
+            loop_inputs[i]  = i;
+        }
+
+        vm_execute_batch(&program, &thread, &cz, sub_code_offset, sub_inputs, sizeof(*sub_inputs), batch_count, sub_outputs);
+        vm_execute_batch(&program, &thread, &cz, reg_loop_code_offset, loop_inputs, sizeof(*loop_inputs), batch_count, loop_outputs);
+
+        b32 is_same = true;
+        for (i32 i = 0; i < batch_count; ++i) {
+            is_same &= sub_outputs[i]  == run_int_2(&program, &thread, &cz, sub_code_offset, i * 7, 50 - i, false);
+            is_same &= loop_outputs[i] == run_int_1(&program, &thread, &cz, loop_code_offset, i, false);
+        }
+        TEST(is_same);
+        TEST(vm_find_function(&program, sub_code_offset)->out_size == sizeof(i32));
+
+        // Lanes diverge on the loop count and the jump, every compile mode has to agree.
+        u32 lane_code_offsets[] = {
+            loop_code_offset, reg_loop_code_offset, plain_loop_code_offset, cached_loop_code_offset,
+        };
+
+        is_same = true;
+        for (u32 i = 0; i < LENGTH_OF(lane_code_offsets); ++i) {
+            i32 lane_outputs[batch_count] = {0};
+            vm_execute_lanes(&program, &thread, &cz, lane_code_offsets[i], loop_inputs, sizeof(*loop_inputs), batch_count - 3, lane_outputs);
+
+            for (i32 j = 0; j < batch_count - 3; ++j) {
+                is_same &= lane_outputs[j] == loop_outputs[j];
+            }
+            is_same &= lane_outputs[batch_count - 3] == 0;
+        }
+        TEST(is_same);
+
+        i32 jmp_outputs[batch_count];
+        vm_execute_lanes(&program, &thread, &cz, cached_jmp_code_offset, loop_inputs, sizeof(*loop_inputs), batch_count, jmp_outputs);
+
+        is_same = true;
+        for (i32 i = 0; i < batch_count; ++i) {
+            is_same &= jmp_outputs[i] == (i < 5 ? 0 : 1);
+        }
+        TEST(is_same);
+
+        vm_execute_lanes(&program, &thread, &cz, reg_sub_code_offset, sub_inputs, sizeof(*sub_inputs), batch_count, sub_outputs);
+
+        is_same = true;
+        for (i32 i = 0; i < batch_count; ++i) {
+            is_same &= sub_outputs[i] == i * 7 - (50 - i);
+        }
+        TEST(is_same);
+    }
+
+    {
+        // More tuples than one chunk per thread, and a partial chunk at the end.
+        enum { pool_count = POOL_CHUNK_SIZE * 9 + 17 };
+
+        i32 *pool_inputs   = malloc(pool_count * sizeof(i32));
+        i32 *pool_outputs  = malloc(pool_count * sizeof(i32));
+        i32 *batch_outputs = malloc(pool_count * sizeof(i32));
+
+        for (i32 i = 0; i < pool_count; ++i) {
+            pool_inputs[i] = i % 100;
+        }
+
+        pool_t pool;
+        pool_init(&pool, 4);
+
+        vm_execute_batch(&program, &thread, &cz, loop_code_offset, pool_inputs, sizeof(i32), pool_count, batch_outputs);
+        pool_execute_batch(&pool, &program, &cz, loop_code_offset, pool_inputs, sizeof(i32), pool_count, pool_outputs);
+        TEST(memcmp(pool_outputs, batch_outputs, pool_count * sizeof(i32)) == 0);
+
+        // Workers go back to sleep and pick up the next batch.
+        pool_execute_batch(&pool, &program, &cz, reg_loop_code_offset, pool_inputs, sizeof(i32), pool_count, pool_outputs);
+        TEST(memcmp(pool_outputs, batch_outputs, pool_count * sizeof(i32)) == 0);
+
+        pool_free(&pool);
+
+        free(pool_inputs);
+        free(pool_outputs);
+        free(batch_outputs);
+    }
+
+    func_ref_t add3_func = f_add3_example(&cz, add_func);
+    func_ref_t sum_func  = f_sum_example(&cz);
+
+    {
+        vm_compiler_t call_compilers[] = {
+            { .mode = vm_compile_mode_Stack },
+            { .mode = vm_compile_mode_Register },
+            { .mode = vm_compile_mode_Cached },
+            { .disable_fusion = true },
+        };
+
+        b32 is_same = true;
+
+        for (u32 i = 0; i < LENGTH_OF(call_compilers); ++i) {
+            // Callers first, the calls get patched once `add` is compiled.
+            vm_program_t call_program = {0};
+
+            u32 add3_code_offset = vm_compile(&call_program, call_compilers + i, &cz, add3_func);
+            u32 sum_code_offset  = vm_compile(&call_program, call_compilers + i, &cz, sum_func);
+            vm_compile(&call_program, call_compilers + i, &cz, add_func);
+
+            for (u32 step = 0; step < 2; ++step) {
+                vm_clear(&thread);
+                VM_PUSH(&thread, i32, &(i32) { 100 });
+                VM_PUSH(&thread, i32, &(i32) { 20 });
+                VM_PUSH(&thread, i32, &(i32) { 3 });
+
+                if (step) {
+                    vm_init(&call_program, &thread, add3_code_offset);
+                    while (vm_is_running(&call_program, &thread)) {
+                        vm_step(&call_program, &thread, &cz);
+                    }
+                }
+                else {
+                    vm_execute(&call_program, &thread, &cz, add3_code_offset);
+                }
+
+                is_same &= *VM_GET(&thread, i32) == 123;
+                is_same &= thread.frames.count == 0;
+
+                is_same &= run_int_1(&call_program, &thread, &cz, sum_code_offset, 100, step) == 5050;
+                is_same &= run_int_1(&call_program, &thread, &cz, sum_code_offset, 0,   step) == 0;
+            }
+
+            // Stack or register code calling code compiled in the other mode.
+            u32 mixed_code_offset = vm_compile(&call_program, &reg_compiler, &cz, add3_func);
+            vm_clear(&thread);
+            VM_PUSH(&thread, i32, &(i32) { 1 });
+            VM_PUSH(&thread, i32, &(i32) { 2 });
+            VM_PUSH(&thread, i32, &(i32) { 3 });
+            vm_execute(&call_program, &thread, &cz, mixed_code_offset);
+            is_same &= *VM_GET(&thread, i32) == 6;
+
+            i32 sum_inputs[9]  = { 0, 1, 2, 3, 4, 5, 6, 7, 50 };
+            i32 sum_outputs[9] = {0};
+            vm_execute_lanes(&call_program, &thread, &cz, sum_code_offset, sum_inputs, sizeof(i32), 9, sum_outputs);
+            for (u32 j = 0; j < 9; ++j) {
+                is_same &= sum_outputs[j] == sum_inputs[j] * (sum_inputs[j] + 1) / 2;
+            }
+        }
+        TEST(is_same);
+    }
+
+    {
+        // Own context, the call in `swap_sub` would count with the inlined sites below.
+        cz_t result_cz = {0};
+
+        func_ref_t swap_func     = f_swap_example(&result_cz);
+        func_ref_t swap_sub_func = f_swap_sub_example(&result_cz, swap_func);
+        func_ref_t keep_sum_func = f_keep_sum_example(&result_cz);
+        func_ref_t shuffle_func  = f_shuffle_example(&result_cz);
+
+        vm_compiler_t result_compilers[] = {
+            { .mode = vm_compile_mode_Stack },
+            { .mode = vm_compile_mode_Register },
+            { .mode = vm_compile_mode_Cached },
+            { .disable_fusion = true },
+        };
+
+        b32 is_same = true;
+
+        for (u32 i = 0; i < LENGTH_OF(result_compilers); ++i) {
+            vm_program_t result_program = {0};
+
+            u32 swap_code_offset     = vm_compile(&result_program, result_compilers + i, &result_cz, swap_func);
+            u32 swap_sub_code_offset = vm_compile(&result_program, result_compilers + i, &result_cz, swap_sub_func);
+            u32 keep_sum_code_offset = vm_compile(&result_program, result_compilers + i, &result_cz, keep_sum_func);
+            u32 shuffle_code_offset  = vm_compile(&result_program, result_compilers + i, &result_cz, shuffle_func);
+
+            u32 code_offsets[]  = { swap_code_offset, keep_sum_code_offset, shuffle_code_offset };
+            u32 result_counts[] = { 2, 2, 3 };
+            i32 results[][3]    = { { 3, 5 }, { 5, 8 }, { 3, 8, -3 } };
+
+            for (u32 j = 0; j < LENGTH_OF(code_offsets); ++j) {
+                for (u32 step = 0; step < 2; ++step) {
+                    // Results packed from the start of the frame, over the inputs.
+                    vm_clear(&thread);
+                    VM_PUSH(&thread, i32, &(i32) { 5 });
+                    VM_PUSH(&thread, i32, &(i32) { 3 });
+
+                    if (step) {
+                        vm_init(&result_program, &thread, code_offsets[j]);
+                        while (vm_is_running(&result_program, &thread)) {
+                            vm_step(&result_program, &thread, &result_cz);
+                        }
+                    }
+                    else {
+                        vm_execute(&result_program, &thread, &result_cz, code_offsets[j]);
+                    }
+
+                    for (u32 k = 0; k < result_counts[j]; ++k) {
+                        is_same &= *VM_GET(&thread, i32) == results[j][k];
+                    }
+                }
+            }
+
+            vm_clear(&thread);
+            VM_PUSH(&thread, i32, &(i32) { 5 });
+            VM_PUSH(&thread, i32, &(i32) { 3 });
+            vm_execute(&result_program, &thread, &result_cz, swap_sub_code_offset);
+
+            is_same &= *VM_GET(&thread, i32) == -2;
+            is_same &= *VM_GET(&thread, i32) == 5;
+        }
+        TEST(is_same);
+
+        // Computed straight into their output slots, also on both sides of a branch, nothing is left to move.
+        b32 is_direct = true;
+        vm_compiler_t direct_compilers[] = {
+            { .mode = vm_compile_mode_Stack },
+            { .mode = vm_compile_mode_Register },
+            { .mode = vm_compile_mode_Cached },
+        };
+
+        for (u32 i = 0; i < LENGTH_OF(direct_compilers); ++i) {
+            vm_program_t direct_program = {0};
+            vm_compile(&direct_program, direct_compilers + i, &cz, add_func);
+            vm_compile(&direct_program, direct_compilers + i, &cz, jmp_func);
+            vm_compile(&direct_program, direct_compilers + i, &result_cz, keep_sum_func);
+
+            for (u32 j = 0; j < direct_program.ops.count; ++j) {
+                is_direct &= direct_program.ops.data[j].inst != vm_inst_MemMove;
+            }
+        }
+        TEST(is_direct);
+    }
+
+    {
+        func_ref_t sum_acc_func = f_sum_acc_example(&cz);
+
+        vm_compiler_t tail_compilers[] = {
+            { .mode = vm_compile_mode_Stack },
+            { .mode = vm_compile_mode_Register },
+            { .mode = vm_compile_mode_Cached },
+        };
+
+        b32 is_same = true;
+
+        for (u32 i = 0; i < LENGTH_OF(tail_compilers); ++i) {
+            u32 sum_acc_code_offset = vm_compile(&program, tail_compilers + i, &cz, sum_acc_func);
+
+            // Deep enough that a frame per call would show, runs without pushing any.
+            vm_thread_t tail_thread = {0};
+            is_same &= run_int_2(&program, &tail_thread, &cz, sum_acc_code_offset, 100000, 0, false) == 705082704;
+            is_same &= tail_thread.frames.capacity == 0;
+            is_same &= tail_thread.memory.capacity <= 4096;
+
+            is_same &= run_int_2(&program, &tail_thread, &cz, sum_acc_code_offset, 10, 5, true) == 60;
+            is_same &= tail_thread.frames.capacity == 0;
+
+            vm_thread_free(&tail_thread);
+        }
+        TEST(is_same);
+
+        vm_compiler_t no_tail_compiler = { .disable_tail_calls = true };
+        u32 no_tail_code_offset = vm_compile(&program, &no_tail_compiler, &cz, sum_acc_func);
+
+        TEST(run_int_2(&program, &thread, &cz, no_tail_code_offset, 1000, 0, false) == 500500);
+        TEST(thread.frames.capacity >= 1000);
+    }
+
+    func_ref_t twice_func = f_twice_example(&cz, loop_func);
+
+    {
+        vm_compiler_t lazy_compilers[] = {
+            { .mode = vm_compile_mode_Stack,    .lazy_calls = true },
+            { .mode = vm_compile_mode_Register, .lazy_calls = true },
+            { .mode = vm_compile_mode_Cached,   .lazy_calls = true },
+        };
+
+        b32 is_same = true;
+
+        for (u32 i = 0; i < LENGTH_OF(lazy_compilers); ++i) {
+            // Stepping and executing both run into the stubs first.
+            for (u32 first_step = 0; first_step < 2; ++first_step) {
+                vm_program_t lazy_program = {0};
+
+                u32 add3_code_offset  = vm_compile(&lazy_program, lazy_compilers + i, &cz, add3_func);
+                u32 twice_code_offset = vm_compile(&lazy_program, lazy_compilers + i, &cz, twice_func);
+                is_same &= lazy_program.functions.count == 2;
+
+                thread.lazy_program  = &lazy_program;
+                thread.lazy_compiler = lazy_compilers + i;
+
+                for (u32 run = 0; run < 2; ++run) {
+                    b32 step = first_step ^ run;
+
+                    vm_clear(&thread);
+                    VM_PUSH(&thread, i32, &(i32) { 100 });
+                    VM_PUSH(&thread, i32, &(i32) { 20 });
+                    VM_PUSH(&thread, i32, &(i32) { 3 });
+
+                    if (step) {
+                        vm_init(&lazy_program, &thread, add3_code_offset);
+                        while (vm_is_running(&lazy_program, &thread)) {
+                            vm_step(&lazy_program, &thread, &cz);
+                        }
+                    }
+                    else {
+                        vm_execute(&lazy_program, &thread, &cz, add3_code_offset);
+                    }
+                    is_same &= *VM_GET(&thread, i32) == 123;
+
+                    is_same &= run_int_1(&lazy_program, &thread, &cz, twice_code_offset, 10, step) == 100;
+                }
+
+                // `add` and `loop` once each, however many sites call them.
+                is_same &= lazy_program.functions.count == 4;
+                is_same &= lazy_program.call_patches.count == 0;
+
+                thread.lazy_program  = NULL;
+                thread.lazy_compiler = NULL;
+            }
+        }
+        TEST(is_same);
+    }
+
+    {
+        // Both `add` sites in add3 and both `loop` sites in twice, the recursive ones stay calls.
+        TEST(cz_inline(&cz, (cz_inline_options_t) { .max_size = 64 }) == 4);
+
+        vm_compiler_t inline_compilers[] = {
+            { .mode = vm_compile_mode_Stack },
+            { .mode = vm_compile_mode_Register },
+            { .mode = vm_compile_mode_Cached },
+        };
+
+        b32 is_same = true;
+
+        for (u32 i = 0; i < LENGTH_OF(inline_compilers); ++i) {
+            vm_program_t inline_program = {0};
+
+            u32 add3_code_offset  = vm_compile(&inline_program, inline_compilers + i, &cz, add3_func);
+            u32 twice_code_offset = vm_compile(&inline_program, inline_compilers + i, &cz, twice_func);
+            u32 sum_code_offset   = vm_compile(&inline_program, inline_compilers + i, &cz, sum_func);
+
+            is_same &= !vm_find_function(&inline_program, add3_code_offset)->has_calls;
+            is_same &= !vm_find_function(&inline_program, twice_code_offset)->has_calls;
+
+            vm_clear(&thread);
+            VM_PUSH(&thread, i32, &(i32) { 100 });
+            VM_PUSH(&thread, i32, &(i32) { 20 });
+            VM_PUSH(&thread, i32, &(i32) { 3 });
+            vm_execute(&inline_program, &thread, &cz, add3_code_offset);
+            is_same &= *VM_GET(&thread, i32) == 123;
+
+            for (u32 step = 0; step < 2; ++step) {
+                // 0 + .. + 9 plus 0 + .. + 10
+                is_same &= run_int_1(&inline_program, &thread, &cz, twice_code_offset, 10, step) == 100;
+                is_same &= run_int_1(&inline_program, &thread, &cz, sum_code_offset, 100, step) == 5050;
+            }
+        }
+        TEST(is_same);
+    }
+
+    {
+        vm_compiler_t profile_compilers[] = {
+            { .mode = vm_compile_mode_Stack, .disable_fusion = true },
+            { .mode = vm_compile_mode_Register },
+        };
+
+        abs_func_t *loop_abs = cz.abs_funcs.data + loop_func.func_index;
+
+        b32 is_same = true;
+
+        for (u32 i = 0; i < LENGTH_OF(profile_compilers); ++i) {
+            vm_program_t profile_program = {0};
+            vm_profile_t profile = {0};
+
+            u32 profile_code_offset = vm_compile(&profile_program, profile_compilers + i, &cz, loop_func);
+
+            vm_clear(&thread);
+            VM_PUSH(&thread, i32, &(i32) { 10 });
+            vm_execute_profiled(&profile_program, &thread, &cz, profile_code_offset, &profile);
+            is_same &= *VM_GET(&thread, i32) == 45;
+
+            is_same &= profile.counts.data[profile_code_offset] == 1;
+
+            // The loop exit, checked 11 times and taken once.
+            u32 exit_count = 0;
+            for (u32 ip = 0; ip < profile.taken.count; ++ip) {
+                if (profile.taken.data[ip] == 0)
+                    continue;
+
+                vm_abs_loc_t loc = vm_find_abs_loc(&profile_program, ip);
+
+                exit_count += 1;
+                is_same &= profile.counts.data[ip] == 11 && profile.taken.data[ip] == 1;
+                is_same &= loc.func_index == loop_func.func_index;
+                is_same &= cz.abs_code.data[loop_abs->code_offset + loc.inst_index].inst == abs_inst_JmpGe;
+            }
+            is_same &= exit_count == 1;
+
+            char profile_path[256];
+            test_path(profile_path, sizeof(profile_path), "tests_profile.txt");
+            is_same &= vm_profile_write(&profile, &profile_program, profile_path);
+            is_same &= remove(profile_path) == 0;
+
+            vm_profile_free(&profile);
+        }
+        TEST(is_same);
+    }
+
+    {
+        vm_compiler_t layout_compilers[] = {
+            { .mode = vm_compile_mode_Stack },
+            { .mode = vm_compile_mode_Register },
+            { .mode = vm_compile_mode_Cached },
+            { .disable_fusion = true },
+        };
+
+        b32 is_same  = true;
+        b32 is_fewer = true;
+
+        for (u32 i = 0; i < LENGTH_OF(layout_compilers); ++i) {
+            vm_program_t profiled_program = {0};
+            vm_profile_t profile = {0};
+
+            u32 jmp_code_offset = vm_compile(&profiled_program, layout_compilers + i, &cz, jmp_func);
+            u32 sum_code_offset = vm_compile(&profiled_program, layout_compilers + i, &cz, sum_func);
+
+            // Mostly small inputs, the jump to `__is_small` is the common case.
+            for (i32 a = -50; a < 10; ++a) {
+                run_profiled_int_1(&profiled_program, &thread, &cz, jmp_code_offset, a, &profile);
+            }
+            run_profiled_int_1(&profiled_program, &thread, &cz, sum_code_offset, 20, &profile);
+
+            vm_compiler_t layout_compiler = {
+                .mode           = layout_compilers[i].mode,
+                .disable_fusion = layout_compilers[i].disable_fusion,
+                .layout_profile = &profile,
+                .layout_program = &profiled_program,
+            };
+
+            vm_program_t layout_program = {0};
+            vm_profile_t layout_profile = {0};
+
+            u32 layout_jmp_code_offset = vm_compile(&layout_program, &layout_compiler, &cz, jmp_func);
+            u32 layout_sum_code_offset = vm_compile(&layout_program, &layout_compiler, &cz, sum_func);
+
+            for (i32 a = -50; a < 10; ++a) {
+                is_same &= run_profiled_int_1(&layout_program, &thread, &cz, layout_jmp_code_offset, a, &layout_profile) == (a < 5 ? 0 : 1);
+            }
+            is_same &= run_profiled_int_1(&layout_program, &thread, &cz, layout_sum_code_offset, 20, &layout_profile) == 210;
+
+            for (u32 step = 0; step < 2; ++step) {
+                is_same &= run_int_1(&layout_program, &thread, &cz, layout_jmp_code_offset, 3, step) == 0;
+                is_same &= run_int_1(&layout_program, &thread, &cz, layout_jmp_code_offset, 7, step) == 1;
+                is_same &= run_int_1(&layout_program, &thread, &cz, layout_sum_code_offset, 100, step) == 5050;
+            }
+
+            is_fewer &= profile_jumps(&layout_profile, &layout_program) < profile_jumps(&profile, &profiled_program);
+
+            vm_profile_free(&profile);
+            vm_profile_free(&layout_profile);
+        }
+        TEST(is_same);
+        TEST(is_fewer);
+    }
+
+    {
+        static sampler_t sampler;
+
+        vm_program_t sample_program = {0};
+        u32 sample_sum_code_offset = vm_compile(&sample_program, &compiler, &cz, sum_func);
+
+        TEST(sampler_start(&sampler, &thread, 1000));
+
+        // Until enough ticks landed, however fast the machine.
+        for (u32 i = 0; i < 200000 && sampler.samples.count < 20; ++i) {
+            run_int_1(&sample_program, &thread, &cz, sample_sum_code_offset, 1000, false);
+            sampler_drain(&sampler);
+        }
+
+        sampler_stop(&sampler);
+
+        b32 has_calls = false;
+        b32 is_same   = sampler.samples.count > 0;
+
+        for (u32 i = 0; i < sampler.samples.count; ++i) {
+            sampler_sample_t sample = sampler.samples.data[i];
+
+            has_calls |= sample.depth > 1;
+            for (u32 depth = 0; depth < sample.depth; ++depth) {
+                u32 code_offset = sample_program.ops.data[sample.ops[depth]].code_offset;
+                is_same &= vm_find_abs_loc(&sample_program, code_offset).func_index == sum_func.func_index;
+            }
+        }
+
+        TEST(is_same && has_calls);
+        char folded_path[256];
+        test_path(folded_path, sizeof(folded_path), "tests_profile.folded");
+        TEST(sampler_write_folded(&sampler, &sample_program, &cz, folded_path));
+        TEST(remove(folded_path) == 0);
+
+        sampler_free(&sampler);
+    }
+
+#if defined(JIT_SUPPORTED)
+    func_ref_t deep_func = f_deep_example(&cz);
+    u32 deep_code_offset = vm_compile(&program, &compiler, &cz, deep_func);
+
+    jit_t jit = {0};
+
+    jit_func_t jit_add  = jit_compile(&jit, &cz, add_func);
+    jit_func_t jit_sub  = jit_compile(&jit, &cz, sub_func);
+    jit_func_t jit_jmp  = jit_compile(&jit, &cz, jmp_func);
+    jit_func_t jit_loop = jit_compile(&jit, &cz, loop_func);
+    jit_func_t jit_deep = jit_compile(&jit, &cz, deep_func);
+
+    TEST(run_jit_int_2(&thread, &jit_add, 5, 3) == 8);
+    TEST(run_jit_int_2(&thread, &jit_sub, 5, 3) == run_int_2(&program, &thread, &cz, sub_code_offset, 5, 3, false));
+    TEST(run_jit_int_2(&thread, &jit_sub, -7, 9) == run_int_2(&program, &thread, &cz, sub_code_offset, -7, 9, false));
+
+    TEST(run_jit_int_1(&thread, &jit_jmp, 3) == run_int_1(&program, &thread, &cz, jmp_code_offset, 3, false));
+    TEST(run_jit_int_1(&thread, &jit_jmp, 8) == run_int_1(&program, &thread, &cz, jmp_code_offset, 8, false));
+
+    TEST(run_jit_int_1(&thread, &jit_loop, 0)   == run_int_1(&program, &thread, &cz, loop_code_offset, 0,   false));
+    TEST(run_jit_int_1(&thread, &jit_loop, 100) == run_int_1(&program, &thread, &cz, loop_code_offset, 100, false));
+
+    TEST(run_jit_int_1(&thread, &jit_deep, 4) == run_int_1(&program, &thread, &cz, deep_code_offset, 4, false));
+
+    // No calls left once inlined.
+    jit_func_t jit_twice = jit_compile(&jit, &cz, twice_func);
+    TEST(run_jit_int_1(&thread, &jit_twice, 10) == 100);
+
+    // Still calls itself.
+    TEST(!jit_is_supported(&cz, sum_func) && jit_compile(&jit, &cz, sum_func).entry == NULL);
+
+    jit_free(&jit);
+
+    {
+        vm_program_t trace_program = {0};
+
+        vm_compiler_t trace_compilers[] = {
+            { .mode = vm_compile_mode_Stack },
+            { .mode = vm_compile_mode_Stack, .disable_fusion = true },
+            { .mode = vm_compile_mode_Register },
+            { .mode = vm_compile_mode_Cached },
+        };
+
+        u32 trace_code_offsets[LENGTH_OF(trace_compilers)];
+        for (u32 i = 0; i < LENGTH_OF(trace_compilers); ++i) {
+            trace_code_offsets[i] = vm_compile(&trace_program, trace_compilers + i, &cz, loop_func);
+        }
+
+        tracer_t tracer;
+        tracer_init(&tracer, &trace_program);
+        TEST(tracer_attach(&tracer, &thread));
+
+        b32 is_same = true;
+        for (u32 i = 0; i < LENGTH_OF(trace_compilers); ++i) {
+            // Short runs never get hot, later ones start out in the trace.
+            i32 ns[] = { 0, 10, 1000, 3, 1000 };
+
+            for (u32 j = 0; j < LENGTH_OF(ns); ++j) {
+                is_same &= run_int_1(&trace_program, &thread, &cz, trace_code_offsets[i], ns[j], false)
+                        == ns[j] * (ns[j] - 1) / 2;
+            }
+        }
+        TEST(is_same);
+
+        TEST(tracer.traces.count == LENGTH_OF(trace_compilers));
+        TEST(tracer.entered > 0);
+
+        // The guard recorded in the first half fails for the whole second half, the loop gets recorded again.
+        func_ref_t phase_func = f_phase_example(&cz);
+        u32 phase_code_offset = vm_compile(&trace_program, &compiler, &cz, phase_func);
+
+        u32 trace_count = tracer.traces.count;
+        TEST(run_int_2(&trace_program, &thread, &cz, phase_code_offset, 2000, 1000, false) == 499500 - 1000);
+        TEST(tracer.traces.count == trace_count + 2);
+
+        // The inner loop leaves its trace through the same guard every time the outer loop gets
+        // to it, that's just the loop ending and not a reason to record it again.
+        func_ref_t nested_func = f_nested_example(&cz);
+        u32 nested_code_offset = vm_compile(&trace_program, &compiler, &cz, nested_func);
+
+        trace_count = tracer.traces.count;
+        TEST(run_int_1(&trace_program, &thread, &cz, nested_code_offset, 200, false) == 200 * 199 / 2 * 200);
+        TEST(tracer.traces.count == trace_count + 1);
+
+        tracer_detach(&thread);
+        tracer_free(&tracer);
+    }
+
+    {
+        // Recorded after inlining, so both calls to `loop` stay calls.
+        func_ref_t tier_twice_func = f_twice_example(&cz, loop_func);
+
+        vm_program_t tier_program = {0};
+        u32 tier_twice_code_offset = vm_compile(&tier_program, &compiler, &cz, tier_twice_func);
+        u32 tier_loop_code_offset  = vm_compile(&tier_program, &compiler, &cz, loop_func);
+
+        tier_t tier;
+        tier_init(&tier, &tier_program, &cz);
+        tier.threshold = 16;
+
+        // Stubs compiling under the compiler thread's feet.
+        thread.lazy_compiler = &compiler;
+        TEST(!tier_attach(&tier, &thread));
+        thread.lazy_compiler = NULL;
+
+        TEST(tier_attach(&tier, &thread));
+
+        // `loop` gets hot halfway through, results don't depend on when its native code shows up.
+        b32 is_same = true;
+        for (i32 n = 0; n < 16; ++n) {
+            vm_clear(&thread);
+            VM_PUSH(&thread, i32, &n);
+            tier_execute(&tier, &thread, tier_twice_code_offset);
+            is_same &= *VM_GET(&thread, i32) == n * n;
+        }
+
+        tier_wait(&tier);
+        u64 native_calls = tier.native_calls;
+
+        // Every call of `loop` is native from now on, `twice` has calls and stays interpreted.
+        for (i32 n = 0; n < 16; ++n) {
+            vm_clear(&thread);
+            VM_PUSH(&thread, i32, &n);
+            tier_execute(&tier, &thread, tier_twice_code_offset);
+            is_same &= *VM_GET(&thread, i32) == n * n;
+        }
+        TEST(is_same);
+        TEST(tier.native_calls == native_calls + 2 * 16);
+
+        // Entering it directly runs the same native code the calls do.
+        vm_clear(&thread);
+        VM_PUSH(&thread, i32, &(i32) { 100 });
+        tier_execute(&tier, &thread, tier_loop_code_offset);
+        TEST(*VM_GET(&thread, i32) == 4950);
+        TEST(tier.native_calls == native_calls + 2 * 16 + 1);
+
+        tier_detach(&thread);
+        tier_free(&tier);
+    }
+#endif
+
+    func_ref_t deep_aot_func = f_deep_example(&cz);
+    u32 deep_aot_code_offset = vm_compile(&program, &compiler, &cz, deep_aot_func);
+
+    aot_t aot = {0};
+    TEST(aot_add(&aot, &cz, add_func));
+    TEST(aot_add(&aot, &cz, sub_func));
+    TEST(aot_add(&aot, &cz, jmp_func));
+    TEST(aot_add(&aot, &cz, loop_func));
+    TEST(aot_add(&aot, &cz, deep_aot_func));
+
+    // Still calls itself.
+    TEST(!aot_add(&aot, &cz, sum_func) && aot.funcs.count == 5);
+
+    char aot_c_path[256];
+    char aot_so_path[256];
+    test_path(aot_c_path,  sizeof(aot_c_path),  "tests_aot.c");
+    test_path(aot_so_path, sizeof(aot_so_path), "tests_aot.so");
+
+    TEST(aot_emit(&aot, &cz, aot_c_path));
+    TEST(aot_build(aot_c_path, aot_so_path));
+    TEST(aot_load(&aot, &cz, aot_so_path));
+
+    // Loaded already, the mapping outlives the file.
+    remove(aot_c_path);
+    remove(aot_so_path);
+
+    // Typed entry, inputs as parameters and the outputs as a struct.
+    typedef struct { i32 o0; } (*add_entry_t)(i32, i32);
+    add_entry_t aot_add_entry;
+    void *add_entry = aot_lookup(&aot, add_func)->entry;
+    memcpy(&aot_add_entry, &add_entry, sizeof(add_entry));
+    TEST(aot_add_entry(5, 3).o0 == 8);
+
+    aot_func_t *aot_sub  = aot_lookup(&aot, sub_func);
+    aot_func_t *aot_jmp  = aot_lookup(&aot, jmp_func);
+    aot_func_t *aot_loop = aot_lookup(&aot, loop_func);
+    aot_func_t *aot_deep = aot_lookup(&aot, deep_aot_func);
+
+    vm_clear(&thread);
+    VM_PUSH(&thread, i32, &(i32) { -7 });
+    VM_PUSH(&thread, i32, &(i32) { 9 });
+    aot_execute(aot_sub, &thread);
+    TEST(*VM_GET(&thread, i32) == run_int_2(&program, &thread, &cz, sub_code_offset, -7, 9, false));
+
+    for (i32 n = 0; n < 10; n += 3) {
+        vm_clear(&thread);
+        VM_PUSH(&thread, i32, &n);
+        aot_execute(aot_jmp, &thread);
+        i32 jmp_res = *VM_GET(&thread, i32);
+
+        vm_clear(&thread);
+        VM_PUSH(&thread, i32, &n);
+        aot_execute(aot_loop, &thread);
+        i32 loop_res = *VM_GET(&thread, i32);
+
+        TEST(jmp_res  == run_int_1(&program, &thread, &cz, jmp_code_offset,  n, false));
+        TEST(loop_res == run_int_1(&program, &thread, &cz, loop_code_offset, n, false));
+    }
+
+    vm_clear(&thread);
+    VM_PUSH(&thread, i32, &(i32) { 4 });
+    aot_execute(aot_deep, &thread);
+    TEST(*VM_GET(&thread, i32) == run_int_1(&program, &thread, &cz, deep_aot_code_offset, 4, false));
+
+    aot_free(&aot);
+    vm_thread_free(&thread);
+
+    TEST(rmdir(test_dir) == 0);
+
     printf("\\_/\n V\n");
     return 0;
 }
@@ -0,0 +1,214 @@
+#include "tier.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Programs grow as functions get compiled, new functions start out cold.
+#define TIER_GROW(m_array, m_count) \
+do { \
+    if ((m_array).count < (m_count)) { \
+        u32 amount_ = (m_count) - (m_array).count; \
+        dck_stretchy_reserve((m_array), amount_); \
+        memset((m_array).data + (m_array).count, 0, amount_ * sizeof(*(m_array).data)); \
+        (m_array).count = (m_count); \
+    } \
+} while (0)
+
+static void *
+tier_compiler_main(void *arg)
+{
+    tier_t *tier = arg;
+
+    pthread_mutex_lock(&tier->lock);
+
+    for (;;) {
+        while (tier->queue_head == tier->queue.count && !tier->quit) {
+            pthread_cond_wait(&tier->wake, &tier->lock);
+        }
+        if (tier->quit)
+            break;
+
+        tier_native_t *native = tier->queue.data[tier->queue_head++];
+        tier->is_compiling = true;
+
+        pthread_mutex_unlock(&tier->lock);
+
+        native->func = jit_compile(&tier->jit, tier->cz, native->func_ref);
+        atomic_store_explicit(&native->is_ready, true, memory_order_release);
+
+        pthread_mutex_lock(&tier->lock);
+
+        tier->is_compiling = false;
+        if (tier->queue_head == tier->queue.count) {
+            pthread_cond_broadcast(&tier->idle);
+        }
+    }
+
+    pthread_mutex_unlock(&tier->lock);
+    return NULL;
+}
+
+// Counts a call of the function starting at op `target`, returns its native code once there is some.
+static tier_native_t *
+tier_count(tier_t *tier, u32 target)
+{
+    const vm_program_t *program = tier->program;
+
+    TIER_GROW(tier->counts,  program->ops.count);
+    TIER_GROW(tier->natives, program->ops.count);
+
+    tier_native_t *native = tier->natives.data[target];
+    if (native)
+        return atomic_load_explicit(&native->is_ready, memory_order_acquire) ? native : NULL;
+
+    u32 *count = tier->counts.data + target;
+    if (*count >= tier->threshold || ++(*count) < tier->threshold)
+        return NULL;
+
+    // Calls through a `vm_inst_Stub` don't go to a function yet.
+    const vm_function_t *function = vm_find_function(program, program->ops.data[target].code_offset);
+    if (function == NULL || !jit_is_supported(tier->cz, function->func_ref))
+        return NULL;
+
+    native = calloc(1, sizeof(tier_native_t));
+    if (native == NULL) {
+        fprintf(stderr, "%s:%d: calloc failure! exiting...\n", __FILE__, __LINE__);
+        exit(666);
+    }
+
+    native->func_ref = function->func_ref;
+    atomic_init(&native->is_ready, false);
+
+    tier->natives.data[target] = native;
+
+    pthread_mutex_lock(&tier->lock);
+    dck_stretchy_push(tier->queue, native);
+    pthread_cond_signal(&tier->wake);
+    pthread_mutex_unlock(&tier->lock);
+
+    // Still interpreted this time around.
+    return NULL;
+}
+
+static b32
+tier_call(void *context, const vm_program_t *program, vm_thread_t *thread, u32 target)
+{
+    tier_t *tier = context;
+    ASSERT(program == tier->program);
+    ASSERT(thread->lazy_compiler == NULL); // See `tier_attach`.
+    (void)program;
+
+    tier_native_t *native = tier_count(tier, target);
+    if (native == NULL)
+        return false;
+
+    // The arguments are at the start of the frame, everything past them belongs to the callee.
+    u32 bp = thread->bp;
+    thread->memory.count = bp;
+    dck_stretchy_reserve(thread->memory, native->func.frame_size);
+
+    native->func.entry(thread->memory.data + bp);
+
+    tier->native_calls += 1;
+    return true;
+}
+
+void
+tier_init(tier_t *tier, const vm_program_t *program, cz_t *cz)
+{
+    *tier = (tier_t) {0};
+
+    tier->program   = program;
+    tier->cz        = cz;
+    tier->threshold = TIER_HOT_CALLS;
+
+    pthread_mutex_init(&tier->lock, NULL);
+    pthread_cond_init(&tier->wake, NULL);
+    pthread_cond_init(&tier->idle, NULL);
+
+    if (pthread_create(&tier->handle, NULL, tier_compiler_main, tier) != 0) {
+        fprintf(stderr, "%s:%d: pthread_create failure! exiting...\n", __FILE__, __LINE__);
+        exit(666);
+    }
+}
+
+b32
+tier_attach(tier_t *tier, vm_thread_t *thread)
+{
+    // Its stubs would `vm_compile` into `cz` while the compiler thread reads it.
+    if (thread->lazy_compiler)
+        return false;
+
+#if defined(JIT_SUPPORTED)
+    thread->call         = tier_call;
+    thread->call_context = tier;
+    return true;
+#else
+    (void)tier;
+    (void)thread;
+    return false;
+#endif
+}
+
+void
+tier_detach(vm_thread_t *thread)
+{
+    thread->call         = NULL;
+    thread->call_context = NULL;
+}
+
+void
+tier_execute(tier_t *tier, vm_thread_t *thread, u32 code_offset)
+{
+    const vm_program_t *program = tier->program;
+
+    ASSERT(code_offset < program->code_ops.count);
+    u32 op_index = program->code_ops.data[code_offset];
+    ASSERT(op_index != CZ_NO_ID);
+
+    tier_native_t *native = tier_count(tier, op_index);
+    if (native) {
+        jit_execute(&native->func, thread);
+        tier->native_calls += 1;
+        return;
+    }
+
+    vm_execute(program, thread, tier->cz, code_offset);
+}
+
+void
+tier_wait(tier_t *tier)
+{
+    pthread_mutex_lock(&tier->lock);
+    while (tier->queue_head != tier->queue.count || tier->is_compiling) {
+        pthread_cond_wait(&tier->idle, &tier->lock);
+    }
+    pthread_mutex_unlock(&tier->lock);
+}
+
+void
+tier_free(tier_t *tier)
+{
+    pthread_mutex_lock(&tier->lock);
+    tier->quit = true;
+    pthread_cond_broadcast(&tier->wake);
+    pthread_mutex_unlock(&tier->lock);
+
+    pthread_join(tier->handle, NULL);
+
+    jit_free(&tier->jit);
+
+    for (u32 i = 0; i < tier->natives.count; ++i) {
+        free(tier->natives.data[i]);
+    }
+
+    free(tier->counts.data);
+    free(tier->natives.data);
+    free(tier->queue.data);
+
+    pthread_mutex_destroy(&tier->lock);
+    pthread_cond_destroy(&tier->wake);
+    pthread_cond_destroy(&tier->idle);
+
+    *tier = (tier_t) {0};
+}
@@ -0,0 +1,89 @@
+#ifndef TIER_H_
+#define TIER_H_
+
+#include "metacz.h"
+#include "interpreter.h"
+#include "jit.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Tiered execution. Functions start out in the bytecode `vm_compile` made for them and every call
+ * is counted, once a function is hot it gets queued for `jit_compile` on a background thread.
+ * Calls switch to the native code as soon as it is published, the interpreter never waits for it.
+ * Only what `jit_is_supported` takes moves up, the rest keeps running interpreted.
+ * Tail calls and `vm_step` always stay in the bytecode.
+ */
+
+// Calls before a function gets queued.
+#define TIER_HOT_CALLS 256
+
+// Native code of one function, the compiler thread fills it in.
+typedef struct
+{
+    func_ref_t func_ref;
+    jit_func_t func;
+
+    // Set with release ordering once `func` is complete.
+    atomic_bool is_ready;
+} tier_native_t;
+
+/* One per thread running the program, the counts aren't shared.
+ * Must not move after `tier_init`, the compiler thread points back to it.
+ * The compiler thread reads `cz`, nothing may be recorded or `vm_compile`d into it until `tier_wait`.
+ */
+typedef struct
+{
+    const vm_program_t *program;
+    cz_t *cz;
+
+    u32 threshold;
+
+    // Both indexed by the op index functions start at, like `vm_op_t.call.target`.
+    // Counts stop at `threshold`, past it a function is either queued or can't be compiled.
+    dck_stretchy_t (u32,             u32) counts;
+    dck_stretchy_t (tier_native_t *, u32) natives;
+
+    pthread_t handle;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    pthread_cond_t  idle;
+
+    // Everything below up to `jit` is guarded by `lock`, the thread takes from `queue_head` on.
+    dck_stretchy_t (tier_native_t *, u32) queue;
+    u32 queue_head;
+    b32 is_compiling;
+    b32 quit;
+
+    // Only the compiler thread touches it.
+    jit_t jit;
+
+    // Calls, entries included, that ran native code.
+    u64 native_calls;
+} tier_t;
+
+void
+tier_init(tier_t *tier, const vm_program_t *program, cz_t *cz);
+
+/* False where there is no native backend or the thread has a `lazy_compiler`, it then runs as before.
+ * Don't set one on the thread until `tier_detach`.
+ */
+b32
+tier_attach(tier_t *tier, vm_thread_t *thread);
+
+void
+tier_detach(vm_thread_t *thread);
+
+// Same as `vm_execute`, entering the function counts as a call to it.
+void
+tier_execute(tier_t *tier, vm_thread_t *thread, u32 code_offset);
+
+// Blocks until everything queued so far is compiled.
+void
+tier_wait(tier_t *tier);
+
+void
+tier_free(tier_t *tier);
+
+#endif // TIER_H_
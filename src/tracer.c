@@ -0,0 +1,184 @@
+#include "tracer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Programs grow as functions get compiled, new ops start out cold.
+#define TRACER_GROW(m_array, m_count) \
+do { \
+    if ((m_array).count < (m_count)) { \
+        u32 amount_ = (m_count) - (m_array).count; \
+        dck_stretchy_reserve((m_array), amount_); \
+        memset((m_array).data + (m_array).count, 0, amount_ * sizeof(*(m_array).data)); \
+        (m_array).count = (m_count); \
+    } \
+} while (0)
+
+static u32
+tracer_enter(tracer_t *tracer, vm_thread_t *thread, u32 header, const tracer_trace_t *trace)
+{
+    u32 bp = thread->bp;
+
+    if (thread->memory.count - bp != trace->header_sp)
+        return header;
+
+    // Nothing in the trace grows the stack, it all has to be there up front.
+    u32 end = bp + trace->native.max_sp;
+    if (end > thread->memory.count) {
+        dck_stretchy_reserve(thread->memory, end - thread->memory.count);
+    }
+
+    jit_trace_result_t result = trace->native.entry(thread->memory.data + bp, &thread->registers);
+    ASSERT(result.exit_index < trace->native.exit_count);
+
+    u32 exit_offset = trace->native.exit_offset + result.exit_index;
+
+    jit_trace_exit_t trace_exit = tracer->jit.trace_exits.data[exit_offset];
+    thread->memory.count = bp + trace_exit.sp;
+
+    tracer->entered += 1;
+
+    // Leaving after some iterations is just the loop ending, only exits before the first one
+    // completes mean the recorded path doesn't fit anymore.
+    if (result.iterations > 0)
+        return trace_exit.op_index;
+
+    TRACER_GROW(tracer->exit_counts, tracer->jit.trace_exits.count);
+    if (++(tracer->exit_counts.data[exit_offset]) == tracer->threshold
+        && tracer->retraces.data[header] < TRACER_MAX_RETRACES) {
+        tracer->retraces.data[header] += 1;
+        tracer->trace_of.data[header] = 0;
+        tracer->counts.data[header]   = 0;
+    }
+
+    return trace_exit.op_index;
+}
+
+/* Steps through one iteration starting at `header`, which the interpreter just jumped to.
+ * The thread ends up wherever the recording stopped, the interpreter carries on from there.
+ */
+static u32
+tracer_record(tracer_t *tracer, const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 header)
+{
+    const vm_op_t *ops = program->ops.data;
+
+    u32 header_sp = thread->memory.count - thread->bp;
+    b32 is_closed = false;
+
+    tracer->steps.count = 0;
+    thread->ip = ops[header].code_offset;
+
+    while (tracer->steps.count < TRACER_MAX_STEPS) {
+        u32 op_index = program->code_ops.data[thread->ip];
+        vm_inst_t inst = ops[op_index].inst;
+
+        // A trace runs in a single frame.
+        if (inst == vm_inst_Halt || inst == vm_inst_Call || inst == vm_inst_TailCall || inst == vm_inst_Ret)
+            break;
+
+        vm_step(program, thread, cz);
+
+        u32 next = program->code_ops.data[thread->ip];
+
+        jit_trace_step_t step = {
+            .op_index = op_index,
+            .taken    = next != op_index + 1,
+        };
+        dck_stretchy_push(tracer->steps, step);
+
+        if (next == header) {
+            is_closed = true;
+            break;
+        }
+
+        // Some inner loop, it gets a trace of its own.
+        if (next <= op_index)
+            break;
+    }
+
+    if (is_closed) {
+        tracer_trace_t trace = { .header_sp = header_sp };
+
+        if (jit_compile_trace(&tracer->jit, program, tracer->steps.data, tracer->steps.count, header_sp,
+                              &trace.native)) {
+            dck_stretchy_push(tracer->traces, trace);
+            tracer->trace_of.data[header] = tracer->traces.count;
+
+            return tracer_enter(tracer, thread, header, tracer->traces.data + tracer->traces.count - 1);
+        }
+    }
+
+    tracer->is_rejected.data[header] = true;
+
+    return program->code_ops.data[thread->ip];
+}
+
+static u32
+tracer_back_edge(void *context, const vm_program_t *program, vm_thread_t *thread, cz_t *cz, u32 target)
+{
+    tracer_t *tracer = context;
+    ASSERT(program == tracer->program);
+
+    TRACER_GROW(tracer->counts,      program->ops.count);
+    TRACER_GROW(tracer->trace_of,    program->ops.count);
+    TRACER_GROW(tracer->is_rejected, program->ops.count);
+    TRACER_GROW(tracer->retraces,    program->ops.count);
+
+    u32 trace_index = tracer->trace_of.data[target];
+    if (trace_index != 0)
+        return tracer_enter(tracer, thread, target, tracer->traces.data + trace_index - 1);
+
+    if (tracer->is_rejected.data[target])
+        return target;
+
+    if (++(tracer->counts.data[target]) < tracer->threshold)
+        return target;
+
+    return tracer_record(tracer, program, thread, cz, target);
+}
+
+void
+tracer_init(tracer_t *tracer, const vm_program_t *program)
+{
+    *tracer = (tracer_t) {0};
+
+    tracer->program   = program;
+    tracer->threshold = TRACER_HOT_LOOP;
+}
+
+b32
+tracer_attach(tracer_t *tracer, vm_thread_t *thread)
+{
+#if defined(JIT_SUPPORTED)
+    thread->back_edge         = tracer_back_edge;
+    thread->back_edge_context = tracer;
+    return true;
+#else
+    (void)tracer;
+    (void)thread;
+    return false;
+#endif
+}
+
+void
+tracer_detach(vm_thread_t *thread)
+{
+    thread->back_edge         = NULL;
+    thread->back_edge_context = NULL;
+}
+
+void
+tracer_free(tracer_t *tracer)
+{
+    jit_free(&tracer->jit);
+
+    free(tracer->counts.data);
+    free(tracer->trace_of.data);
+    free(tracer->is_rejected.data);
+    free(tracer->retraces.data);
+    free(tracer->traces.data);
+    free(tracer->exit_counts.data);
+    free(tracer->steps.data);
+
+    *tracer = (tracer_t) {0};
+}
@@ -0,0 +1,67 @@
+#ifndef TRACER_H_
+#define TRACER_H_
+
+#include "metacz.h"
+#include "interpreter.h"
+#include "jit.h"
+
+/*
+ * Tracing for hot loops. Taken backward jumps are counted per loop header, once one is hot
+ * a single iteration is recorded by stepping and compiled to native code with `jit_compile_trace`.
+ * Later iterations run in the trace until a guard fails and the interpreter takes over again.
+ * Time spent in traces doesn't show up in `VM_STATS` counts.
+ */
+
+// Iterations before a loop gets recorded.
+#define TRACER_HOT_LOOP 64
+// Longer recordings give up, inner loops that didn't get a trace of their own end up here.
+#define TRACER_MAX_STEPS 512
+// Times a loop is recorded again once one guard keeps failing, the branch changed direction for good.
+#define TRACER_MAX_RETRACES 3
+
+typedef struct
+{
+    jit_trace_t native;
+    // Stack offset from `bp` at the header, the trace only fits where the recording started.
+    u32 header_sp;
+} tracer_trace_t;
+
+// One per thread, the traces are specialised to the program it was made for.
+typedef struct
+{
+    const vm_program_t *program;
+    jit_t jit;
+
+    u32 threshold;
+
+    // All indexed by op index of the loop header.
+    dck_stretchy_t (u32, u32) counts;
+    // Trace index + 1, 0 for none yet.
+    dck_stretchy_t (u32, u32) trace_of;
+    // Headers that couldn't be traced, not counted anymore.
+    dck_stretchy_t (b32, u32) is_rejected;
+    dck_stretchy_t (u32, u32) retraces;
+
+    dck_stretchy_t (tracer_trace_t, u32) traces;
+    // Indexed like `jit_t.trace_exits`, only exits before an iteration completed count.
+    dck_stretchy_t (u32, u32) exit_counts;
+
+    dck_stretchy_t (jit_trace_step_t, u32) steps;
+
+    u64 entered;
+} tracer_t;
+
+void
+tracer_init(tracer_t *tracer, const vm_program_t *program);
+
+// False where there is no native backend, the thread then runs as before.
+b32
+tracer_attach(tracer_t *tracer, vm_thread_t *thread);
+
+void
+tracer_detach(vm_thread_t *thread);
+
+void
+tracer_free(tracer_t *tracer);
+
+#endif // TRACER_H_